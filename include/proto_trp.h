@@ -66,13 +66,28 @@ enum {
 		 * no response from the receiver is necessary nor expected. */
 	trp_sack = 0x5000,
 		/**< This packet is a selective acknowledgement that contains
-		 * no data.  Rather, the psn and ack_psn fields indicate the
-		 * minimum and (maximum + 1) sequence numbers, respectively, in
-		 * a contiguous range that have been received. */
+		 * no data.  The ack_psn field is the cumulative
+		 * acknowledgement as in any other packet, and the header is
+		 * followed by a struct trp_sack listing up to
+		 * TRP_SACK_RANGES_MAX ranges of sequence numbers beyond ack_psn
+		 * that have been received. */
+	trp_coalesced = 0x6000,
+		/**< This packet carries one or more DDP segments, each preceded
+		 * by its length in bytes as a 16-bit integer in network byte
+		 * order.  The segments are placed in order and are
+		 * acknowledged together under this packet's PSN.  Only sent
+		 * if both ends set trp_rr_coalesce during connection
+		 * setup. */
 	trp_opcode_mask = 0xf000,
 		/**< Mask of all bits used for opcode. */
-	trp_reserved_mask = 0x0fff,
-		/**< Mask of all bits not currently used. */
+	trp_ecn_echo = 0x0800,
+		/**< The sender of this packet has received a datagram marked
+		 * Congestion Experienced since it last set this flag.  Only
+		 * sent if both ends set trp_rr_ecn during connection setup. */
+	trp_credits_mask = 0x07ff,
+		/**< Mask of the Credits field, which is the number of packets
+		 * following ack_psn that the receiver of this packet may send
+		 * to us. */
 	trp_opcode_shift = 12,
 		/**< Number of bits that opcode is shifted by. */
 };
@@ -83,10 +98,43 @@ struct trp_hdr {
 	uint16_t opcode;
 } __attribute__((__packed__));
 
+enum {
+	TRP_SACK_RANGES_MAX = 16,
+		/**< Maximum number of ranges in a single trp_sack packet. */
+};
+
+struct trp_sack_range {
+	uint32_t min;
+		/**< The first sequence number received in this range. */
+	uint32_t max;
+		/**< One past the last sequence number received in this
+		 * range. */
+} __attribute__((__packed__));
+
+struct trp_sack {
+	uint16_t range_count;
+	uint16_t reserved;
+	struct trp_sack_range range[];
+} __attribute__((__packed__));
+
+enum {
+	trp_rr_coalesce = 0x0001,
+		/**< The sender can receive trp_coalesced packets.  In a
+		 * trp_accept, this is only set if it was also set in the
+		 * trp_req, and indicates that both ends may send
+		 * trp_coalesced packets. */
+	trp_rr_ecn = 0x0002,
+		/**< The sender marks its DDP segments ECN-capable and echoes
+		 * Congestion Experienced marks with trp_ecn_echo.  As with
+		 * trp_rr_coalesce, only used if both ends set it. */
+};
+
 struct trp_rr_params {
 	uint16_t pd_len;
 	uint16_t ird;
 	uint16_t ord;
+	uint16_t features;
+		/**< Bitwise OR of trp_rr_* feature flags. */
 } __attribute__((__packed__));
 
 struct trp_rr {
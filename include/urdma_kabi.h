@@ -62,6 +62,10 @@ struct urdma_uresp_create_cq {
 	uint32_t	cq_id;
 };
 
+struct urdma_uresp_create_srq {
+	uint32_t	srq_id;
+};
+
 struct urdma_udata_create_qp {
 	uint32_t	ord_max;
 	uint32_t	ird_max;
@@ -69,6 +73,7 @@ struct urdma_udata_create_qp {
 	uint16_t	urdmad_qp_id;
 	uint16_t	rxq;
 	uint16_t	txq;
+	uint16_t	features;
 };
 
 struct urdma_uresp_create_qp {
@@ -85,6 +90,11 @@ struct urdma_cq_event {
 	uint32_t	cq_id;
 };
 
+struct urdma_srq_event {
+	uint32_t	event_type;
+	uint32_t	srq_id;
+};
+
 struct urdma_qp_connected_event {
 	uint32_t	event_type;
 	uint32_t	kmod_qp_id;
@@ -99,6 +109,7 @@ struct urdma_qp_connected_event {
 	uint8_t		ird_max;
 	uint16_t	rxq;
 	uint16_t	txq;
+	uint16_t	features;
 };
 
 struct urdma_qp_disconnected_event {
@@ -132,6 +143,11 @@ enum urdma_event_type {
 	SIW_EVENT_QP_DISCONNECTED = 3,
 		/**< Sent from the kernel to userspace to indicate that a
 		 * connection has been torn down. */
+	SIW_EVENT_SRQ_LIMIT_REACHED = 4,
+		/**< Sent from userspace to the kernel to indicate that the
+		 * number of WQEs in the shared receive queue dropped below its
+		 * limit, so that the kernel can raise the asynchronous
+		 * event. */
 };
 
 #endif
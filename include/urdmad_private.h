@@ -49,6 +49,10 @@
 #include <rte_ether.h>
 #include <rte_spinlock.h>
 
+#define URDMAD_MAX_QUEUES 32
+	/**< Maximum number of hardware queues per port, including queue 0
+	 * which carries traffic for the KNI interface. */
+
 /** Internal state machine of the queue pair. */
 enum urdma_qp_state {
 	usiw_qp_unbound = 0,
@@ -63,6 +67,14 @@ enum urdma_qp_state {
 		/**< Queue pair has been invalidated. */
 };
 
+/** Flags describing how urdmad assigned hardware queues to a queue pair. */
+enum urdmad_qp_flags {
+	urdmad_qp_shared_queue = 1,
+		/**< rx_queue and tx_queue are shared with other queue pairs
+		 * of the same process; received datagrams must be
+		 * demultiplexed by destination UDP port. */
+};
+
 /** Fields of the queue pair that must be accessible from urdmad and verbs
  * processes. */
 struct urdmad_qp {
@@ -85,6 +97,9 @@ struct urdmad_qp {
 		/**< Hardware receive queue to use for this queue pair. */
 	uint16_t tx_queue;
 		/**< Hardware transmit queue to use for this queue pair. */
+	uint16_t flags;
+		/**< urdmad_qp_flags; assigned along with rx_queue and
+		 * tx_queue. */
 	uint16_t local_udp_port;
 		/**< UDP port assigned to local endpoint. */
 	uint16_t remote_udp_port;
@@ -100,6 +115,9 @@ struct urdmad_qp {
 		/**< Hardware receive descriptors on this RX queue. */
 	uint16_t mtu;
 		/**< Device MTU. */
+	uint16_t features;
+		/**< trp_rr_* flags requested by the verbs process, replaced by
+		 * the flags agreed on with the peer once connected. */
 
 	LIST_ENTRY(urdmad_qp) urdmad__entry;
 		/**< Private field used only by urdmad to thread onto list. */
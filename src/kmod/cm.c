@@ -549,6 +549,7 @@ static int siw_proc_trpreq(struct siw_cep *cep)
 	cep->state = SIW_EPSTATE_RECVD_MPAREQ;
 	cep->ird = ntohs(req->params.ord);
 	cep->ord = ntohs(req->params.ird);
+	cep->features = ntohs(req->params.features);
 	pr_debug(DBG_CM "(cep=0x%p): recved TRP Request ORD: %d (max: %d), IRD: %d (max: %d)\n",
 			cep, cep->ord, cep->sdev->attrs.max_ord,
 			cep->ird, cep->sdev->attrs.max_ird);
@@ -614,6 +615,7 @@ static int siw_proc_trpreply(struct siw_cep *cep)
 	qp_attrs.irq_size = min(htons(rep->params.ord), qp->attrs.irq_size);
 	qp_attrs.orq_size = max(htons(rep->params.ird), qp->attrs.orq_size);
 	qp_attrs.llp_stream_handle = cep->llp.sock;
+	qp->attrs.urdma_features &= ntohs(rep->params.features);
 	qp_attrs.state = SIW_QP_STATE_RTS;
 
 	if (s->type == SOCK_DGRAM) {
@@ -1175,6 +1177,7 @@ int siw_connect(struct iw_cm_id *id, struct iw_cm_conn_param *params)
 	cep->mpa.hdr.hdr.opcode = htons(trp_req);
 	cep->mpa.hdr.params.ird = htons(cep->ird);
 	cep->mpa.hdr.params.ord = htons(cep->ord);
+	cep->mpa.hdr.params.features = htons(qp->attrs.urdma_features);
 
 	rv = siw_send_trpreqrep(cep, params->private_data, pd_len);
 	/*
@@ -1271,6 +1274,8 @@ int siw_qp_rtr(struct siw_cep *cep)
 		cep->mpa.hdr.hdr.opcode = htons(trp_accept);
 		cep->mpa.hdr.params.ird = htons(cep->qp->attrs.irq_size);
 		cep->mpa.hdr.params.ord = htons(cep->qp->attrs.orq_size);
+		cep->mpa.hdr.params.features
+			= htons(cep->qp->attrs.urdma_features);
 		rv = siw_send_trpreqrep(cep, cep->mpa.send_pdata,
 					cep->mpa.send_pdata_size);
 
@@ -1417,6 +1422,9 @@ int siw_accept(struct iw_cm_id *id, struct iw_cm_conn_param *params)
 	/* siw_qp_get(qp) already done by QP lookup */
 	cep->qp = qp;
 
+	/* Only use features that both sides support */
+	qp->attrs.urdma_features &= cep->features;
+
 	cep->state = SIW_EPSTATE_RDMA_MODE;
 
 	rv = s->ops->connect(s, (struct sockaddr *)&cep->llp.raddr,
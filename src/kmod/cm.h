@@ -120,6 +120,7 @@ struct siw_cep {
 	uint16_t		urdmad_qp_id;
 	uint16_t		ord;
 	uint16_t		ird;
+	uint16_t		features; /* peer trp_rr_* flags */
 	int			sk_error; /* not (yet) used XXX */
 };
 
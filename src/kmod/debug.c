@@ -219,7 +219,7 @@ static ssize_t siw_show_stats(struct file *f, char __user *buf, size_t space,
 
 	len =  snprintf(kbuf, space, "Allocated SIW Objects:\n"
 		"Device %s (%s):\t"
-		"%s: %d, %s %d, %s: %d, %s: %d, %s: %d\n",
+		"%s: %d, %s %d, %s: %d, %s: %d, %s: %d, %s: %d\n",
 		sdev->ofa_dev.name,
 		(sdev->netdev && (sdev->netdev->flags & IFF_UP))
 				? "IFF_UP" : "IFF_DOWN",
@@ -227,6 +227,7 @@ static ssize_t siw_show_stats(struct file *f, char __user *buf, size_t space,
 		"PDs", atomic_read(&sdev->num_pd),
 		"QPs", atomic_read(&sdev->num_qp),
 		"CQs", atomic_read(&sdev->num_cq),
+		"SRQs", atomic_read(&sdev->num_srq),
 		"CEPs", atomic_read(&sdev->num_cep));
 	if (len > space)
 		len = space;
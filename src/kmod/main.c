@@ -223,6 +223,7 @@ static ssize_t do_read_established_event(struct urdma_chardev_data *file,
 	event.ird_max = cep->qp->attrs.irq_size;
 	event.rxq = cep->qp->attrs.urdma_rxq;
 	event.txq = cep->qp->attrs.urdma_txq;
+	event.features = cep->qp->attrs.urdma_features;
 
 	netdev = cep->sdev->netdev;
 	dev_hold(netdev);
@@ -451,6 +452,7 @@ static void siw_device_deregister(struct siw_dev *sdev)
 	WARN_ON(atomic_read(&sdev->num_qp));
 	WARN_ON(atomic_read(&sdev->num_cq));
 	WARN_ON(atomic_read(&sdev->num_pd));
+	WARN_ON(atomic_read(&sdev->num_srq));
 	WARN_ON(atomic_read(&sdev->num_cep));
 
 	i = 0;
@@ -579,7 +581,9 @@ static struct siw_dev *siw_device_create(struct net_device *netdev)
 	    (1ull << IB_USER_VERBS_CMD_CREATE_QP) |
 	    (1ull << IB_USER_VERBS_CMD_QUERY_QP) |
 	    (1ull << IB_USER_VERBS_CMD_MODIFY_QP) |
-	    (1ull << IB_USER_VERBS_CMD_DESTROY_QP);
+	    (1ull << IB_USER_VERBS_CMD_DESTROY_QP) |
+	    (1ull << IB_USER_VERBS_CMD_CREATE_SRQ) |
+	    (1ull << IB_USER_VERBS_CMD_DESTROY_SRQ);
 
 	ofa_dev->node_type = RDMA_NODE_RNIC;
 	memcpy(ofa_dev->node_desc, URDMA_NODE_DESC, sizeof(URDMA_NODE_DESC));
@@ -668,6 +672,7 @@ static struct siw_dev *siw_device_create(struct net_device *netdev)
 	sdev->attrs.cap_flags = 0;
 	sdev->attrs.max_cq = SIW_MAX_CQ;
 	sdev->attrs.max_pd = SIW_MAX_PD;
+	sdev->attrs.max_srq = SIW_MAX_SRQ;
 
 	siw_idr_init(sdev);
 	INIT_LIST_HEAD(&sdev->cep_list);
@@ -676,6 +681,7 @@ static struct siw_dev *siw_device_create(struct net_device *netdev)
 	atomic_set(&sdev->num_qp, 0);
 	atomic_set(&sdev->num_cq, 0);
 	atomic_set(&sdev->num_pd, 0);
+	atomic_set(&sdev->num_srq, 0);
 	atomic_set(&sdev->num_cep, 0);
 
 	sdev->is_registered = 0;
@@ -84,13 +84,16 @@ extern void siw_idr_release(struct siw_dev *);
 
 extern struct siw_cq *siw_cq_id2obj(struct siw_dev *, int);
 extern struct siw_qp *siw_qp_id2obj(struct siw_dev *, int);
+extern struct siw_srq *siw_srq_id2obj(struct siw_dev *, int);
 
 extern int siw_qp_add(struct siw_dev *, struct siw_qp *);
 extern int siw_cq_add(struct siw_dev *, struct siw_cq *);
 extern int siw_pd_add(struct siw_dev *, struct siw_pd *);
+extern int siw_srq_add(struct siw_dev *, struct siw_srq *);
 
 extern void siw_cq_put(struct siw_cq *);
 extern void siw_qp_put(struct siw_qp *);
 extern void siw_pd_put(struct siw_pd *);
+extern void siw_srq_put(struct siw_srq *);
 
 #endif
@@ -54,6 +54,7 @@
 #define SIW_MAX_ORD		128
 #define SIW_MAX_IRD		128
 #define SIW_MAX_CQ		(1024 * 100)
+#define SIW_MAX_SRQ		(1024 * 100)
 #define SIW_MAX_PD		SIW_MAX_QP
 #define SIW_MAX_CONTEXT		(SIW_MAX_PD * 10)
 
@@ -73,6 +74,7 @@ struct siw_devinfo {
 	enum ib_device_cap_flags	cap_flags;
 	int			max_cq;
 	int			max_pd;
+	int			max_srq;
 	/* end ib_device_attr */
 };
 
@@ -101,11 +103,13 @@ struct siw_dev {
 	struct idr		qp_idr;
 	struct idr		cq_idr;
 	struct idr		pd_idr;
+	struct idr		srq_idr;
 
 	/* active objects statistics */
 	atomic_t		num_qp;
 	atomic_t		num_cq;
 	atomic_t		num_pd;
+	atomic_t		num_srq;
 	atomic_t		num_cep;
 	atomic_t		num_ctx;
 
@@ -139,6 +143,14 @@ struct siw_cq {
 	struct siw_objhdr	hdr;
 };
 
+/* The receive WQEs of a shared receive queue live entirely in userspace; the
+ * kernel object exists so that queue pairs can refer to it and so that the
+ * SRQ limit event can be delivered. */
+struct siw_srq {
+	struct ib_srq		ofa_srq;
+	struct siw_objhdr	hdr;
+};
+
 enum siw_qp_state {
 	SIW_QP_STATE_IDLE	= 0,
 	SIW_QP_STATE_RTR	= 1,
@@ -184,6 +196,7 @@ struct siw_qp_attrs {
 	u16			urdma_qp_id;
 	u16			urdma_rxq;
 	u16			urdma_txq;
+	u16			urdma_features; /* trp_rr_* flags */
 	enum siw_qp_flags	flags;
 
 	struct socket		*llp_stream_handle;
@@ -225,6 +238,7 @@ enum siw_qp_state siw_map_ibstate(enum ib_qp_state);
 /* RDMA core event dipatching */
 void siw_qp_event(struct siw_qp *, enum ib_event_type);
 void siw_cq_event(struct siw_cq *, enum ib_event_type);
+void siw_srq_event(struct siw_srq *, enum ib_event_type);
 void siw_port_event(struct siw_dev *, u8, enum ib_event_type);
 
 
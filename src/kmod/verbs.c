@@ -108,7 +108,9 @@ static ssize_t siw_event_file_write(struct file *filp, const char __user *buf,
 	struct siw_event_file *file;
 	struct urdma_event_storage event;
 	struct urdma_cq_event *cq_event;
+	struct urdma_srq_event *srq_event;
 	struct siw_cq *cq;
+	struct siw_srq *srq;
 	ssize_t rv;
 
 	if (count > sizeof(event)) {
@@ -137,6 +139,20 @@ static ssize_t siw_event_file_write(struct file *filp, const char __user *buf,
 		cq->ofa_cq.comp_handler(&cq->ofa_cq, cq->ofa_cq.cq_context);
 		siw_cq_put(cq);
 		break;
+	case SIW_EVENT_SRQ_LIMIT_REACHED:
+		if (count != sizeof(*srq_event)) {
+			rv = -EINVAL;
+			goto out;
+		}
+		srq_event = (struct urdma_srq_event *)&event;
+		srq = siw_srq_id2obj(file->ctx->sdev, srq_event->srq_id);
+		if (!srq) {
+			rv = -EINVAL;
+			goto out;
+		}
+		siw_srq_event(srq, IB_EVENT_SRQ_LIMIT_REACHED);
+		siw_srq_put(srq);
+		break;
 	default:
 		pr_debug(" got invalid event type %u\n", event.event_type);
 		rv = -EINVAL;
@@ -293,6 +309,7 @@ int siw_query_device(struct ib_device *ofa_dev, struct ib_device_attr *attr,
 	attr->device_cap_flags = sdev->attrs.cap_flags;
 	attr->max_cq = sdev->attrs.max_cq;
 	attr->max_pd = sdev->attrs.max_pd;
+	attr->max_srq = sdev->attrs.max_srq;
 
 	return 0;
 }
@@ -518,12 +535,6 @@ struct ib_qp *siw_create_qp(struct ib_pd *ofa_pd,
 		rv = -EINVAL;
 		goto err_out;
 	}
-	if (attrs->srq) {
-		pr_debug(": SRQ is not supported\n");
-		rv = -EINVAL;
-		goto err_out;
-	}
-
 	scq = siw_cq_id2obj(sdev, ((struct siw_cq *)attrs->send_cq)->hdr.id);
 	rcq = siw_cq_id2obj(sdev, ((struct siw_cq *)attrs->recv_cq)->hdr.id);
 
@@ -564,6 +575,7 @@ struct ib_qp *siw_create_qp(struct ib_pd *ofa_pd,
 		qp->attrs.urdma_qp_id = ureq.urdmad_qp_id;
 		qp->attrs.urdma_rxq = ureq.rxq;
 		qp->attrs.urdma_txq = ureq.txq;
+		qp->attrs.urdma_features = ureq.features;
 
 		memset(&uresp, 0, sizeof uresp);
 		uresp.kmod_qp_id = QP_ID(qp);
@@ -911,17 +923,62 @@ struct ib_mr *siw_get_dma_mr(struct ib_pd *ofa_pd, int rights)
  * siw_create_srq()
  *
  * Create Shared Receive Queue of attributes @init_attrs
- * within protection domain given by @ofa_pd.
+ * within protection domain given by @ofa_pd.  The receive WQEs are managed
+ * entirely in userspace.
  *
  * @ofa_pd:	OFA PD contained in siw PD.
  * @init_attrs:	SRQ init attributes.
- * @udata:	not used by siw.
+ * @udata:	used to provide SRQ ID back to user.
  */
 struct ib_srq *siw_create_srq(struct ib_pd *ofa_pd,
 			      struct ib_srq_init_attr *init_attrs,
 			      struct ib_udata *udata)
 {
-	return ERR_PTR(-ENOSYS);
+	struct siw_srq			*srq = NULL;
+	struct siw_dev			*sdev = siw_dev_ofa2siw(ofa_pd->device);
+	struct urdma_uresp_create_srq	uresp;
+	int rv;
+
+	if (!ofa_pd->uobject) {
+		pr_debug(": This driver does not support kernel clients\n");
+		return ERR_PTR(-EINVAL);
+	}
+	if (atomic_inc_return(&sdev->num_srq) > SIW_MAX_SRQ) {
+		pr_debug(": Out of SRQ's\n");
+		rv = -ENOMEM;
+		goto err_out;
+	}
+	if (init_attrs->srq_type != IB_SRQT_BASIC) {
+		rv = -EINVAL;
+		goto err_out;
+	}
+	srq = kzalloc(sizeof *srq, GFP_KERNEL);
+	if (!srq) {
+		rv = -ENOMEM;
+		goto err_out;
+	}
+
+	rv = siw_srq_add(sdev, srq);
+	if (rv)
+		goto err_out;
+
+	uresp.srq_id = OBJ_ID(srq);
+
+	rv = ib_copy_to_udata(udata, &uresp, sizeof uresp);
+	if (rv)
+		goto err_out_idr;
+
+	return &srq->ofa_srq;
+
+err_out_idr:
+	siw_remove_obj(&sdev->idr_lock, &sdev->srq_idr, &srq->hdr);
+err_out:
+	pr_debug(DBG_OBJ ": SRQ creation failed %d", rv);
+
+	kfree(srq);
+	atomic_dec(&sdev->num_srq);
+
+	return ERR_PTR(rv);
 }
 
 /*
@@ -959,7 +1016,13 @@ int siw_query_srq(struct ib_srq *ofa_srq, struct ib_srq_attr *attrs)
  */
 int siw_destroy_srq(struct ib_srq *ofa_srq)
 {
-	return -ENOSYS;
+	struct siw_srq	*srq = container_of(ofa_srq, struct siw_srq, ofa_srq);
+	struct siw_dev	*sdev = siw_dev_ofa2siw(ofa_srq->device);
+
+	siw_remove_obj(&sdev->idr_lock, &sdev->srq_idr, &srq->hdr);
+	siw_srq_put(srq);
+
+	return 0;
 }
 
 
@@ -272,7 +272,7 @@ kvstore_cache_evict(struct kvstore *store, struct kv_elem *elem, bool flush)
 }
 
 static int
-fill_entry(struct kvstore *store, struct kv_elem *elem, int hash,
+fill_entry(struct kvstore *store, struct kv_elem *elem,
 		const void *value, size_t value_len)
 {
 	elem->handle.value = rte_malloc("value",
@@ -285,11 +285,10 @@ fill_entry(struct kvstore *store, struct kv_elem *elem, int hash,
 		memcpy(elem->handle.value, value, value_len);
 	}
 
-	elem->handle.mr = urdma_reg_mr_with_rkey(store->pd,
+	elem->handle.mr = ibv_reg_mr(store->pd,
 				elem->handle.value,
 				elem->handle.length,
-				IBV_ACCESS_REMOTE_READ|IBV_ACCESS_REMOTE_WRITE,
-				hash);
+				IBV_ACCESS_REMOTE_READ|IBV_ACCESS_REMOTE_WRITE);
 	if (!elem->handle.mr) {
 		goto free_handle_value;
 	}
@@ -340,8 +339,8 @@ kvstore_lookup(struct kvstore *store, const char *key, uint32_t *hash)
 	if (entry) {
 		pmem_value = (void *)((uintptr_t)store->store
 				+ elem->pmem_entry->offset);
-		if (fill_entry(store, elem, *hash,
-				pmem_value, entry->value_size) != 0) {
+		if (fill_entry(store, elem, pmem_value,
+					entry->value_size) != 0) {
 			return NULL;
 		}
 		elem->cas_version = entry->cas_version;
@@ -426,7 +425,7 @@ kvstore_do_create(struct kvstore *store, struct kv_elem *elem, uint32_t hash,
 
 	elem->pmem_entry = entry;
 
-	if (fill_entry(store, elem, hash, new_value, value_len) != 0) {
+	if (fill_entry(store, elem, new_value, value_len) != 0) {
 		return NULL;
 	}
 	if (value_len > 0) {
@@ -45,6 +45,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/prctl.h>
@@ -54,10 +55,13 @@
 
 #include <infiniband/driver.h>
 
+#include <rte_cycles.h>
 #include <rte_ethdev.h>
 #include <rte_errno.h>
 #include <rte_ip.h>
 #include <rte_jhash.h>
+#include <rte_launch.h>
+#include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_ring.h>
 
@@ -79,14 +83,72 @@ static struct usiw_driver *driver;
 int
 driver_add_context(struct usiw_context *ctx)
 {
-	int i, ret;
-	ret = rte_ring_enqueue(driver->new_ctxs, ctx->h);
-	for (i = 0; ret == -ENOBUFS && i < 1000; ++i) {
-		ret = rte_ring_enqueue(driver->new_ctxs, ctx->h);
-	}
-	return ret;
+	return rte_ring_enqueue(driver->new_ctxs, ctx->h);
 } /* driver_add_context */
 
+int
+driver_add_qp(struct usiw_qp *qp)
+{
+	struct usiw_progress_lcore *lc;
+	int ret;
+
+	if (driver->tunables.progress_lcores == 0) {
+		progress_cq_add_qp(qp);
+		return 0;
+	}
+
+	lc = progress_lcore_least_loaded(driver);
+	atomic_fetch_add(&lc->qp_count, 1);
+	ret = rte_ring_enqueue(lc->new_qps, qp);
+	if (ret == -ENOBUFS) {
+		atomic_fetch_sub(&lc->qp_count, 1);
+		return ret;
+	}
+	progress_lcore_wake(lc);
+	return 0;
+} /* driver_add_qp */
+
+void
+driver_remove_qp(struct usiw_qp *qp)
+{
+	/* Progress lcores drop their own reference once the queue pair reaches
+	 * the error state; in application progress mode nothing else will. */
+	if (driver->tunables.progress_lcores == 0) {
+		progress_cq_remove_qp(qp);
+		if (atomic_fetch_sub(&qp->refcnt, 1) == 1) {
+			usiw_do_destroy_qp(qp);
+		}
+	}
+} /* driver_remove_qp */
+
+__attribute__((__visibility__("default")))
+void
+urdma_query_progress_stats(struct urdma_progress_stats *stats)
+{
+	struct usiw_progress_lcore *lc;
+	uint64_t now;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	now = rte_get_timer_cycles();
+	for (i = 0; i < driver->progress_lcore_count; ++i) {
+		lc = &driver->progress[i];
+		if (lc->start_time) {
+			stats->elapsed_cycles += now - lc->start_time;
+		}
+		stats->sleep_cycles += lc->stats.sleep_cycles;
+		stats->sleep_count += lc->stats.sleep_count;
+		stats->wakeup_rx += lc->stats.wakeup_rx;
+		stats->wakeup_post += lc->stats.wakeup_post;
+		stats->wakeup_timeout += lc->stats.wakeup_timeout;
+		stats->wakeup_latency_total += lc->stats.wakeup_latency_total;
+		if (lc->stats.wakeup_latency_max > stats->wakeup_latency_max) {
+			stats->wakeup_latency_max
+				= lc->stats.wakeup_latency_max;
+		}
+	}
+} /* urdma_query_progress_stats */
+
 void
 start_progress_thread(void)
 {
@@ -179,21 +241,56 @@ free_hints:
 } /* get_ipaddr */
 
 
+/** Sets up the congestion control parameters of dev, converting periods to
+ * timer cycles.  Flows start at the link speed of the port, if it is known. */
+static void
+init_cc_params(struct usiw_device *dev)
+{
+	struct dcqcn_params *params = &dev->cc_params;
+	struct rte_eth_link link;
+	uint64_t cycles_per_us;
+
+	memset(&link, 0, sizeof(link));
+	rte_eth_link_get_nowait(dev->portid, &link);
+	cycles_per_us = rte_get_timer_hz() / 1000000;
+
+	params->line_rate = link.link_speed ? link.link_speed
+					: CC_LINE_RATE_DEFAULT_MBPS;
+	params->min_rate = RTE_MIN(DCQCN_MIN_RATE_MBPS, params->line_rate);
+	params->additive_increase = DCQCN_ADDITIVE_INCREASE_MBPS;
+	params->hyper_increase = DCQCN_HYPER_INCREASE_MBPS;
+	params->fast_recovery_stages = DCQCN_FAST_RECOVERY_STAGES;
+	params->byte_counter = DCQCN_BYTE_COUNTER;
+	params->increase_period = DCQCN_INCREASE_PERIOD_US * cycles_per_us;
+	params->alpha_period = DCQCN_ALPHA_PERIOD_US * cycles_per_us;
+	params->decrease_period = DCQCN_DECREASE_PERIOD_US * cycles_per_us;
+} /* init_cc_params */
+
+
 static struct ibv_device *
 usiw_driver_init(int portid)
 {
+	static const uint32_t rx_checksum_offloads
+		= DEV_RX_OFFLOAD_UDP_CKSUM|DEV_RX_OFFLOAD_IPV4_CKSUM;
 	static const uint32_t tx_checksum_offloads
 		= DEV_TX_OFFLOAD_UDP_CKSUM|DEV_TX_OFFLOAD_IPV4_CKSUM;
 
 	struct usiw_device *dev;
 	struct rte_eth_dev_info info;
 	char name[RTE_MEMPOOL_NAMESIZE];
+	unsigned int q;
 
 	dev = calloc(1, sizeof(*dev));
 	if (!dev) {
 		errno = ENOMEM;
 		return NULL;
 	}
+	for (q = 0; q < URDMAD_MAX_QUEUES; ++q) {
+		rte_spinlock_init(&dev->shared_queues[q].rx_lock);
+		rte_spinlock_init(&dev->shared_queues[q].tx_lock);
+		dev->shared_queues[q].qp_by_port = NULL;
+		atomic_init(&dev->shared_queues[q].qp_count, 0);
+	}
 	dev->vdev.sz = sizeof(struct verbs_device);
 	dev->vdev.size_of_context = sizeof(struct usiw_context)
 						- sizeof(struct verbs_context);
@@ -213,6 +310,10 @@ usiw_driver_init(int portid)
 						== tx_checksum_offloads) {
 		dev->flags |= port_checksum_offload;
 	}
+	if ((info.rx_offload_capa & rx_checksum_offloads)
+						== rx_checksum_offloads) {
+		dev->flags |= port_rx_checksum_offload;
+	}
 	if (rte_eth_dev_filter_supported(dev->portid,
 						RTE_ETH_FILTER_FDIR) == 0) {
 		dev->flags |= port_fdir;
@@ -227,13 +328,34 @@ usiw_driver_init(int portid)
 	}
 
 	snprintf(name, RTE_MEMPOOL_NAMESIZE, "port_%u_tx_mempool", portid);
-	dev->tx_ddp_mempool = dev->tx_hdr_mempool = rte_mempool_lookup(name);
+	dev->tx_ddp_mempool = rte_mempool_lookup(name);
 	if (!dev->tx_ddp_mempool) {
 		free(dev);
 		errno = ENOENT;
 		return NULL;
 	}
 
+	snprintf(name, RTE_MEMPOOL_NAMESIZE, "port_%u_tx_hdr_mempool", portid);
+	dev->tx_hdr_mempool = rte_mempool_lookup(name);
+	if (!dev->tx_hdr_mempool) {
+		free(dev);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	snprintf(name, RTE_MEMPOOL_NAMESIZE, "port_%u_tx_ext_mempool", portid);
+	dev->tx_ext_mempool = rte_mempool_lookup(name);
+	if (!dev->tx_ext_mempool) {
+		free(dev);
+		errno = ENOENT;
+		return NULL;
+	}
+	dev->tunables = driver->tunables;
+	rte_spinlock_init(&dev->pacer_lock);
+	tx_pacer_init(&dev->pacer, dev->tunables.port_rate_limit_mbps,
+			dev->tunables.port_rate_burst);
+	init_cc_params(dev);
+
 	dev->urdmad_fd = driver->urdmad_fd;
 
 	return &dev->vdev.device;
@@ -335,13 +457,34 @@ free_arg_list(int argc, char **argv)
 } /* free_arg_list */
 
 
+/** Reads the optional tunable named name from the config file into *value.
+ * *value must already contain the default, which is kept if the tunable is not
+ * present.  Returns false if the tunable is present but is not an integer in
+ * the range [min, max]. */
+static bool
+get_tunable(struct usiw_config *config, const char *name, unsigned int *value,
+		unsigned int min, unsigned int max)
+{
+	int ret;
+
+	ret = urdma__config_file_get_uint(config, name, value);
+	if ((ret < 0 && ret != -ENOENT) || *value < min || *value > max) {
+		fprintf(stderr, "Invalid %s in config file\n", name);
+		return false;
+	}
+	return true;
+} /* get_tunable */
+
+
 /** Parses the config file and fills in sock_name with the name of the socket to
  * use, and eal_argv with the user-requested argument, in addition to the
  * required arguments "--proc-type=secondary" and "-c".  (*eal_argv)[*eal_argc -
  * 1] is left NULL and must be filled in by the caller with the coremask to use,
- * which is determined by the socket identified by *sock_name. */
+ * which is determined by the socket identified by *sock_name.  Any tunables
+ * not given in the config file are set to their defaults in *tunables. */
 static bool
-do_config(char **sock_name, int *eal_argc, char ***eal_argv)
+do_config(char **sock_name, int *eal_argc, char ***eal_argv,
+		struct usiw_tunables *tunables)
 {
 	struct usiw_config config;
 	bool result = false;
@@ -361,6 +504,59 @@ do_config(char **sock_name, int *eal_argc, char ***eal_argv)
 		goto close_config;
 	}
 
+	tunables->progress_lcores = 1;
+	tunables->zero_copy_threshold = ZERO_COPY_THRESHOLD_DEFAULT;
+	tunables->fast_retransmit_limit = FAST_RETRANSMIT_LIMIT_DEFAULT;
+	tunables->retransmit_timeout_min_us
+		= RETRANSMIT_TIMEOUT_MIN_US_DEFAULT;
+	tunables->retransmit_timeout_max_us
+		= RETRANSMIT_TIMEOUT_MAX_US_DEFAULT;
+	tunables->coalesce_threshold = 0;
+	tunables->progress_idle_us = 0;
+	tunables->qp_rate_limit_mbps = 0;
+	tunables->qp_rate_burst = RATE_BURST_DEFAULT;
+	tunables->port_rate_limit_mbps = 0;
+	tunables->port_rate_burst = RATE_BURST_DEFAULT;
+	tunables->ecn = 0;
+	tunables->ack_segments = ACK_SEGMENTS_DEFAULT;
+	tunables->ack_delay_us = ACK_DELAY_US_DEFAULT;
+	if (!get_tunable(&config, "progress_lcores",
+				&tunables->progress_lcores, 0, RTE_MAX_LCORE)
+			|| !get_tunable(&config, "zero_copy_threshold",
+				&tunables->zero_copy_threshold, 0, UINT_MAX)
+			|| !get_tunable(&config, "fast_retransmit_limit",
+				&tunables->fast_retransmit_limit,
+				0, UINT_MAX)
+			|| !get_tunable(&config, "retransmit_timeout_min_us",
+				&tunables->retransmit_timeout_min_us,
+				1, UINT_MAX)
+			|| !get_tunable(&config, "retransmit_timeout_max_us",
+				&tunables->retransmit_timeout_max_us,
+				tunables->retransmit_timeout_min_us,
+				UINT_MAX)
+			|| !get_tunable(&config, "coalesce_threshold",
+				&tunables->coalesce_threshold,
+				0, COALESCE_THRESHOLD_MAX)
+			|| !get_tunable(&config, "progress_idle_us",
+				&tunables->progress_idle_us, 0, UINT_MAX)
+			|| !get_tunable(&config, "qp_rate_limit_mbps",
+				&tunables->qp_rate_limit_mbps, 0, UINT_MAX)
+			|| !get_tunable(&config, "qp_rate_burst",
+				&tunables->qp_rate_burst, 0,
+				TX_PACER_BURST_MAX)
+			|| !get_tunable(&config, "port_rate_limit_mbps",
+				&tunables->port_rate_limit_mbps, 0, UINT_MAX)
+			|| !get_tunable(&config, "port_rate_burst",
+				&tunables->port_rate_burst, 0,
+				TX_PACER_BURST_MAX)
+			|| !get_tunable(&config, "ecn", &tunables->ecn, 0, 1)
+			|| !get_tunable(&config, "ack_segments",
+				&tunables->ack_segments, 1, UINT16_MAX)
+			|| !get_tunable(&config, "ack_delay_us",
+				&tunables->ack_delay_us, 0, UINT_MAX)) {
+		goto free_sock_name;
+	}
+
 	/* Need to allocate argc + 4 elements for EAL args
 	 * argc returned by urdma__config_file_get_eal_argc does not include
 	 * process name
@@ -416,7 +612,7 @@ do_hello(void)
 
 	memset(&req, 0, sizeof(req));
 	req.hdr.opcode = rte_cpu_to_be_32(urdma_sock_hello_req);
-	req.req_lcore_count = rte_cpu_to_be_32(1);
+	req.req_lcore_count = rte_cpu_to_be_32(driver->progress_lcore_count);
 	ret = send(driver->urdmad_fd, &req, sizeof(req), 0);
 	if (ret != sizeof(req)) {
 		return -1;
@@ -460,19 +656,76 @@ format_coremask(uint32_t *coremask, size_t array_size)
 } /* format_coremask */
 
 
+/** Sets up one usiw_progress_lcore for each lcore that urdmad granted us.  The
+ * first entry is always the lcore running our_eal_master_thread(). */
+static int
+setup_progress_lcores(void)
+{
+	struct usiw_progress_lcore *lc;
+	char name[RTE_RING_NAMESIZE];
+	unsigned int lcore_id, i;
+	int ret;
+
+	driver->progress_lcore_count = rte_lcore_count();
+	driver->progress = calloc(driver->progress_lcore_count,
+			sizeof(*driver->progress));
+	if (!driver->progress) {
+		return -errno;
+	}
+	atomic_init(&driver->rebalance_gen, 0);
+
+	i = 0;
+	RTE_LCORE_FOREACH(lcore_id) {
+		lc = &driver->progress[i];
+		LIST_INIT(&lc->qp_active);
+		atomic_init(&lc->qp_count, 0);
+		lc->rebalance_gen = 0;
+		lc->lcore_id = lcore_id;
+		lc->index = i;
+		lc->driver = driver;
+		lc->epfd = lc->wake_fd = -1;
+		atomic_init(&lc->sleeping, false);
+		atomic_init(&lc->wake_request_time, 0);
+		if (driver->tunables.progress_idle_us) {
+			ret = progress_lcore_init_sleep(lc);
+			if (ret < 0) {
+				RTE_LOG(NOTICE, USER1, "lcore %u will not sleep when idle: %s\n",
+						lcore_id, rte_strerror(-ret));
+			}
+		}
+
+		snprintf(name, RTE_RING_NAMESIZE, "new_qp_ring%u", i);
+		lc->new_qps = malloc(rte_ring_get_memsize(NEW_QP_MAX + 1));
+		if (!lc->new_qps) {
+			return -errno;
+		}
+		ret = rte_ring_init(lc->new_qps, name, NEW_QP_MAX + 1,
+				RING_F_SC_DEQ);
+		if (ret < 0) {
+			return ret;
+		}
+		i++;
+	}
+
+	return 0;
+} /* setup_progress_lcores */
+
+
 /** Initialize the DPDK in a separate thread; this way we do not affect the
  * affinity of the user thread which first calls ibv_get_device_list, whether
  * directly or indirectly. */
 static void *
 our_eal_master_thread(void *sem)
 {
+	struct usiw_tunables tunables;
+	unsigned int lcore_id, i;
 	char **eal_argv;
 	char **argv_copy;
 	char *sock_name;
 	char *p;
 	int eal_argc, ret;
 
-	if (!do_config(&sock_name, &eal_argc, &eal_argv)) {
+	if (!do_config(&sock_name, &eal_argc, &eal_argv, &tunables)) {
 		/* driver will be NULL either because this previously failed or
 		 * because it is a global variable which is initialized from 0'd
 		 * memory, so it is safe to call free() on it regardless */
@@ -484,6 +737,8 @@ our_eal_master_thread(void *sem)
 	if (!driver)
 		goto err;
 	LIST_INIT(&driver->ctxs);
+	driver->tunables = tunables;
+	driver->progress_lcore_count = tunables.progress_lcores;
 
 	driver->urdmad_fd = setup_socket(sock_name);
 	if (driver->urdmad_fd < 0)
@@ -494,8 +749,22 @@ our_eal_master_thread(void *sem)
 				strerror(errno));
 		goto close_fd;
 	}
-	eal_argv[eal_argc - 1] = format_coremask(driver->lcore_mask,
-						 RTE_DIM(driver->lcore_mask));
+	if (tunables.progress_lcores == 0) {
+		/* No lcores were granted, but the EAL needs a master lcore.
+		 * Use an lcore id that no application thread is likely to have,
+		 * since this thread only does housekeeping and never touches a
+		 * mempool cache. */
+		free(eal_argv[eal_argc - 2]);
+		eal_argv[eal_argc - 2] = strdup("--lcores");
+		p = malloc(32);
+		if (p) {
+			snprintf(p, 32, "%u@0", RTE_MAX_LCORE - 1);
+		}
+		eal_argv[eal_argc - 1] = p;
+	} else {
+		eal_argv[eal_argc - 1] = format_coremask(driver->lcore_mask,
+						RTE_DIM(driver->lcore_mask));
+	}
 
 	/* rte_eal_init does nothing and returns -1 if it was already called
 	 * (although this behavior is not documented).  rte_eal_init also
@@ -530,23 +799,57 @@ our_eal_master_thread(void *sem)
 		goto close_fd;
 	}
 
+	ret = tunables.progress_lcores ? setup_progress_lcores() : 0;
+	if (ret < 0) {
+		RTE_LOG(ERR, USER1, "cannot set up progress lcores: %s\n",
+				rte_strerror(-ret));
+		goto free_progress;
+	}
+
 	/* Here we create a semaphore "go" which is used to start the progress
 	 * thread once a uverbs context is established, and then post on our
 	 * initialization semaphore to let the "parent" thread know that we have
 	 * completed initialization. */
 	if (sem_init(&driver->go, 0, 0))
-		goto free_ring;
+		goto free_progress;
 	ret = sem_post(sem);
 	if (ret) {
 		goto destroy_sem;
 	}
-	kni_loop(driver);
+
+	/* Do not start burning CPU on any lcore until a context exists. The
+	 * master lcore (this thread) always drives driver->progress[0]. */
+	sem_wait(&driver->go);
+	if (tunables.progress_lcores == 0) {
+		/* Queue pairs are progressed by the application threads that
+		 * post to and poll them. */
+		app_progress_housekeeping_loop(driver);
+		return NULL;
+	}
+	for (i = 1; i < driver->progress_lcore_count; ++i) {
+		lcore_id = driver->progress[i].lcore_id;
+		ret = rte_eal_remote_launch(kni_loop, &driver->progress[i],
+				lcore_id);
+		if (ret < 0) {
+			RTE_LOG(ERR, USER1, "cannot launch progress lcore %u: %s\n",
+					lcore_id, rte_strerror(-ret));
+			driver->progress_lcore_count = i;
+			break;
+		}
+	}
+	kni_loop(&driver->progress[0]);
 
 	return NULL;
 
 destroy_sem:
 	sem_destroy(&driver->go);
-free_ring:
+free_progress:
+	if (driver->progress) {
+		for (i = 0; i < driver->progress_lcore_count; ++i) {
+			free(driver->progress[i].new_qps);
+		}
+		free(driver->progress);
+	}
 	rte_ring_free(driver->new_ctxs);
 close_fd:
 	close(driver->urdmad_fd);
@@ -46,10 +46,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <netinet/ip.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <rte_arp.h>
 #include <rte_cycles.h>
@@ -61,8 +69,10 @@
 #include <rte_log.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_memory.h>
 #include <rte_udp.h>
 
+#include "cksum.h"
 #include "interface.h"
 #include "list.h"
 #include "proto.h"
@@ -70,7 +80,7 @@
 #include "util.h"
 
 #define IP_HDR_PROTO_UDP 17
-#define RETRANSMIT_MAX 5
+#define RX_PREFETCH_OFFSET 3
 
 struct packet_context {
 	struct ee_state *src_ep;
@@ -111,35 +121,47 @@ serial_greater_32(uint32_t s1, uint32_t s2)
 } /* serial_greater_32 */
 
 
-struct usiw_mr **
+struct usiw_mr *
 usiw_mr_lookup(struct usiw_mr_table *tbl, uint32_t rkey)
 {
-	struct usiw_mr **candidate;
+	struct usiw_mr *mr;
+	uint32_t index;
 
-	for (candidate = &tbl->entries[rkey % tbl->capacity];
-			*candidate != NULL; candidate = &(*candidate)->next) {
-		if ((*candidate)->mr.rkey == rkey) {
-			return candidate;
-		}
+	index = STAG_MR_INDEX(rkey);
+	if ((rkey & STAG_TYPE_MASK) != STAG_TYPE_MR || index >= tbl->capacity) {
+		return NULL;
 	}
 
-	return NULL;
+	/* A free entry never matches, since its rkey has no valid type */
+	mr = &tbl->entries[index];
+	return (mr->mr.rkey == rkey) ? mr : NULL;
 } /* usiw_mr_lookup */
 
 
 void
-usiw_dereg_mr_real(__attribute__((unused)) struct usiw_mr_table *tbl,
-		struct usiw_mr **mr)
+usiw_dereg_mr_real(struct usiw_mr_table *tbl, struct usiw_mr *mr)
 {
-	struct usiw_mr *free_mr = *mr;
-	*mr = (*mr)->next;
-	free(free_mr);
+	uint32_t index = mr - tbl->entries;
+
+	rte_spinlock_lock(&tbl->lock);
+	mr->mr.rkey = mr->mr.lkey = STAG_TYPE_MASK;
+	mr->in_use = false;
+	mr->key++;
+	mr->prev_free = USIW_MR_FREE_END;
+	mr->next_free = tbl->free_head;
+	if (tbl->free_head != USIW_MR_FREE_END) {
+		tbl->entries[tbl->free_head].prev_free = index;
+	}
+	tbl->free_head = index;
+	tbl->mr_count--;
+	rte_spinlock_unlock(&tbl->lock);
 } /* usiw_dereg_mr_real */
 
 int
 usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
 		uint32_t max_send_wr, uint32_t max_send_sge)
 {
+	struct usiw_send_wqe *wqe;
 	size_t wqe_size;
 	char name[RTE_RING_NAMESIZE];
 	int i, ret;
@@ -165,16 +187,21 @@ usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
 		return ret;
 
 	wqe_size = sizeof(struct usiw_send_wqe)
-					+ max_send_sge * sizeof(struct iovec);
+			+ max_send_sge * (sizeof(struct iovec)
+				+ sizeof(struct usiw_phys_range));
 	q->storage = calloc(max_send_wr, wqe_size);
 	if (!q->storage)
 		return -errno;
 
 	for (i = 0; i < max_send_wr; i++) {
-		rte_ring_enqueue(q->free_ring, q->storage + i * wqe_size);
+		wqe = (struct usiw_send_wqe *)(q->storage + i * wqe_size);
+		wqe->iov_phys = (struct usiw_phys_range *)
+					&wqe->iov[max_send_sge];
+		rte_ring_enqueue(q->free_ring, wqe);
 	}
 
 	TAILQ_INIT(&q->active_head);
+	memset(q->read_active, 0, sizeof(q->read_active));
 	rte_spinlock_init(&q->lock);
 	q->max_wr = max_send_wr;
 	q->max_sge = max_send_sge;
@@ -196,13 +223,57 @@ usiw_send_wqe_queue_add_active(struct usiw_send_wqe_queue *q,
 	TAILQ_INSERT_TAIL(&q->active_head, wqe, active);
 } /* usiw_send_wqe_queue_add_active */
 
+/** Enters an RDMA READ WQE into read_active so that its READ Responses can
+ * find it.  Returns -EBUSY if the slot for its MSN still holds an earlier READ
+ * that is waiting for its response; the READ Request must not be sent until
+ * that READ completes. */
+static int
+usiw_send_wqe_queue_add_read(struct usiw_send_wqe_queue *q,
+		struct usiw_send_wqe *wqe)
+{
+	struct usiw_send_wqe **slot;
+
+	slot = &q->read_active[wqe->msn & (USIW_ORD_MAX - 1)];
+	if (*slot && *slot != wqe) {
+		return -EBUSY;
+	}
+	*slot = wqe;
+	return 0;
+} /* usiw_send_wqe_queue_add_read */
+
 static void
 usiw_send_wqe_queue_del_active(struct usiw_send_wqe_queue *q,
 		struct usiw_send_wqe *wqe)
 {
+	struct usiw_send_wqe **slot;
+
 	TAILQ_REMOVE(&q->active_head, wqe, active);
+	if (wqe->opcode == usiw_wr_read) {
+		slot = &q->read_active[wqe->msn & (USIW_ORD_MAX - 1)];
+		if (*slot == wqe) {
+			*slot = NULL;
+		}
+	}
 } /* usiw_send_wqe_queue_del_active */
 
+/** Looks up the active RDMA READ WQE whose sink STag is stag.  The STag
+ * carries the low 24 bits of the READ MSN, which both indexes read_active and
+ * serves as a generation number: a stale or duplicate READ Response whose
+ * slot has since been reused will not match the MSN of the WQE there. */
+static int
+usiw_send_wqe_queue_lookup_read(struct usiw_send_wqe_queue *q,
+		uint32_t stag, struct usiw_send_wqe **wqe)
+{
+	struct usiw_send_wqe *lptr;
+
+	lptr = q->read_active[stag & (USIW_ORD_MAX - 1)];
+	if (lptr && STAG_RDMA_READ(lptr->msn) == stag) {
+		*wqe = lptr;
+		return 0;
+	}
+	return -ENOENT;
+} /* usiw_send_wqe_queue_lookup_read */
+
 static int
 usiw_send_wqe_queue_lookup(struct usiw_send_wqe_queue *q,
 		uint16_t wr_opcode, uint32_t wr_key_data,
@@ -211,6 +282,9 @@ usiw_send_wqe_queue_lookup(struct usiw_send_wqe_queue *q,
 	struct usiw_send_wqe *lptr, **prev;
 	RTE_LOG(DEBUG, USER1, "LOOKUP active send WQE opcode=%" PRIu8 " key_data=%" PRIu32 "\n",
 			wr_opcode, wr_key_data);
+	if (wr_opcode == usiw_wr_read) {
+		return usiw_send_wqe_queue_lookup_read(q, wr_key_data, wqe);
+	}
 	TAILQ_FOR_EACH(lptr, &q->active_head, active, prev) {
 		if (lptr->opcode != wr_opcode) {
 			continue;
@@ -229,41 +303,57 @@ usiw_send_wqe_queue_lookup(struct usiw_send_wqe_queue *q,
 			}
 			break;
 		case usiw_wr_read:
-			if (wr_key_data == STAG_RDMA_READ(lptr->msn)) {
-				*wqe = lptr;
-				return 0;
-			}
+			/* Handled by usiw_send_wqe_queue_lookup_read() */
 			break;
 		}
 	}
 	return -ENOENT;
 } /* usiw_send_wqe_queue_lookup */
 
+/** Initializes a receive WQE queue.  qpn is the queue pair number, or the SRQ
+ * number if flags includes usiw_rq_shared, and is only used to name the
+ * rings. */
 int
 usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
-		uint32_t max_recv_wr, uint32_t max_recv_sge)
+		uint32_t max_recv_wr, uint32_t max_recv_sge, unsigned int flags)
 {
 	size_t wqe_size;
 	char name[RTE_RING_NAMESIZE];
+	unsigned int ring_flags;
 	int i, ret;
 
-	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_recv", qpn);
+	rte_spinlock_init(&q->lock);
+	q->max_wr = max_recv_wr;
+	q->max_sge = max_recv_sge;
+	if (flags & usiw_rq_srq_user) {
+		/* WQEs come from the SRQ, but are still tracked by MSN
+		 * here */
+		q->ring = q->free_ring = NULL;
+		q->storage = NULL;
+		goto init_active;
+	}
+
+	/* The WQEs of an SRQ may be posted by several user threads at once,
+	 * and are consumed and freed by whichever progress lcores own the
+	 * queue pairs that receive into them. */
+	ring_flags = (flags & usiw_rq_shared) ? 0 : RING_F_SP_ENQ|RING_F_SC_DEQ;
+	snprintf(name, RTE_RING_NAMESIZE, "%s%" PRIu32 "_recv",
+			(flags & usiw_rq_shared) ? "srq" : "qpn", qpn);
 	q->ring = rte_malloc(NULL, rte_ring_get_memsize(max_recv_wr + 1),
 			RTE_CACHE_LINE_SIZE);
 	if (!q->ring)
 		return -rte_errno;
-	ret = rte_ring_init(q->ring, name, max_recv_wr + 1,
-			RING_F_SP_ENQ|RING_F_SC_DEQ);
+	ret = rte_ring_init(q->ring, name, max_recv_wr + 1, ring_flags);
 	if (ret)
 		return ret;
 
-	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_recv_free", qpn);
+	snprintf(name, RTE_RING_NAMESIZE, "%s%" PRIu32 "_recv_free",
+			(flags & usiw_rq_shared) ? "srq" : "qpn", qpn);
 	q->free_ring = rte_malloc(NULL, rte_ring_get_memsize(max_recv_wr + 1),
 				  RTE_CACHE_LINE_SIZE);
 	if (!q->free_ring)
 		return -rte_errno;
-	ret = rte_ring_init(q->free_ring, name, max_recv_wr + 1,
-			RING_F_SP_ENQ|RING_F_SC_DEQ);
+	ret = rte_ring_init(q->free_ring, name, max_recv_wr + 1, ring_flags);
 	if (ret)
 		return ret;
 
@@ -277,10 +367,24 @@ usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
 		rte_ring_enqueue(q->free_ring, q->storage + i * wqe_size);
 	}
 
-	TAILQ_INIT(&q->active_head);
-	rte_spinlock_init(&q->lock);
-	q->max_wr = max_recv_wr;
-	q->max_sge = max_recv_sge;
+	if (flags & usiw_rq_shared) {
+		q->active = NULL;
+		q->active_mask = 0;
+		return 0;
+	}
+
+init_active:
+	/* Messages may complete out of order, so the MSNs of the active WQEs
+	 * can span more than max_recv_wr; leave some slack so that collisions
+	 * are limited to pathological loss patterns. */
+	for (q->active_mask = 1; q->active_mask < 2 * max_recv_wr;
+			q->active_mask <<= 1)
+		;
+	q->active = calloc(q->active_mask, sizeof(*q->active));
+	if (!q->active)
+		return -errno;
+	q->active_mask--;
+
 	return 0;
 } /* usiw_recv_wqe_queue_init */
 
@@ -289,145 +393,556 @@ usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q)
 {
 	rte_free(q->ring);
 	rte_free(q->free_ring);
+	free(q->active);
 	free(q->storage);
 } /* usiw_recv_wqe_queue_destroy */
 
-static void
+/** Returns true if a WQE with the given msn can be made active, i.e., no other
+ * active WQE occupies its slot. */
+static bool
+usiw_recv_wqe_queue_slot_free(struct usiw_recv_wqe_queue *q, uint32_t msn)
+{
+	return q->active[msn & q->active_mask] == NULL;
+} /* usiw_recv_wqe_queue_slot_free */
+
+static int
 usiw_recv_wqe_queue_add_active(struct usiw_recv_wqe_queue *q,
 		struct usiw_recv_wqe *wqe)
 {
+	struct usiw_recv_wqe **slot = &q->active[wqe->msn & q->active_mask];
+
 	RTE_LOG(DEBUG, USER1, "ADD active recv WQE msn=%" PRIu32 "\n",
 			wqe->msn);
-	TAILQ_INSERT_TAIL(&q->active_head, wqe, active);
+	if (*slot) {
+		return -EBUSY;
+	}
+	*slot = wqe;
+	return 0;
 } /* usiw_recv_wqe_queue_add_active */
 
 static void
 usiw_recv_wqe_queue_del_active(struct usiw_recv_wqe_queue *q,
 		struct usiw_recv_wqe *wqe)
 {
+	struct usiw_recv_wqe **slot = &q->active[wqe->msn & q->active_mask];
+
 	RTE_LOG(DEBUG, USER1, "DEL active recv WQE msn=%" PRIu32 "\n",
 			wqe->msn);
-	TAILQ_REMOVE(&q->active_head, wqe, active);
+	if (*slot == wqe) {
+		*slot = NULL;
+	}
 } /* usiw_recv_wqe_queue_del_active */
 
 static int
 usiw_recv_wqe_queue_lookup(struct usiw_recv_wqe_queue *q,
 		uint32_t msn, struct usiw_recv_wqe **wqe)
 {
-	struct usiw_recv_wqe *lptr, **prev;
+	struct usiw_recv_wqe *lptr;
+
 	RTE_LOG(DEBUG, USER1, "LOOKUP active recv WQE msn=%" PRIu32 "\n",
 			msn);
-	TAILQ_FOR_EACH(lptr, &q->active_head, active, prev) {
-		if (lptr->msn == msn) {
-			*wqe = lptr;
-			return 0;
-		}
+	lptr = q->active[msn & q->active_mask];
+	if (lptr && lptr->msn == msn) {
+		*wqe = lptr;
+		return 0;
 	}
 	return -ENOENT;
 } /* usiw_recv_wqe_queue_lookup */
 
 
-/* Transmits all packets currently in the transmit queue.  The queue will be
- * empty when this function returns.
- *
- * FIXME: It may be possible for this to never return if there is any error
- * that prevents packets from being transmitted. */
+/** Returns the number of frames waiting in the transmit backlog. */
+static inline uint16_t
+tx_backlog_count(struct usiw_qp *qp)
+{
+	return (uint16_t)(qp->txq_tail - qp->txq_head);
+} /* tx_backlog_count */
+
+/** Changes the rate and burst size of pacer, keeping the tokens that it has
+ * already accumulated up to the new burst size. */
+static void
+tx_pacer_set_rate(struct usiw_tx_pacer *pacer, unsigned int rate_mbps,
+		unsigned int burst_bytes)
+{
+	/* One Mbit/s is 125000 bytes per second */
+	pacer->cycles_per_byte = rate_mbps
+		? (rte_get_timer_hz() << TX_PACER_FRAC_BITS)
+			/ (rate_mbps * UINT64_C(125000))
+		: 0;
+	pacer->burst = (burst_bytes * pacer->cycles_per_byte)
+		>> TX_PACER_FRAC_BITS;
+	pacer->tokens = RTE_MIN(pacer->tokens, pacer->burst);
+} /* tx_pacer_set_rate */
+
+void
+tx_pacer_init(struct usiw_tx_pacer *pacer, unsigned int rate_mbps,
+		unsigned int burst_bytes)
+{
+	pacer->tokens = INT64_MAX;
+	tx_pacer_set_rate(pacer, rate_mbps, burst_bytes);
+	pacer->last_refill = rte_get_timer_cycles();
+} /* tx_pacer_init */
+
+/** Refills pacer up to time now, and returns true if it is not in debt. */
+static bool
+tx_pacer_ready(struct usiw_tx_pacer *pacer, uint64_t now)
+{
+	pacer->tokens = RTE_MIN(pacer->tokens
+			+ (int64_t)(now - pacer->last_refill), pacer->burst);
+	pacer->last_refill = now;
+	return pacer->tokens >= 0;
+} /* tx_pacer_ready */
+
+/** Takes the tokens for a datagram of length bytes from pacer. */
+static void
+tx_pacer_charge(struct usiw_tx_pacer *pacer, uint32_t length)
+{
+	pacer->tokens -= (length * pacer->cycles_per_byte)
+		>> TX_PACER_FRAC_BITS;
+} /* tx_pacer_charge */
+
+/** Returns true if neither the rate limit of qp, nor the rate allowed to it
+ * by congestion control, nor the rate limit of its port holds back the next
+ * DDP segment.  Acknowledgements and retransmissions are never paced. */
+static bool
+tx_pacing_open(struct usiw_qp *qp)
+{
+	struct usiw_device *dev = qp->dev;
+	uint64_t now;
+	bool ready;
+
+	if (!qp->pacer.cycles_per_byte && !qp->cc_pacer.cycles_per_byte
+			&& !dev->pacer.cycles_per_byte) {
+		return true;
+	}
+	now = rte_get_timer_cycles();
+	if ((qp->pacer.cycles_per_byte && !tx_pacer_ready(&qp->pacer, now))
+			|| (qp->cc_pacer.cycles_per_byte
+				&& !tx_pacer_ready(&qp->cc_pacer, now))) {
+		qp->stats.tx_paced++;
+		return false;
+	}
+	if (dev->pacer.cycles_per_byte) {
+		rte_spinlock_lock(&dev->pacer_lock);
+		ready = tx_pacer_ready(&dev->pacer, now);
+		rte_spinlock_unlock(&dev->pacer_lock);
+		if (!ready) {
+			qp->stats.tx_paced++;
+			return false;
+		}
+	}
+	return true;
+} /* tx_pacing_open */
+
+/** Sets up the congestion control pacer of qp for the rate that congestion
+ * control currently allows, which is unlimited at the line rate. */
+static void
+cc_apply_rate(struct usiw_qp *qp)
+{
+	if (qp->cc.current_rate >= qp->dev->cc_params.line_rate) {
+		qp->cc_pacer.cycles_per_byte = 0;
+	} else {
+		tx_pacer_set_rate(&qp->cc_pacer, qp->cc.current_rate,
+				qp->dev->tunables.qp_rate_burst);
+	}
+	qp->stats.cc_rate_mbps = qp->cc.current_rate;
+} /* cc_apply_rate */
+
+/** Charges a newly sent datagram of length bytes, not counting the Ethernet,
+ * IPv4, UDP and TRP headers, to the rate limits of qp and its port, and
+ * counts it towards the next rate increase of congestion control. */
+static void
+tx_pacing_charge(struct usiw_qp *qp, uint32_t length)
+{
+	struct usiw_device *dev = qp->dev;
+
+	if (!qp->pacer.cycles_per_byte && !qp->remote_ep.ecn
+			&& !dev->pacer.cycles_per_byte) {
+		return;
+	}
+	length += sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+		+ sizeof(struct udp_hdr) + sizeof(struct trp_hdr);
+	if (qp->pacer.cycles_per_byte) {
+		tx_pacer_charge(&qp->pacer, length);
+	}
+	if (qp->remote_ep.ecn) {
+		if (qp->cc_pacer.cycles_per_byte) {
+			tx_pacer_charge(&qp->cc_pacer, length);
+		}
+		if (dcqcn_sent(&qp->cc, &dev->cc_params, length)) {
+			cc_apply_rate(qp);
+		}
+	}
+	if (dev->pacer.cycles_per_byte) {
+		rte_spinlock_lock(&dev->pacer_lock);
+		tx_pacer_charge(&dev->pacer, length);
+		rte_spinlock_unlock(&dev->pacer_lock);
+	}
+} /* tx_pacing_charge */
+
+/** Applies the rate limit most recently set by urdma_set_qp_rate_limit(). */
+static void
+tx_pacing_update(struct usiw_qp *qp)
+{
+	uint64_t request;
+
+	request = atomic_load_explicit(&qp->pacer_request,
+			memory_order_relaxed);
+	if (request != qp->pacer_config) {
+		tx_pacer_init(&qp->pacer, request >> 32, (uint32_t)request);
+		qp->pacer_config = request;
+	}
+} /* tx_pacing_update */
+
+/** Returns true if the send engine may produce another DDP segment for ep:
+ * the peer has granted credits for it, the transmit backlog of this queue
+ * pair is not congested, and the rate limits allow it.  Half of the backlog is
+ * kept free for acknowledgements and retransmissions. */
+static bool
+tx_window_open(struct usiw_qp *qp, struct ee_state *ep)
+{
+	return serial_less_32(ep->send_next_psn, ep->send_max_psn)
+		&& tx_backlog_count(qp) < TX_BACKLOG_SIZE / 2
+		&& tx_pacing_open(qp);
+} /* tx_window_open */
+
+/** Offers the frames in the transmit backlog to the NIC, without waiting for
+ * it to accept them.  Any frames that the NIC does not accept stay in the
+ * backlog for the next call.  While the NIC ring is full, tx_burst_size
+ * grows so that enqueue_tx_frame() makes fewer futile attempts; it shrinks
+ * back each time the backlog is drained completely. */
 static void
 flush_tx_queue(struct usiw_qp *qp)
 {
-	struct rte_mbuf **begin;
-	int ret;
+	struct usiw_shared_queue *sq = qp->shared_queue;
+	uint16_t count, index, ret;
 
-	begin = qp->txq;
-	do {
+	/* If another queue pair is transmitting on the same hardware queue,
+	 * leave our frames in the backlog until the next call */
+	if (sq && !rte_spinlock_trylock(&sq->tx_lock)) {
+		return;
+	}
+	while ((count = tx_backlog_count(qp)) != 0) {
+		index = qp->txq_head & (TX_BACKLOG_SIZE - 1);
+		count = RTE_MIN(count, TX_BACKLOG_SIZE - index);
 		ret = rte_eth_tx_burst(qp->dev->portid, qp->shm_qp->tx_queue,
-			begin, qp->txq_end - begin);
+				&qp->txq[index], count);
 		if (ret > 0) {
 			RTE_LOG(DEBUG, USER1, "Transmitted %d packets\n", ret);
 		}
-		begin += ret;
-	} while (begin != qp->txq_end);
-	qp->txq_end = qp->txq;
+		qp->txq_head += ret;
+		if (ret < count) {
+			qp->stats.tx_full++;
+			qp->tx_burst_size = RTE_MIN(2 * qp->tx_burst_size,
+					TX_BURST_SIZE_MAX);
+			break;
+		}
+	}
+	if (sq) {
+		rte_spinlock_unlock(&sq->tx_lock);
+	}
+	if (tx_backlog_count(qp) == 0 && qp->tx_burst_size > TX_BURST_SIZE) {
+		qp->tx_burst_size /= 2;
+	}
+	qp->stats.tx_backlog_depth = tx_backlog_count(qp);
 } /* flush_tx_queue */
 
-/* Prepends an Ethernet header to the frame and enqueues it on the given port.
- * The ether_type should be in host byte order. */
+/** Discards every frame in the transmit backlog. */
 static void
-enqueue_ether_frame(struct rte_mbuf *sendmsg, unsigned int ether_type,
-		struct usiw_qp *qp, struct ether_addr *dst_addr)
+discard_tx_queue(struct usiw_qp *qp)
 {
-	struct ether_hdr *eth = (struct ether_hdr *)rte_pktmbuf_prepend(sendmsg,
-								sizeof(*eth));
+	while (qp->txq_head != qp->txq_tail) {
+		rte_pktmbuf_free(qp->txq[qp->txq_head++
+					& (TX_BACKLOG_SIZE - 1)]);
+	}
+} /* discard_tx_queue */
 
-	ether_addr_copy(dst_addr, &eth->d_addr);
-	rte_eth_macaddr_get(qp->dev->portid, &eth->s_addr);
-	eth->ether_type = rte_cpu_to_be_16(ether_type);
-	sendmsg->l2_len = sizeof(*eth);
-#ifdef DEBUG_PACKET_HEADERS
-	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Enqueue packet to transmit queue:\n",
-		qp->shm_qp->dev_id, qp->shm_qp->qp_id);
-	rte_pktmbuf_dump(stderr, sendmsg, 128);
-#endif
+/** Returns the queue pair bound to the destination UDP port of pkt, which
+ * arrived on the shared hardware queue sq, or NULL if there is none.  Must be
+ * called with sq->rx_lock held. */
+static struct usiw_qp *
+shared_queue_find_qp(struct usiw_shared_queue *sq, struct rte_mbuf *pkt)
+{
+	struct usiw_qp *qp;
+	struct ether_hdr *ether;
+	struct ipv4_hdr *ipv4;
+	struct udp_hdr *udp;
 
-	*(qp->txq_end++) = sendmsg;
-	if (qp->txq_end == qp->txq + TX_BURST_SIZE) {
-		RTE_LOG(DEBUG, USER1, "TX queue filled; early flush forced\n");
-		flush_tx_queue(qp);
+	ether = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+	if (ether->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+		return NULL;
+	}
+	ipv4 = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, sizeof(*ether));
+	if (ipv4->next_proto_id != IP_HDR_PROTO_UDP) {
+		return NULL;
 	}
-} /* enqueue_ether_frame */
+	udp = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *,
+			sizeof(*ether) + sizeof(*ipv4));
+
+	HASH_FIND(hh_port, sq->qp_by_port, &udp->dst_port,
+			sizeof(udp->dst_port), qp);
+	return qp;
+} /* shared_queue_find_qp */
 
-/* Appends a skeleton IPv4 header to the packet.  src_addr and dst_addr are in
- * network byte order. */
-static struct ipv4_hdr *
-prepend_ipv4_header(struct rte_mbuf *sendmsg, int next_proto_id,
-					uint32_t src_addr, uint32_t dst_addr)
+/** Receives a burst from the hardware queue that qp shares with other queue
+ * pairs, unless another thread is already doing so, and moves each datagram
+ * to the rx_queue ring of the queue pair bound to its destination UDP port.
+ * Datagrams for unbound ports, or that do not fit in the ring, are dropped and
+ * will be retransmitted by the sender. */
+static void
+shared_queue_receive(struct usiw_qp *qp)
 {
-	struct ipv4_hdr *ip;
-	size_t payload_length;
+	struct rte_mbuf *rxmbuf[RX_BURST_SIZE];
+	struct usiw_shared_queue *sq = qp->shared_queue;
+	struct usiw_qp *dst;
+	uint16_t rx_count, pkt;
+
+	if (!rte_spinlock_trylock(&sq->rx_lock)) {
+		return;
+	}
+	rx_count = rte_eth_rx_burst(qp->dev->portid, qp->shm_qp->rx_queue,
+			rxmbuf, RX_BURST_SIZE);
+	for (pkt = 0; pkt < rx_count; ++pkt) {
+		dst = shared_queue_find_qp(sq, rxmbuf[pkt]);
+		if (!dst || rte_ring_enqueue(dst->remote_ep.rx_queue,
+							rxmbuf[pkt]) != 0) {
+			rte_pktmbuf_free(rxmbuf[pkt]);
+			continue;
+		}
+		if (dst != qp) {
+			progress_wake_qp(dst);
+		}
+	}
+	rte_spinlock_unlock(&sq->rx_lock);
+} /* shared_queue_receive */
 
-	payload_length = rte_pktmbuf_pkt_len(sendmsg);
-	ip = (struct ipv4_hdr *)rte_pktmbuf_prepend(sendmsg, sizeof(*ip));
-	ip->version_ihl = 0x45;
-	ip->type_of_service = 0;
-	ip->total_length = rte_cpu_to_be_16(sizeof(*ip) + payload_length);
-	ip->packet_id = 0;
-	ip->fragment_offset = 0;
-	ip->time_to_live = 64;
-	ip->next_proto_id = next_proto_id;
-	ip->hdr_checksum = 0;
-	ip->src_addr = src_addr;
-	ip->dst_addr = dst_addr;
-	sendmsg->l3_len = sizeof(*ip);
+/** Creates the ring that holds the datagrams demultiplexed for qp and binds
+ * qp to its local UDP port on its shared hardware queue.  Returns 0 or a
+ * negative errno value. */
+static int
+shared_queue_bind(struct usiw_qp *qp)
+{
+	struct usiw_shared_queue *sq = qp->shared_queue;
+	char name[RTE_RING_NAMESIZE];
+	struct usiw_qp *other;
+	unsigned int count;
+	int ret;
 
-	if (!(sendmsg->ol_flags & PKT_TX_IP_CKSUM)) {
-		ip->hdr_checksum = rte_ipv4_cksum(ip);
+	count = rte_align32pow2(qp->shm_qp->rx_desc_count);
+	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_rx",
+			qp->ib_qp.qp_num);
+	qp->remote_ep.rx_queue = rte_malloc(NULL, rte_ring_get_memsize(count),
+			RTE_CACHE_LINE_SIZE);
+	if (!qp->remote_ep.rx_queue) {
+		return -ENOMEM;
+	}
+	ret = rte_ring_init(qp->remote_ep.rx_queue, name, count,
+			RING_F_SP_ENQ|RING_F_SC_DEQ);
+	if (ret) {
+		goto free_ring;
 	}
 
-	return ip;
-} /* prepend_ipv4_header */
+	rte_spinlock_lock(&sq->rx_lock);
+	HASH_FIND(hh_port, sq->qp_by_port, &qp->shm_qp->local_udp_port,
+			sizeof(qp->shm_qp->local_udp_port), other);
+	if (other) {
+		rte_spinlock_unlock(&sq->rx_lock);
+		ret = -EADDRINUSE;
+		goto free_ring;
+	}
+	qp->shared_queue_port = qp->shm_qp->local_udp_port;
+	HASH_ADD(hh_port, sq->qp_by_port, shared_queue_port,
+			sizeof(qp->shared_queue_port), qp);
+	atomic_fetch_add(&sq->qp_count, 1);
+	rte_spinlock_unlock(&sq->rx_lock);
+	qp->remote_ep.shared_queue = sq;
+	return 0;
 
+free_ring:
+	rte_free(qp->remote_ep.rx_queue);
+	qp->remote_ep.rx_queue = NULL;
+	return ret;
+} /* shared_queue_bind */
 
-/* Appends a skeleton IPv4 header to the packet.  Note that this sets the
- * checksum to 0, which must either be computed in full or offloaded (in which
- * case the IP psuedo-header checksum must be pre-computed by the caller).
- * src_port and dst_port should be in network byte order. */
-static struct udp_hdr *
-prepend_udp_header(struct rte_mbuf *sendmsg, unsigned int src_port,
-			unsigned int dst_port)
+/** Stops demultiplexing datagrams to qp.  Datagrams already in its rx_queue
+ * ring are freed along with the ring by shared_queue_free_ring(). */
+static void
+shared_queue_unbind(struct usiw_qp *qp)
 {
-	struct udp_hdr *udp;
-	size_t payload_length;
+	struct usiw_shared_queue *sq = qp->shared_queue;
+
+	if (!sq || !qp->shared_queue_port) {
+		return;
+	}
+	rte_spinlock_lock(&sq->rx_lock);
+	HASH_DELETE(hh_port, sq->qp_by_port, qp);
+	atomic_fetch_sub(&sq->qp_count, 1);
+	rte_spinlock_unlock(&sq->rx_lock);
+	qp->shared_queue_port = 0;
+	qp->remote_ep.shared_queue = NULL;
+} /* shared_queue_unbind */
+
+/** Frees the rx_queue ring of qp and any datagrams left in it. */
+static void
+shared_queue_free_ring(struct usiw_qp *qp)
+{
+	struct rte_mbuf *pkt;
+
+	if (!qp->remote_ep.rx_queue) {
+		return;
+	}
+	while (rte_ring_dequeue(qp->remote_ep.rx_queue, (void **)&pkt) == 0) {
+		rte_pktmbuf_free(pkt);
+	}
+	rte_free(qp->remote_ep.rx_queue);
+	qp->remote_ep.rx_queue = NULL;
+} /* shared_queue_free_ring */
+
+/* Enqueues the frame, which must already have all of its headers, on the queue
+ * pair's transmit backlog.  If the backlog is full, the frame is discarded;
+ * tx_window_open() keeps enough room that this only happens if the NIC has
+ * stopped accepting frames altogether. */
+static void
+enqueue_tx_frame(struct usiw_qp *qp, struct rte_mbuf *sendmsg)
+{
+	uint16_t count;
+
+#ifdef DEBUG_PACKET_HEADERS
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Enqueue packet to transmit queue:\n",
+		qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+	rte_pktmbuf_dump(stderr, sendmsg, 128);
+#endif
+
+	if (tx_backlog_count(qp) == TX_BACKLOG_SIZE) {
+		qp->stats.tx_backlog_drop++;
+		rte_pktmbuf_free(sendmsg);
+		return;
+	}
+	qp->txq[qp->txq_tail++ & (TX_BACKLOG_SIZE - 1)] = sendmsg;
 
-	payload_length = rte_pktmbuf_pkt_len(sendmsg);
-	udp = (struct udp_hdr *)rte_pktmbuf_prepend(sendmsg, sizeof(*udp));
-	udp->src_port = src_port;
-	udp->dst_port = dst_port;
-	udp->dgram_cksum = 0;
-	udp->dgram_len = rte_cpu_to_be_16(sizeof(*udp) + payload_length);
-	sendmsg->l4_len = sizeof(*udp);
+	count = tx_backlog_count(qp);
+	if (count > qp->stats.tx_backlog_max) {
+		qp->stats.tx_backlog_max = count;
+	}
+	if (count >= qp->tx_burst_size) {
+		RTE_LOG(DEBUG, USER1, "TX queue filled; early flush forced\n");
+		flush_tx_queue(qp);
+	}
+} /* enqueue_tx_frame */
+
+/** Fills in the Ethernet, IPv4 and UDP headers that are the same for every
+ * datagram sent on this queue pair, along with the partial checksums of the
+ * IPv4 header and UDP pseudo-header with all length fields set to 0.
+ * send_udp_dgram() copies the template in front of each datagram and only
+ * has to patch in the lengths and checksums.  Must be called once the
+ * remote endpoint is known. */
+static void
+build_tx_hdr_template(struct usiw_qp *qp)
+{
+	struct usiw_tx_hdr *hdr = &qp->tx_hdr;
+
+	memset(hdr, 0, sizeof(*hdr));
+	ether_addr_copy(&qp->shm_qp->remote_ether_addr, &hdr->eth.d_addr);
+	ether_addr_copy(&qp->dev->ether_addr, &hdr->eth.s_addr);
+	hdr->eth.ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	hdr->ip.version_ihl = 0x45;
+	hdr->ip.type_of_service = 0;
+	hdr->ip.packet_id = 0;
+	hdr->ip.fragment_offset = 0;
+	hdr->ip.time_to_live = 64;
+	hdr->ip.next_proto_id = IP_HDR_PROTO_UDP;
+	hdr->ip.hdr_checksum = 0;
+	hdr->ip.src_addr = qp->dev->ipv4_addr;
+	hdr->ip.dst_addr = qp->shm_qp->remote_ipv4_addr;
+
+	hdr->udp.src_port = qp->shm_qp->local_udp_port;
+	hdr->udp.dst_port = qp->shm_qp->remote_udp_port;
+	hdr->udp.dgram_len = 0;
+	hdr->udp.dgram_cksum = 0;
+
+	/* With total_length equal to the IP header length, the pseudo-header
+	 * has a UDP length of 0 */
+	hdr->ip.total_length = rte_cpu_to_be_16(sizeof(hdr->ip));
+	qp->tx_hdr_udp_cksum = rte_ipv4_phdr_cksum(&hdr->ip, 0);
+	hdr->ip.total_length = 0;
+	qp->tx_hdr_ip_cksum = rte_raw_cksum(&hdr->ip, sizeof(hdr->ip));
+	if (!(qp->dev->flags & port_checksum_offload)) {
+		qp->tx_hdr_udp_cksum = cksum_fold((uint32_t)qp->tx_hdr_udp_cksum
+				+ hdr->udp.src_port + hdr->udp.dst_port);
+	}
+} /* build_tx_hdr_template */
 
-	return udp;
-} /* prepend_udp_header */
+/** Fills in the header values that every datagram received on this queue pair
+ * must have, and the mask of the bits to compare: the Ethernet type and our
+ * MAC address, an IPv4 header without options that is not a fragment, and
+ * the UDP/IPv4 addresses and ports of both ends.  Must be called after
+ * build_tx_hdr_template(). */
+static void
+build_rx_hdr_match(struct usiw_qp *qp)
+{
+	union usiw_rx_hdr_match *value = &qp->rx_hdr_value;
+	union usiw_rx_hdr_match *mask = &qp->rx_hdr_mask;
+
+	memset(value, 0, sizeof(*value));
+	memset(mask, 0, sizeof(*mask));
+
+	ether_addr_copy(&qp->tx_hdr.eth.s_addr, &value->hdr.eth.d_addr);
+	memset(&mask->hdr.eth.d_addr, 0xff, sizeof(mask->hdr.eth.d_addr));
+	value->hdr.eth.ether_type = qp->tx_hdr.eth.ether_type;
+	mask->hdr.eth.ether_type = UINT16_MAX;
+
+	value->hdr.ip.version_ihl = qp->tx_hdr.ip.version_ihl;
+	mask->hdr.ip.version_ihl = UINT8_MAX;
+	/* Neither the More Fragments flag nor the fragment offset */
+	mask->hdr.ip.fragment_offset = rte_cpu_to_be_16(0x3fff);
+	value->hdr.ip.next_proto_id = IP_HDR_PROTO_UDP;
+	mask->hdr.ip.next_proto_id = UINT8_MAX;
+	value->hdr.ip.src_addr = qp->tx_hdr.ip.dst_addr;
+	mask->hdr.ip.src_addr = UINT32_MAX;
+	value->hdr.ip.dst_addr = qp->tx_hdr.ip.src_addr;
+	mask->hdr.ip.dst_addr = UINT32_MAX;
+
+	value->hdr.udp.src_port = qp->tx_hdr.udp.dst_port;
+	mask->hdr.udp.src_port = UINT16_MAX;
+	value->hdr.udp.dst_port = qp->tx_hdr.udp.src_port;
+	mask->hdr.udp.dst_port = UINT16_MAX;
+} /* build_rx_hdr_match */
+
+/** Returns true if the headers at the start of the received frame pkt match
+ * those expected by build_rx_hdr_match().  The frame must be at least
+ * sizeof(union usiw_rx_hdr_match) bytes long. */
+static inline bool
+rx_hdr_match(struct usiw_qp *qp, const void *pkt)
+{
+#ifdef __SSE2__
+	const __m128i *p = pkt;
+	__m128i diff;
+	unsigned int i;
+
+	diff = _mm_setzero_si128();
+	for (i = 0; i < sizeof(qp->rx_hdr_value) / sizeof(*p); ++i) {
+		diff = _mm_or_si128(diff, _mm_and_si128(
+				_mm_xor_si128(_mm_loadu_si128(p + i),
+					_mm_loadu_si128((__m128i *)
+						&qp->rx_hdr_value + i)),
+				_mm_loadu_si128((__m128i *)
+						&qp->rx_hdr_mask + i)));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+					_mm_setzero_si128())) == 0xffff;
+#else
+	uint64_t diff, word;
+	unsigned int i;
+
+	diff = 0;
+	for (i = 0; i < RTE_DIM(qp->rx_hdr_value.words); ++i) {
+		memcpy(&word, (const uint64_t *)pkt + i, sizeof(word));
+		diff |= (word ^ qp->rx_hdr_value.words[i])
+				& qp->rx_hdr_mask.words[i];
+	}
+	return diff == 0;
+#endif
+} /* rx_hdr_match */
 
 /** Adds a UDP datagram to our packet TX queue to be transmitted when the queue
  * is next flushed.
@@ -436,45 +951,165 @@ prepend_udp_header(struct rte_mbuf *sendmsg, unsigned int src_port,
  *   The queue pair that is sending this datagram.
  * @param sendmsg
  *   The mbuf containing the datagram to send.
- * @param dest
- *   The address handle of the destination for this datagram.
  * @param payload_checksum
  *   The non-complemented checksum of the packet payload.  Ignored if
  *   checksum_offload is enabled.
+ * @param ecn
+ *   The ECN codepoint to place in the IPv4 header.
  */
 static void
 send_udp_dgram(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
-		uint32_t raw_cksum)
+		uint32_t raw_cksum, uint8_t ecn)
 {
-	struct udp_hdr *udp;
-	struct ipv4_hdr *ip;
+	struct usiw_tx_hdr *hdr;
+	uint16_t udp_length, ip_length;
+
+	udp_length = rte_pktmbuf_pkt_len(sendmsg) + sizeof(hdr->udp);
+	ip_length = udp_length + sizeof(hdr->ip);
+
+	hdr = (struct usiw_tx_hdr *)rte_pktmbuf_prepend(sendmsg, sizeof(*hdr));
+	rte_memcpy(hdr, &qp->tx_hdr, sizeof(*hdr));
+	hdr->ip.type_of_service = ecn;
+	hdr->ip.total_length = rte_cpu_to_be_16(ip_length);
+	hdr->udp.dgram_len = rte_cpu_to_be_16(udp_length);
+	sendmsg->l2_len = sizeof(hdr->eth);
+	sendmsg->l3_len = sizeof(hdr->ip);
+	sendmsg->l4_len = sizeof(hdr->udp);
 
 	if (qp->dev->flags & port_checksum_offload) {
 		sendmsg->ol_flags
 			|= PKT_TX_UDP_CKSUM|PKT_TX_IPV4|PKT_TX_IP_CKSUM;
+		/* The NIC expects the pseudo-header checksum */
+		hdr->udp.dgram_cksum = cksum_fold((uint32_t)qp->tx_hdr_udp_cksum
+				+ hdr->udp.dgram_len);
+	} else {
+		/* The template has a type of service of 0, so add in the
+		 * ECN codepoint, which shares a word with version_ihl */
+		hdr->ip.hdr_checksum = ~cksum_fold((uint32_t)qp->tx_hdr_ip_cksum
+				+ hdr->ip.total_length
+				+ rte_cpu_to_be_16(ecn));
+		/* The UDP length is counted once in the pseudo-header and once
+		 * in the UDP header itself */
+		raw_cksum = cksum_fold(raw_cksum + qp->tx_hdr_udp_cksum
+				+ 2 * (uint32_t)hdr->udp.dgram_len);
+		hdr->udp.dgram_cksum = (raw_cksum == UINT16_MAX) ? UINT16_MAX
+					: ~raw_cksum;
 	}
 
-	udp = prepend_udp_header(sendmsg, qp->shm_qp->local_udp_port,
-			qp->shm_qp->remote_udp_port);
-	ip = prepend_ipv4_header(sendmsg, IP_HDR_PROTO_UDP,
-			qp->dev->ipv4_addr,
-			qp->shm_qp->remote_ipv4_addr);
+	enqueue_tx_frame(qp, sendmsg);
+} /* send_udp_dgram */
+
+/** Takes an extra reference on every segment of the DDP segment sendmsg, so
+ * that it can be chained behind a TRP header and handed to the NIC, which
+ * frees it once transmitted, while it stays in tx_pending until it is
+ * acknowledged.  Neither the header nor the NIC modify the segments of
+ * sendmsg, so the same chain may be in flight more than once if it is
+ * retransmitted before an earlier transmission completes. */
+static void
+ref_ddp_segment(struct rte_mbuf *sendmsg)
+{
+	struct rte_mbuf *seg;
 
-	udp->dgram_cksum = rte_ipv4_phdr_cksum(ip, sendmsg->ol_flags);
-	if (!(sendmsg->ol_flags & PKT_TX_UDP_CKSUM)) {
-		raw_cksum += udp->dgram_cksum + udp->src_port
-					+ udp->dst_port + udp->dgram_len;
-		/* Add any carry bits into the checksum. */
-		while (raw_cksum > UINT16_MAX) {
-			raw_cksum = (raw_cksum >> 16) + (raw_cksum & 0xffff);
-		}
-		udp->dgram_cksum = (raw_cksum == UINT16_MAX) ? UINT16_MAX
-					: ~raw_cksum;
+	for (seg = sendmsg; seg != NULL; seg = seg->next) {
+		rte_mbuf_refcnt_update(seg, 1);
 	}
+} /* ref_ddp_segment */
+
+/** Returns the non-complemented checksum of all data in the mbuf chain. */
+static uint16_t
+raw_cksum_chain(struct rte_mbuf *m)
+{
+	uint32_t sum;
+	size_t offset;
+
+	sum = 0;
+	for (offset = 0; m != NULL; offset += m->data_len, m = m->next) {
+		sum = cksum_add(sum, cksum_raw(rte_pktmbuf_mtod(m, void *),
+					m->data_len), offset);
+	}
+	return cksum_fold(sum);
+} /* raw_cksum_chain */
+
+/** Returns the number of packets beyond recv_ack_psn that the peer may send
+ * to us, to be placed in the Credits field of each outgoing TRP header.  This
+ * is limited by our receive window, and by the free space in the software
+ * receive ring if we are not using flow director.  On a shared hardware queue,
+ * the receive window covers the descriptors of the whole queue, so it is
+ * divided evenly among the queue pairs bound to it, but each may always send
+ * at least one packet.  If a datagram marked
+ * Congestion Experienced has arrived since the last TRP header we sent, the
+ * result also has trp_ecn_echo set, which is then cleared. */
+static uint16_t
+trp_recv_credits(struct ee_state *ep)
+{
+	uint32_t credits;
+
+	credits = RTE_MIN(ep->recv_window_size - 1, trp_credits_mask);
+	if (ep->shared_queue) {
+		credits = RTE_MIN(credits, RTE_MAX(ep->recv_window_size
+				/ atomic_load(&ep->shared_queue->qp_count),
+				2u) - 1);
+	}
+	if (ep->rx_queue) {
+		/* The peer may send one datagram more than we advertise */
+		credits = RTE_MIN(credits,
+				RTE_MAX(rte_ring_free_count(ep->rx_queue), 1u)
+				- 1);
+	}
+	if (ep->trp_flags & trp_recv_ce) {
+		ep->trp_flags &= ~trp_recv_ce;
+		credits |= trp_ecn_echo;
+	}
+	return credits;
+} /* trp_recv_credits */
+
+
+/** Records that the TRP header about to be sent carries our current
+ * acknowledgement, so that no separate acknowledgement is needed for the
+ * datagrams received so far. */
+static void
+trp_ack_sent(struct ee_state *ep)
+{
+	ep->trp_flags &= ~(trp_ack_update|trp_ack_now|trp_ack_delayed);
+	ep->ack_pending_count = 0;
+} /* trp_ack_sent */
+
+
+/** Returns true if the acknowledgement owed to the peer must be sent now
+ * rather than waiting for a data packet to carry it: once ack_segments
+ * datagrams are unacknowledged, once ack_delay has passed since the first of
+ * them arrived, or right away if trp_ack_now is set. */
+static bool
+trp_ack_due(struct ee_state *ep, uint64_t now)
+{
+	if ((ep->trp_flags & trp_ack_now)
+			|| ep->ack_pending_count >= ep->ack_segments) {
+		return true;
+	}
+	if (!(ep->trp_flags & trp_ack_delayed)) {
+		ep->trp_flags |= trp_ack_delayed;
+		ep->ack_deadline = now + ep->ack_delay;
+	}
+	return now >= ep->ack_deadline;
+} /* trp_ack_due */
+
+
+/** Updates the send window with the ack_psn and Credits fields of a TRP
+ * header received from the peer.  We never allow more packets in flight than
+ * there are entries in tx_pending.  An acknowledgement older than one already
+ * seen, such as a delayed standalone acknowledgement reordered behind later
+ * datagrams, is ignored so that the window never moves backwards. */
+static void
+trp_update_send_window(struct ee_state *ep, uint32_t ack_psn, uint16_t credits)
+{
+	if (serial_less_32(ack_psn, ep->send_last_acked_psn)) {
+		return;
+	}
+	ep->send_last_acked_psn = ack_psn;
+	ep->send_max_psn = ack_psn + RTE_MIN((uint32_t)credits + 1,
+			(uint32_t)ep->tx_pending_size);
+} /* trp_update_send_window */
 
-	enqueue_ether_frame(sendmsg, ETHER_TYPE_IPv4, qp,
-			&qp->shm_qp->remote_ether_addr);
-} /* send_udp_dgram */
 
 static int
 resend_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
@@ -484,35 +1119,50 @@ resend_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 	struct rte_mbuf *hdr;
 	struct trp_hdr *trp;
 	uint32_t payload_raw_cksum = 0;
+	uint64_t now, timeout;
 
 	info = (struct pending_datagram_info *)(sendmsg + 1);
-	info->next_retransmit = rte_get_timer_cycles()
-		+ rte_get_timer_hz() / 100;
-	if (info->transmit_count++ > RETRANSMIT_MAX) {
+	now = rte_get_timer_cycles();
+	if (info->transmit_count == 0) {
+		info->first_send_time = now;
+	} else if (now - info->first_send_time >= ep->rto_max) {
+		/* Give up once the backoff has spent the longest timeout we
+		 * would ever wait, however small the RTO was to start with */
 		return -EIO;
 	}
+	info->transmit_count++;
+	/* Back off exponentially each time the same segment is lost */
+	timeout = RTE_MIN(ep->rto << RTE_MIN(info->transmit_count - 1, 32),
+			ep->rto_max);
+	info->send_time = now;
+	timer_wheel_arm(&ep->retransmit_timers, &info->retransmit,
+			info->send_time + timeout);
 
 	hdr = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
 	if (!hdr) {
 		return -ENOMEM;
 	}
-
-	sendmsg = rte_pktmbuf_clone(sendmsg, sendmsg->pool);
+	ref_ddp_segment(sendmsg);
 
 	trp = (struct trp_hdr *)rte_pktmbuf_append(hdr, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(info->psn);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
-	trp->opcode = rte_cpu_to_be_16(0);
-	if (!(ep->trp_flags & trp_recv_missing)) {
-		ep->trp_flags &= ~trp_ack_update;
+	trp->opcode = rte_cpu_to_be_16(((info->flags & pending_coalesced)
+				? trp_coalesced : 0) | trp_recv_credits(ep));
+	if ((ep->trp_flags & (trp_ack_update|trp_recv_missing))
+			== trp_ack_update) {
+		qp->stats.ack_piggybacked++;
+		trp_ack_sent(ep);
 	}
 
-	rte_pktmbuf_chain(hdr, sendmsg);
-	if (!qp->dev->flags & port_checksum_offload) {
+	/* sendmsg stays in tx_pending and is linked again on retransmission */
+	pktmbuf_chain_shared(hdr, sendmsg);
+	if (!(qp->dev->flags & port_checksum_offload)) {
 		payload_raw_cksum = info->ddp_raw_cksum
 			+ rte_raw_cksum(trp, sizeof(*trp));
 	}
-	send_udp_dgram(qp, hdr, payload_raw_cksum);
+	send_udp_dgram(qp, hdr, payload_raw_cksum,
+			ep->ecn ? IPTOS_ECN_ECT0 : IPTOS_ECN_NOT_ECT);
 
 	return 0;
 } /* resend_ddp_segment */
@@ -525,53 +1175,237 @@ tx_pending_entry(struct ee_state *ep, uint32_t psn)
 
 } /* tx_pending_entry */
 
-static uint32_t
-send_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
-		struct ee_state *ep, struct usiw_send_wqe *wqe,
-		size_t payload_length)
+/** Transmits the datagram for the first time.  All fields of its
+ * pending_datagram_info that describe the payload, including the PSN and the
+ * checksum, must already be filled in. */
+static void
+transmit_ddp_datagram(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		struct ee_state *ep)
 {
 	struct pending_datagram_info *pending;
-	uint32_t psn = ep->send_next_psn++;
 
 	pending = (struct pending_datagram_info *)(sendmsg + 1);
-	pending->wqe = wqe;
+	timer_wheel_entry_init(&pending->retransmit);
 	pending->transmit_count = 0;
-	pending->ddp_length = payload_length;
-	if (!qp->dev->flags & port_checksum_offload) {
-		pending->ddp_raw_cksum = rte_raw_cksum(
-				rte_pktmbuf_mtod(sendmsg, void *),
-				rte_pktmbuf_data_len(sendmsg));
-	}
-	pending->psn = psn;
 
-	assert(*tx_pending_entry(ep, psn) == NULL);
-	*tx_pending_entry(ep, psn) = sendmsg;
+	assert(*tx_pending_entry(ep, pending->psn) == NULL);
+	*tx_pending_entry(ep, pending->psn) = sendmsg;
 
+	tx_pacing_charge(qp, rte_pktmbuf_pkt_len(sendmsg));
 	resend_ddp_segment(qp, sendmsg, ep);
-	return psn;
-} /* send_ddp_segment */
+} /* transmit_ddp_datagram */
 
 
+/** Sends the datagram of coalesced segments for this endpoint, if any. */
 static void
-send_trp_sack(struct usiw_qp *qp)
+flush_coalesced_segments(struct usiw_qp *qp, struct ee_state *ep)
 {
-	struct rte_mbuf *sendmsg;
-	struct ee_state *ep = &qp->remote_ep;
-	struct trp_hdr *trp;
+	struct rte_mbuf *sendmsg = ep->coalesce_msg;
 
-	assert(ep->trp_flags & trp_recv_missing);
-	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
-	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
-	trp->psn = rte_cpu_to_be_32(ep->recv_sack_psn.min);
-	trp->ack_psn = rte_cpu_to_be_32(ep->recv_sack_psn.max);
-	trp->opcode = rte_cpu_to_be_16(trp_sack);
-
-	ep->trp_flags &= ~trp_ack_update;
+	if (sendmsg) {
+		ep->coalesce_msg = NULL;
+		transmit_ddp_datagram(qp, sendmsg, ep);
+	}
+} /* flush_coalesced_segments */
 
-	send_udp_dgram(qp, sendmsg,
-			(qp->dev->flags & port_checksum_offload)
-					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
-} /* send_trp_sack */
+
+/** Sends the DDP segment sendmsg, whose raw checksum raw_cksum has already
+ * been computed (or is ignored if the NIC computes checksums). */
+static uint32_t
+send_ddp_segment_cksum(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		struct ee_state *ep, struct usiw_send_wqe *wqe,
+		size_t payload_length, uint16_t raw_cksum)
+{
+	struct pending_datagram_info *pending;
+
+	/* Any coalesced datagram already holds an earlier PSN */
+	flush_coalesced_segments(qp, ep);
+
+	pending = (struct pending_datagram_info *)(sendmsg + 1);
+	pending->wqe = wqe;
+	pending->wqe_count = 1;
+	pending->flags = 0;
+	pending->ddp_length = payload_length;
+	pending->ddp_raw_cksum = raw_cksum;
+	pending->psn = ep->send_next_psn++;
+
+	transmit_ddp_datagram(qp, sendmsg, ep);
+	return pending->psn;
+} /* send_ddp_segment_cksum */
+
+
+static uint32_t
+send_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		struct ee_state *ep, struct usiw_send_wqe *wqe,
+		size_t payload_length)
+{
+	return send_ddp_segment_cksum(qp, sendmsg, ep, wqe, payload_length,
+			(qp->dev->flags & port_checksum_offload)
+			? 0 : raw_cksum_chain(sendmsg));
+} /* send_ddp_segment */
+
+
+/** Returns the mbuf to which the DDP header and payload of the next segment
+ * of wqe should be appended.  If the whole message fits in a single segment
+ * no longer than coalesce_max, this is the endpoint's coalesced datagram with
+ * the segment length already appended, and the caller must not send it;
+ * otherwise it is a new mbuf to pass to send_ddp_segment().  Returns NULL if
+ * no mbuf or PSN is available. */
+static struct rte_mbuf *
+alloc_ddp_segment(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
+		size_t hdr_length, size_t payload_length)
+{
+	struct pending_datagram_info *pending;
+	struct ee_state *ep = wqe->remote_ep;
+	struct rte_mbuf *sendmsg;
+	uint16_t seg_length;
+
+	if (wqe->bytes_sent != 0 || payload_length != wqe->total_length
+			|| payload_length > ep->coalesce_max) {
+		return rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+	}
+
+	seg_length = hdr_length + payload_length;
+	sendmsg = ep->coalesce_msg;
+	if (sendmsg && rte_pktmbuf_pkt_len(sendmsg) + sizeof(seg_length)
+				+ seg_length > qp->shm_qp->mtu) {
+		flush_coalesced_segments(qp, ep);
+		sendmsg = NULL;
+		if (!tx_window_open(qp, ep)) {
+			return NULL;
+		}
+	}
+
+	if (sendmsg) {
+		pending = (struct pending_datagram_info *)(sendmsg + 1);
+	} else {
+		sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+		if (!sendmsg) {
+			return NULL;
+		}
+		pending = (struct pending_datagram_info *)(sendmsg + 1);
+		pending->wqe = wqe;
+		pending->wqe_count = 0;
+		pending->flags = pending_coalesced;
+		pending->ddp_length = 0;
+		pending->ddp_raw_cksum = 0;
+		pending->psn = ep->send_next_psn++;
+		ep->coalesce_msg = sendmsg;
+	}
+
+	pending->wqe_count++;
+	pending->ddp_length += payload_length;
+	*(uint16_t *)rte_pktmbuf_append(sendmsg, sizeof(seg_length))
+		= rte_cpu_to_be_16(seg_length);
+	return sendmsg;
+} /* alloc_ddp_segment */
+
+
+/** Sends a segment built in an mbuf returned by alloc_ddp_segment(), unless
+ * it was added to the coalesced datagram.  The last seg_length bytes of
+ * sendmsg are the DDP header and payload, with raw checksum seg_cksum. */
+static void
+finish_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		struct usiw_send_wqe *wqe, size_t seg_length,
+		size_t payload_length, uint16_t seg_cksum)
+{
+	struct pending_datagram_info *pending;
+	struct ee_state *ep = wqe->remote_ep;
+	size_t seg_offset;
+	uint16_t *prefix;
+
+	if (sendmsg != ep->coalesce_msg) {
+		send_ddp_segment_cksum(qp, sendmsg, ep, wqe, payload_length,
+				seg_cksum);
+		return;
+	}
+
+	if (!(qp->dev->flags & port_checksum_offload)) {
+		/* The length prefix is at the same parity as the segment */
+		pending = (struct pending_datagram_info *)(sendmsg + 1);
+		seg_offset = rte_pktmbuf_pkt_len(sendmsg) - seg_length;
+		prefix = rte_pktmbuf_mtod_offset(sendmsg, uint16_t *,
+				seg_offset - sizeof(*prefix));
+		pending->ddp_raw_cksum = cksum_add(pending->ddp_raw_cksum,
+				cksum_fold((uint32_t)seg_cksum + *prefix),
+				seg_offset);
+	}
+} /* finish_ddp_segment */
+
+
+static inline bool
+recv_bitmap_test(struct ee_state *ep, uint32_t psn)
+{
+	uint32_t bit = psn & (ep->recv_window_size - 1);
+	return ep->recv_bitmap[bit / 64] & (UINT64_C(1) << (bit % 64));
+} /* recv_bitmap_test */
+
+static inline void
+recv_bitmap_set(struct ee_state *ep, uint32_t psn)
+{
+	uint32_t bit = psn & (ep->recv_window_size - 1);
+	ep->recv_bitmap[bit / 64] |= UINT64_C(1) << (bit % 64);
+} /* recv_bitmap_set */
+
+static inline void
+recv_bitmap_clear(struct ee_state *ep, uint32_t psn)
+{
+	uint32_t bit = psn & (ep->recv_window_size - 1);
+	ep->recv_bitmap[bit / 64] &= ~(UINT64_C(1) << (bit % 64));
+} /* recv_bitmap_clear */
+
+
+static void
+send_trp_sack(struct usiw_qp *qp)
+{
+	struct rte_mbuf *sendmsg;
+	struct ee_state *ep = &qp->remote_ep;
+	struct trp_sack_range *range;
+	struct trp_sack *sack;
+	struct trp_hdr *trp;
+	unsigned int count;
+	uint32_t psn;
+
+	assert(ep->trp_flags & trp_recv_missing);
+	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
+	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
+	trp->psn = rte_cpu_to_be_32(ep->send_next_psn);
+	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
+	trp->opcode = rte_cpu_to_be_16(trp_sack | trp_recv_credits(ep));
+	sack = (struct trp_sack *)rte_pktmbuf_append(sendmsg, sizeof(*sack));
+	sack->reserved = 0;
+
+	/* Describe each run of received PSNs between recv_ack_psn (which is
+	 * by definition missing) and the highest PSN received so far. */
+	count = 0;
+	psn = ep->recv_ack_psn + 1;
+	while (count < TRP_SACK_RANGES_MAX
+			&& serial_less_32(psn, ep->recv_sack_max_psn)) {
+		if (!recv_bitmap_test(ep, psn)) {
+			psn++;
+			continue;
+		}
+		range = (struct trp_sack_range *)rte_pktmbuf_append(sendmsg,
+				sizeof(*range));
+		range->min = rte_cpu_to_be_32(psn);
+		do {
+			psn++;
+		} while (psn != ep->recv_sack_max_psn
+				&& recv_bitmap_test(ep, psn));
+		range->max = rte_cpu_to_be_32(psn);
+		count++;
+	}
+	sack->range_count = rte_cpu_to_be_16(count);
+
+	qp->stats.ack_pure++;
+	trp_ack_sent(ep);
+
+	send_udp_dgram(qp, sendmsg,
+			(qp->dev->flags & port_checksum_offload)
+					? 0 : rte_raw_cksum(trp,
+						rte_pktmbuf_data_len(sendmsg)),
+			IPTOS_ECN_NOT_ECT);
+} /* send_trp_sack */
 
 
 static void
@@ -580,24 +1414,32 @@ send_trp_fin(struct usiw_qp *qp)
 	struct ee_state *ep = &qp->remote_ep;
 	struct rte_mbuf *sendmsg;
 	struct trp_hdr *trp;
+	uint64_t deadline;
 
 	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
 	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(ep->send_next_psn);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
-	trp->opcode = rte_cpu_to_be_16(trp_fin);
+	trp->opcode = rte_cpu_to_be_16(trp_fin | trp_recv_credits(ep));
 
 	if (!(ep->trp_flags & trp_recv_missing)) {
-		ep->trp_flags &= ~trp_ack_update;
+		trp_ack_sent(ep);
 	}
 
 	send_udp_dgram(qp, sendmsg,
 			(qp->dev->flags & port_checksum_offload)
-					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
-
-	/* Force flush of TX queue since we are shutting down, but we still
-	 * need the receiver to get the FIN packet */
-	flush_tx_queue(qp);
+					? 0 : rte_raw_cksum(trp, sizeof(*trp)),
+			IPTOS_ECN_NOT_ECT);
+
+	/* This queue pair will not be progressed again, but we still need the
+	 * receiver to get the FIN packet, so give the NIC up to a millisecond
+	 * to take it.  Whatever is left is discarded when the queue pair is
+	 * destroyed. */
+	deadline = rte_get_timer_cycles() + rte_get_timer_hz() / 1000;
+	do {
+		flush_tx_queue(qp);
+	} while (tx_backlog_count(qp) != 0
+			&& rte_get_timer_cycles() < deadline);
 } /* send_trp_fin */
 
 
@@ -613,12 +1455,14 @@ send_trp_ack(struct usiw_qp *qp)
 	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(ep->send_next_psn);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
-	trp->opcode = rte_cpu_to_be_16(0);
-	ep->trp_flags &= ~trp_ack_update;
+	trp->opcode = rte_cpu_to_be_16(trp_recv_credits(ep));
+	qp->stats.ack_pure++;
+	trp_ack_sent(ep);
 
 	send_udp_dgram(qp, sendmsg,
 			(qp->dev->flags & port_checksum_offload)
-					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
+					? 0 : rte_raw_cksum(trp, sizeof(*trp)),
+			IPTOS_ECN_NOT_ECT);
 } /* send_trp_ack */
 
 
@@ -642,7 +1486,8 @@ static void
 qp_free_recv_wqe(struct usiw_qp *qp, struct usiw_recv_wqe *wqe)
 {
 	usiw_recv_wqe_queue_del_active(&qp->rq0, wqe);
-	rte_ring_enqueue(qp->rq0.free_ring, wqe);
+	rte_ring_enqueue(qp->srq ? qp->srq->rq.free_ring : qp->rq0.free_ring,
+			wqe);
 } /* qp_free_recv_wqe */
 
 
@@ -694,31 +1539,156 @@ get_next_cqe(struct usiw_cq *cq, struct usiw_wc **cqe)
 	return 0;
 } /* get_next_cqe */
 
-/** Places a filled-in CQE into the completion queue.  This releases the lock on
- * the CQ, which must have been acquired previously via get_next_cqe(). */
+/** Places count filled-in CQEs onto the cqe_ring of the CQ with a single ring
+ * operation.  Returns true if the application asked to be notified of the next
+ * completion on this CQ, in which case the caller must write a
+ * SIW_EVENT_COMP_POSTED event for it. */
+static bool
+cq_publish(struct usiw_cq *cq, struct usiw_wc **cqe, unsigned int count)
+{
+	int ret;
+
+	ret = rte_ring_enqueue_bulk(cq->cqe_ring, (void **)cqe, count);
+	assert(ret == 0);
+	return atomic_exchange(&cq->notify_flag, false);
+} /* cq_publish */
+
+
+/** Writes the events in iov to the event file of ctx with one system call.
+ * The kernel module takes each iovec as a separate event. */
+static void
+write_events(struct usiw_context *ctx, struct iovec *iov, int iovcnt)
+{
+	size_t length;
+	ssize_t ret;
+	int i;
+
+	length = 0;
+	for (i = 0; i < iovcnt; ++i) {
+		length += iov[i].iov_len;
+	}
+	ret = writev(ctx->event_fd, iov, iovcnt);
+	if (ret < 0) {
+		RTE_LOG(ERR, USER1, "write to event fd: %s\n",
+				strerror(errno));
+	} else if ((size_t)ret < length) {
+		RTE_LOG(ERR, USER1, "partial write to event fd: %zd/%zu bytes\n",
+				ret, length);
+	}
+} /* write_events */
+
+
+/** Publishes all CQEs staged in batch and empties it.  The SRQ limit events
+ * and CQ events of each context are written to its event file at once. */
+static void
+cqe_batch_flush(struct usiw_cqe_batch *batch)
+{
+	struct urdma_cq_event cq_event[CQE_BATCH_CQ_MAX];
+	struct usiw_context *ctx[CQE_BATCH_CQ_MAX + CQE_BATCH_SRQ_EVENT_MAX];
+	struct iovec event[CQE_BATCH_CQ_MAX + CQE_BATCH_SRQ_EVENT_MAX];
+	struct iovec iov[CQE_BATCH_CQ_MAX + CQE_BATCH_SRQ_EVENT_MAX];
+	unsigned int i, j, event_count;
+	int iovcnt;
+
+	event_count = 0;
+	for (i = 0; i < batch->srq_event_count; ++i) {
+		ctx[event_count] = batch->srq_event[i].ctx;
+		event[event_count].iov_base = &batch->srq_event[i].event;
+		event[event_count].iov_len = sizeof(batch->srq_event[i].event);
+		event_count++;
+	}
+	batch->srq_event_count = 0;
+
+	for (i = 0; i < batch->cq_count; ++i) {
+		struct usiw_cq *cq = batch->entry[i].cq;
+		if (!cq_publish(cq, batch->entry[i].cqe,
+					batch->entry[i].count)) {
+			continue;
+		}
+		ctx[event_count] = usiw_get_context(cq->ib_cq.context);
+		assert(ctx[event_count] != NULL);
+		if (!ctx[event_count]) {
+			continue;
+		}
+		cq_event[i].event_type = SIW_EVENT_COMP_POSTED;
+		cq_event[i].cq_id = cq->cq_id;
+		event[event_count].iov_base = &cq_event[i];
+		event[event_count].iov_len = sizeof(cq_event[i]);
+		event_count++;
+	}
+	batch->cq_count = 0;
+
+	for (i = 0; i < event_count; ++i) {
+		if (!ctx[i]) {
+			continue;
+		}
+		iovcnt = 0;
+		for (j = i; j < event_count; ++j) {
+			if (ctx[j] == ctx[i]) {
+				iov[iovcnt++] = event[j];
+				if (j != i) {
+					ctx[j] = NULL;
+				}
+			}
+		}
+		write_events(ctx[i], iov, iovcnt);
+	}
+} /* cqe_batch_flush */
+
+
+/** Stages a filled-in CQE in batch.  The batch is flushed first if it has no
+ * room for another CQ, and afterwards if the CQE filled its CQ's entry. */
+static void
+cqe_batch_add(struct usiw_cqe_batch *batch, struct usiw_cq *cq,
+		struct usiw_wc *cqe)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->cq_count; ++i) {
+		if (batch->entry[i].cq == cq) {
+			break;
+		}
+	}
+	if (i == batch->cq_count) {
+		if (batch->cq_count == CQE_BATCH_CQ_MAX) {
+			cqe_batch_flush(batch);
+			i = 0;
+		}
+		batch->entry[i].cq = cq;
+		batch->entry[i].count = 0;
+		batch->cq_count++;
+	}
+
+	batch->entry[i].cqe[batch->entry[i].count++] = cqe;
+	if (batch->entry[i].count == CQE_BATCH_SIZE) {
+		cqe_batch_flush(batch);
+	}
+} /* cqe_batch_add */
+
+
+/** Places a filled-in CQE, obtained from get_next_cqe(), into the completion
+ * queue.  If the queue pair is being progressed with a CQE batch, the CQE only
+ * becomes visible to the application once the batch is flushed. */
 static void
-finish_post_cqe(struct usiw_cq *cq, struct usiw_wc *cqe)
+finish_post_cqe(struct usiw_qp *qp, struct usiw_cq *cq, struct usiw_wc *cqe)
 {
 	struct urdma_cq_event event;
 	struct usiw_context *ctx;
-	ssize_t ret;
+	struct iovec iov;
+
+	if (qp->cqe_batch) {
+		cqe_batch_add(qp->cqe_batch, cq, cqe);
+		return;
+	}
 
-	ret = rte_ring_enqueue(cq->cqe_ring, cqe);
-	assert(ret == 0);
 	ctx = usiw_get_context(cq->ib_cq.context);
 	assert(ctx != NULL);
-
-	if (ctx && atomic_exchange(&cq->notify_flag, false)) {
+	if (cq_publish(cq, &cqe, 1) && ctx) {
 		event.event_type = SIW_EVENT_COMP_POSTED;
 		event.cq_id = cq->cq_id;
-		ret = write(ctx->event_fd, &event, sizeof(event));
-		if (ret < 0) {
-			RTE_LOG(ERR, USER1, "write to event fd: %s\n",
-					strerror(errno));
-		} else if ((size_t)ret < sizeof(event)) {
-			RTE_LOG(ERR, USER1, "partial write to event fd: %zd/%zu bytes\n",
-					ret, sizeof(event));
-		}
+		iov.iov_base = &event;
+		iov.iov_len = sizeof(event);
+		write_events(ctx, &iov, 1);
 	}
 } /* finish_post_cqe */
 
@@ -749,7 +1719,7 @@ post_recv_cqe(struct usiw_qp *qp, struct usiw_recv_wqe *wqe,
 	cqe->qp_num = qp->ib_qp.qp_num;
 
 	qp_free_recv_wqe(qp, wqe);
-	finish_post_cqe(cq, cqe);
+	finish_post_cqe(qp, cq, cqe);
 	return 0;
 } /* post_recv_cqe */
 
@@ -796,7 +1766,7 @@ post_send_cqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 	cqe->qp_num = qp->ib_qp.qp_num;
 
 	qp_free_send_wqe(qp, wqe, true);
-	finish_post_cqe(cq, cqe);
+	finish_post_cqe(qp, cq, cqe);
 	return 0;
 } /* post_send_cqe */
 
@@ -804,15 +1774,23 @@ post_send_cqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 static void
 rq_flush(struct usiw_qp *qp)
 {
-	struct usiw_recv_wqe *wqe, **prev;
+	struct usiw_recv_wqe *wqe;
+	uint32_t i;
 
 	rte_spinlock_lock(&qp->rq0.lock);
-	while (rte_ring_dequeue(qp->rq0.ring, (void **)&wqe) == 0) {
+	/* WQEs still in an SRQ belong to no queue pair yet, and remain
+	 * available to the other queue pairs attached to it */
+	while (!qp->srq && rte_ring_dequeue(qp->rq0.ring, (void **)&wqe) == 0) {
 		wqe->msn = qp->remote_ep.expected_recv_msn++;
-		usiw_recv_wqe_queue_add_active(&qp->rq0, wqe);
+		if (usiw_recv_wqe_queue_add_active(&qp->rq0, wqe) < 0) {
+			post_recv_cqe(qp, wqe, IBV_WC_WR_FLUSH_ERR);
+		}
 	}
-	TAILQ_FOR_EACH(wqe, &qp->rq0.active_head, active, prev) {
-		post_recv_cqe(qp, wqe, IBV_WC_WR_FLUSH_ERR);
+	for (i = 0; i <= qp->rq0.active_mask; ++i) {
+		wqe = qp->rq0.active[i];
+		if (wqe) {
+			post_recv_cqe(qp, wqe, IBV_WC_WR_FLUSH_ERR);
+		}
 	}
 	rte_spinlock_unlock(&qp->rq0.lock);
 } /* rq_flush */
@@ -834,50 +1812,251 @@ sq_flush(struct usiw_qp *qp)
 } /* sq_flush */
 
 
-static void
+/** Copies dest_size bytes starting at offset within the src iovec array to
+ * dest.  If cksum is true, returns the raw checksum of the copied bytes,
+ * computed while copying; otherwise returns 0. */
+static uint16_t
 memcpy_from_iov(char * restrict dest, size_t dest_size,
 		const struct iovec * restrict src, size_t iov_count,
-		size_t offset)
+		size_t offset, bool cksum)
 {
 	unsigned y;
 	size_t prev, pos, cur;
 	char *src_iov_base;
+	uint32_t sum;
 
 	pos = 0;
+	sum = 0;
 	for (y = 0, prev = 0; pos < dest_size && y < iov_count; ++y) {
 		if (prev <= offset && offset < prev + src[y].iov_len) {
 			cur = RTE_MIN(prev + src[y].iov_len - offset,
 					dest_size - pos);
 			src_iov_base = src[y].iov_base;
-			rte_memcpy(dest + pos, src_iov_base + offset - prev,
-					cur);
+			if (cksum) {
+				sum = cksum_add(sum, cksum_copy(dest + pos,
+						src_iov_base + offset - prev,
+						cur), pos);
+			} else {
+				rte_memcpy(dest + pos,
+						src_iov_base + offset - prev,
+						cur);
+			}
 			pos += cur;
 			offset += cur;
 		}
 		prev += src[y].iov_len;
 	}
+	return cksum_fold(sum);
 } /* memcpy_from_iov */
 
 
+phys_addr_t
+hugepage_virt2phy(const char *vaddr, size_t *contig_len)
+{
+	const struct rte_memseg *ms;
+	const char *base;
+	unsigned int i;
+
+	ms = rte_eal_get_physmem_layout();
+	for (i = 0; i < RTE_MAX_MEMSEG && ms[i].addr != NULL; ++i) {
+		base = ms[i].addr;
+		if (base <= vaddr && vaddr < base + ms[i].len) {
+			*contig_len = base + ms[i].len - vaddr;
+			return ms[i].phys_addr + (vaddr - base);
+		}
+	}
+	return RTE_BAD_PHYS_ADDR;
+} /* hugepage_virt2phy */
+
+
+void
+usiw_mr_phys_range(const struct usiw_mr *mr, const char *vaddr,
+		struct usiw_phys_range *phys)
+{
+	size_t offset;
+
+	if (!mr || mr->phys.addr == RTE_BAD_PHYS_ADDR) {
+		phys->addr = RTE_BAD_PHYS_ADDR;
+		phys->len = 0;
+		return;
+	}
+	offset = vaddr - (const char *)mr->mr.addr;
+	if (offset < mr->phys.len) {
+		phys->addr = mr->phys.addr + offset;
+		phys->len = mr->phys.len - offset;
+	} else {
+		/* The region spans more than one memory segment */
+		phys->addr = hugepage_virt2phy(vaddr, &phys->len);
+	}
+} /* usiw_mr_phys_range */
+
+
+/** Advances phys past the first len bytes of the buffer that it describes. */
+static void
+phys_range_advance(struct usiw_phys_range *phys, size_t len)
+{
+	if (phys->addr == RTE_BAD_PHYS_ADDR) {
+		return;
+	}
+	if (len < phys->len) {
+		phys->addr += len;
+		phys->len -= len;
+	} else {
+		phys->len = 0;
+	}
+} /* phys_range_advance */
+
+
+/** Attaches payload_length bytes from the src iovec array, starting at offset,
+ * to the end of sendmsg as a chain of mbufs from tx_ext_mempool which point
+ * directly at the user memory, whose physical location is given by the
+ * matching entries of phys.  The user memory is not touched again until the
+ * segment is acknowledged and freed from tx_pending, before which the WQE
+ * cannot complete.  Returns 0 on success, -EFAULT if any part of the payload is
+ * not in hugepage memory, or another negative errno value on failure; sendmsg
+ * is left unmodified on failure. */
+static int
+attach_payload_from_iov(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		const struct iovec *src, const struct usiw_phys_range *phys,
+		size_t iov_count, size_t offset, size_t payload_length)
+{
+	struct rte_mbuf *head, *tail, *m;
+	phys_addr_t physaddr;
+	size_t prev, cur, contig, pos;
+	unsigned int y;
+	char *base;
+	int ret;
+
+	head = tail = NULL;
+	for (y = 0, prev = 0; payload_length > 0 && y < iov_count; ++y) {
+		while (payload_length > 0 && prev <= offset
+				&& offset < prev + src[y].iov_len) {
+			pos = offset - prev;
+			base = (char *)src[y].iov_base + pos;
+			if (phys[y].addr == RTE_BAD_PHYS_ADDR) {
+				ret = -EFAULT;
+				goto free_chain;
+			} else if (pos < phys[y].len) {
+				physaddr = phys[y].addr + pos;
+				contig = phys[y].len - pos;
+			} else {
+				physaddr = hugepage_virt2phy(base, &contig);
+			}
+			if (physaddr == RTE_BAD_PHYS_ADDR) {
+				ret = -EFAULT;
+				goto free_chain;
+			}
+			cur = RTE_MIN(prev + src[y].iov_len - offset,
+					payload_length);
+			cur = RTE_MIN(cur, contig);
+
+			m = rte_pktmbuf_alloc(qp->dev->tx_ext_mempool);
+			if (!m) {
+				ret = -ENOMEM;
+				goto free_chain;
+			}
+			m->buf_addr = base;
+			m->buf_physaddr = physaddr;
+			m->buf_len = cur;
+			m->data_off = 0;
+			m->data_len = cur;
+			m->pkt_len = cur;
+			if (tail) {
+				tail->next = m;
+				head->nb_segs++;
+				head->pkt_len += cur;
+			} else {
+				head = m;
+			}
+			tail = m;
+
+			offset += cur;
+			payload_length -= cur;
+		}
+		prev += src[y].iov_len;
+	}
+	if (payload_length > 0) {
+		ret = -EFAULT;
+		goto free_chain;
+	}
+
+	ret = rte_pktmbuf_chain(sendmsg, head);
+	if (ret < 0) {
+		goto free_chain;
+	}
+	return 0;
+
+free_chain:
+	rte_pktmbuf_free(head);
+	return ret;
+} /* attach_payload_from_iov */
+
+
+/** Appends payload_length bytes from the src iovec array, starting at offset,
+ * to the end of sendmsg, which must be a single mbuf.  Payloads of at least
+ * zero_copy_threshold bytes are attached without copying if possible, and are
+ * otherwise copied into sendmsg.  Returns the raw checksum of the payload if
+ * the NIC does not compute checksums, and 0 otherwise. */
+static uint16_t
+append_payload_from_iov(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		const struct iovec *src, const struct usiw_phys_range *phys,
+		size_t iov_count, size_t offset, size_t payload_length)
+{
+	bool cksum = !(qp->dev->flags & port_checksum_offload);
+	char *payload;
+
+	if (payload_length > 0
+			&& payload_length >= qp->dev->tunables.zero_copy_threshold
+			&& attach_payload_from_iov(qp, sendmsg, src, phys,
+					iov_count, offset, payload_length) == 0) {
+		return cksum ? raw_cksum_chain(sendmsg->next) : 0;
+	}
+
+	payload = rte_pktmbuf_append(sendmsg, payload_length);
+	return memcpy_from_iov(payload, payload_length, src, iov_count, offset,
+			cksum);
+} /* append_payload_from_iov */
+
+
+/** Copies an inline payload to the end of sendmsg, returning its raw checksum
+ * if the NIC does not compute checksums and 0 otherwise. */
+static uint16_t
+append_payload_inline(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
+		const void *src, size_t payload_length)
+{
+	char *payload;
+
+	payload = rte_pktmbuf_append(sendmsg, payload_length);
+	if (!(qp->dev->flags & port_checksum_offload)) {
+		return cksum_copy(payload, src, payload_length);
+	}
+	memcpy(payload, src, payload_length);
+	return 0;
+} /* append_payload_inline */
+
+
 static void
 do_rdmap_send(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
 	struct rdmap_untagged_packet *new_rdmap;
 	struct rte_mbuf *sendmsg;
-	unsigned int packet_length;
 	size_t payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
+	uint16_t cksum;
 
 	while (wqe->bytes_sent < wqe->total_length
-			&& serial_less_32(wqe->remote_ep->send_next_psn,
-					wqe->remote_ep->send_max_psn)) {
-		sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
-
+			&& tx_window_open(qp, wqe->remote_ep)) {
 		payload_length = RTE_MIN(mtu, wqe->total_length
 				- wqe->bytes_sent);
-		packet_length = RDMAP_UNTAGGED_ALLOC_SIZE(payload_length);
+		sendmsg = alloc_ddp_segment(qp, wqe, sizeof(*new_rdmap),
+				payload_length);
+		if (!sendmsg) {
+			/* Try again on the next progress iteration */
+			break;
+		}
+
 		new_rdmap = (struct rdmap_untagged_packet *)rte_pktmbuf_append(
-					sendmsg, packet_length);
+					sendmsg, sizeof(*new_rdmap));
 		new_rdmap->head.ddp_flags = (wqe->total_length
 				- wqe->bytes_sent <= mtu)
 			? DDP_V1_UNTAGGED_LAST_DF
@@ -888,17 +2067,22 @@ do_rdmap_send(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 		new_rdmap->msn = rte_cpu_to_be_32(wqe->msn);
 		new_rdmap->mo = rte_cpu_to_be_32(wqe->bytes_sent);
 		if (wqe->flags & usiw_send_inline) {
-			memcpy(PAYLOAD_OF(new_rdmap),
+			cksum = append_payload_inline(qp, sendmsg,
 					(char *)wqe->iov + wqe->bytes_sent,
 					payload_length);
 		} else {
-			memcpy_from_iov(PAYLOAD_OF(new_rdmap), payload_length,
-					wqe->iov, wqe->iov_count,
-					wqe->bytes_sent);
+			cksum = append_payload_from_iov(qp, sendmsg, wqe->iov,
+					wqe->iov_phys, wqe->iov_count,
+					wqe->bytes_sent, payload_length);
+		}
+		if (!(qp->dev->flags & port_checksum_offload)) {
+			cksum = cksum_fold((uint32_t)cksum + rte_raw_cksum(
+					new_rdmap, sizeof(*new_rdmap)));
 		}
 
-		send_ddp_segment(qp, sendmsg, wqe->remote_ep, wqe,
-				payload_length);
+		finish_ddp_segment(qp, sendmsg, wqe,
+				sizeof(*new_rdmap) + payload_length,
+				payload_length, cksum);
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> SEND transmit msn=%" PRIu32 " [%zu-%zu]\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				wqe->msn,
@@ -919,20 +2103,22 @@ do_rdmap_write(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
 	struct rdmap_tagged_packet *new_rdmap;
 	struct rte_mbuf *sendmsg;
-	unsigned int packet_length;
 	size_t payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
-	void *payload;
+	uint16_t cksum;
 
 	while (wqe->bytes_sent < wqe->total_length
-			&& serial_less_32(wqe->remote_ep->send_next_psn,
-					wqe->remote_ep->send_max_psn)) {
-		sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
-
+			&& tx_window_open(qp, wqe->remote_ep)) {
 		payload_length = RTE_MIN(mtu, wqe->total_length
 				- wqe->bytes_sent);
-		packet_length = RDMAP_TAGGED_ALLOC_SIZE(payload_length);
-		new_rdmap = (struct rdmap_tagged_packet *)rte_pktmbuf_prepend(
+		sendmsg = alloc_ddp_segment(qp, wqe, sizeof(*new_rdmap),
+				payload_length);
+		if (!sendmsg) {
+			/* Try again on the next progress iteration */
+			break;
+		}
+
+		new_rdmap = (struct rdmap_tagged_packet *)rte_pktmbuf_append(
 					sendmsg, sizeof(*new_rdmap));
 		new_rdmap->head.ddp_flags = (wqe->total_length
 				- wqe->bytes_sent <= mtu)
@@ -942,18 +2128,23 @@ do_rdmap_write(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 		new_rdmap->head.sink_stag = rte_cpu_to_be_32(wqe->rkey);
 		new_rdmap->offset = rte_cpu_to_be_64(wqe->remote_addr
 				 + wqe->bytes_sent);
-		payload = rte_pktmbuf_append(sendmsg, payload_length);
 		if (wqe->flags & usiw_send_inline) {
-			memcpy(payload, (char *)wqe->iov + wqe->bytes_sent,
+			cksum = append_payload_inline(qp, sendmsg,
+					(char *)wqe->iov + wqe->bytes_sent,
 					payload_length);
 		} else {
-			memcpy_from_iov(payload, payload_length,
-					wqe->iov, wqe->iov_count,
-					wqe->bytes_sent);
+			cksum = append_payload_from_iov(qp, sendmsg, wqe->iov,
+					wqe->iov_phys, wqe->iov_count,
+					wqe->bytes_sent, payload_length);
+		}
+		if (!(qp->dev->flags & port_checksum_offload)) {
+			cksum = cksum_fold((uint32_t)cksum + rte_raw_cksum(
+					new_rdmap, sizeof(*new_rdmap)));
 		}
 
-		send_ddp_segment(qp, sendmsg, wqe->remote_ep, wqe,
-				payload_length);
+		finish_ddp_segment(qp, sendmsg, wqe,
+				sizeof(*new_rdmap) + payload_length,
+				payload_length, cksum);
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA WRITE transmit bytes %zu through %zu\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				wqe->bytes_sent,
@@ -973,7 +2164,6 @@ do_rdmap_read_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
 	struct rdmap_readreq_packet *new_rdmap;
 	struct rte_mbuf *sendmsg;
-	struct ibv_mr *temp_mr;
 	unsigned int packet_length;
 	uint32_t rkey;
 
@@ -985,27 +2175,27 @@ do_rdmap_read_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 		/* Cannot issue more than ird_max simultaneous RDMA READ
 		 * Requests. */
 		return;
-	} else if (wqe->remote_ep->send_next_psn
-			== wqe->remote_ep->send_max_psn
-			|| serial_greater_32(wqe->remote_ep->send_next_psn,
-				wqe->remote_ep->send_max_psn)) {
+	} else if (!tx_window_open(qp, wqe->remote_ep)) {
 		/* We have reached the maximum number of credits we are allowed
-		 * to send. */
+		 * to send, or the NIC is not keeping up. */
 		return;
 	}
 
-	rkey = STAG_RDMA_READ(wqe->msn);
-	temp_mr = urdma_reg_mr_with_rkey(&qp->pd->pd, wqe->iov[0].iov_base,
-			wqe->iov[0].iov_len, IBV_ACCESS_REMOTE_WRITE,
-			rkey);
-	if (!temp_mr) {
-		/* FIXME: issue error completion */
-		atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
+	if (usiw_send_wqe_queue_add_read(&qp->sq, wqe) < 0) {
+		/* More READs are outstanding than read_active can tell
+		 * apart. */
 		return;
 	}
-	qp->ird_active++;
 
 	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+	if (!sendmsg) {
+		return;
+	}
+
+	/* The sink STag names this WQE in sq.read_active; the READ Response is
+	 * placed into wqe->iov[0] without registering a memory region. */
+	rkey = STAG_RDMA_READ(wqe->msn);
+	qp->ird_active++;
 
 	packet_length = sizeof(*new_rdmap);
 	new_rdmap = (struct rdmap_readreq_packet *)rte_pktmbuf_append(
@@ -1132,6 +2322,50 @@ memcpy_to_iov(struct iovec * restrict dest, size_t iov_count,
 } /* memcpy_to_iov */
 
 
+/** Takes the next posted WQE from the shared receive queue of qp, and raises
+ * the SRQ limit event if that leaves fewer WQEs than the armed limit. */
+static int
+srq_get_next_wqe(struct usiw_qp *qp, struct usiw_recv_wqe **wqe)
+{
+	struct usiw_srq *srq = qp->srq;
+	struct usiw_cqe_batch *batch = qp->cqe_batch;
+	struct urdma_srq_event event;
+	struct usiw_context *ctx;
+	struct iovec iov;
+	unsigned int limit;
+	int ret;
+
+	ret = rte_ring_dequeue(srq->rq.ring, (void **)wqe);
+	if (ret != 0) {
+		return ret;
+	}
+
+	limit = atomic_load(&srq->srq_limit);
+	if (limit && rte_ring_count(srq->rq.ring) < limit
+			&& atomic_compare_exchange_strong(&srq->srq_limit,
+							&limit, 0)) {
+		ctx = usiw_get_context(srq->ib_srq.context);
+		event.event_type = SIW_EVENT_SRQ_LIMIT_REACHED;
+		event.srq_id = srq->srq_id;
+		if (!batch) {
+			iov.iov_base = &event;
+			iov.iov_len = sizeof(event);
+			write_events(ctx, &iov, 1);
+			return 0;
+		}
+		/* Written along with the completions of this progress
+		 * pass */
+		if (batch->srq_event_count == CQE_BATCH_SRQ_EVENT_MAX) {
+			cqe_batch_flush(batch);
+		}
+		batch->srq_event[batch->srq_event_count].ctx = ctx;
+		batch->srq_event[batch->srq_event_count].event = event;
+		batch->srq_event_count++;
+	}
+	return 0;
+} /* srq_get_next_wqe */
+
+
 static void
 process_send(struct usiw_qp *qp, struct packet_context *orig)
 {
@@ -1165,19 +2399,42 @@ process_send(struct usiw_qp *qp, struct packet_context *orig)
 					msn, ee->expected_recv_msn);
 		}
 
-		ret = rte_ring_dequeue(qp->rq0.ring, (void **)&wqe);
-		if (ret != 0) {
+		if (!usiw_recv_wqe_queue_slot_free(&qp->rq0, msn)) {
+			/* An older message which maps to the same slot is
+			 * still incomplete; we have no way to track both. */
+			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> msn=%" PRIu32 " collides with an active receive\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+					msn);
 			do_rdmap_terminate(qp, orig,
 					ddp_error_untagged_no_buffer);
-			rte_exit(EXIT_FAILURE, "rte_ring_dequeue rq0.ring port %u queue %u: %s\n",
-					qp->dev->portid,
-					qp->shm_qp->rx_queue, rte_strerror(-ret));
+			return;
 		}
 
-		wqe->remote_ep = ee;
-		wqe->msn = msn;
+		if (qp->srq) {
+			ret = srq_get_next_wqe(qp, &wqe);
+			if (ret != 0) {
+				RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> SRQ %" PRIu32 " is empty\n",
+						qp->shm_qp->dev_id,
+						qp->shm_qp->qp_id,
+						qp->srq->srq_id);
+				do_rdmap_terminate(qp, orig,
+						ddp_error_untagged_no_buffer);
+				return;
+			}
+		} else if ((ret = rte_ring_dequeue(qp->rq0.ring,
+						(void **)&wqe)) != 0) {
+			do_rdmap_terminate(qp, orig,
+					ddp_error_untagged_no_buffer);
+			rte_exit(EXIT_FAILURE, "rte_ring_dequeue rq0.ring port %u queue %u: %s\n",
+					qp->dev->portid,
+					qp->shm_qp->rx_queue, rte_strerror(-ret));
+		}
 
-		usiw_recv_wqe_queue_add_active(&qp->rq0, wqe);
+		wqe->remote_ep = ee;
+		wqe->msn = msn;
+
+		ret = usiw_recv_wqe_queue_add_active(&qp->rq0, wqe);
+		assert(ret == 0);
 	}
 
 	offset = rte_be_to_cpu_32(rdmap->mo);
@@ -1219,35 +2476,46 @@ respond_rdma_read(struct usiw_qp *qp)
 	struct rdmap_tagged_packet *new_rdmap;
 	struct read_response_state *readresp, **prev;
 	struct rte_mbuf *sendmsg;
-	size_t dgram_length;
+	struct iovec src;
 	size_t payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
+	uint16_t cksum;
 	int count;
 
 	count = 0;
 	TAILQ_FOR_EACH(readresp, &qp->readresp_active, qp_entry, prev) {
 		while (readresp->msg_size > 0
-				&& serial_less_32(readresp->sink_ep->send_next_psn,
-					readresp->sink_ep->send_max_psn)) {
+				&& tx_window_open(qp, readresp->sink_ep)) {
 			sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+			if (!sendmsg) {
+				break;
+			}
 
 			payload_length = RTE_MIN(mtu, readresp->msg_size);
-			dgram_length = RDMAP_TAGGED_ALLOC_SIZE(payload_length);
 
 			new_rdmap = (struct rdmap_tagged_packet *)rte_pktmbuf_append(
-					sendmsg, dgram_length);
+					sendmsg, sizeof(*new_rdmap));
 			new_rdmap->head.ddp_flags = (readresp->msg_size <= mtu)
 				? DDP_V1_TAGGED_LAST_DF : DDP_V1_TAGGED_DF;
 			new_rdmap->head.rdmap_info = RDMAP_V1
 				| rdmap_opcode_rdma_read_response;
 			new_rdmap->head.sink_stag = readresp->sink_stag;
 			new_rdmap->offset = rte_cpu_to_be_64(readresp->sink_offset);
-			memcpy(PAYLOAD_OF(new_rdmap), readresp->vaddr,
-					payload_length);
+			src.iov_base = readresp->vaddr;
+			src.iov_len = payload_length;
+			cksum = append_payload_from_iov(qp, sendmsg, &src,
+					&readresp->phys, 1, 0, payload_length);
+			if (!(qp->dev->flags & port_checksum_offload)) {
+				cksum = cksum_fold((uint32_t)cksum
+						+ rte_raw_cksum(new_rdmap,
+							sizeof(*new_rdmap)));
+			}
 
-			(void)send_ddp_segment(qp, sendmsg, readresp->sink_ep,
-					NULL, payload_length);
+			(void)send_ddp_segment_cksum(qp, sendmsg,
+					readresp->sink_ep, NULL,
+					payload_length, cksum);
 			readresp->vaddr += payload_length;
+			phys_range_advance(&readresp->phys, payload_length);
 			readresp->msg_size -= payload_length;
 			readresp->sink_offset += payload_length;
 			count++;
@@ -1271,7 +2539,6 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	struct read_response_state *readresp;
 	uint32_t rkey;
 	uint32_t msn;
-	struct usiw_mr **candidate;
 	struct usiw_mr *mr;
 
 	msn = rte_be_to_cpu_32(rdmap->untagged.msn);
@@ -1285,8 +2552,8 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	orig->src_ep->expected_read_msn++;
 
 	rkey = rte_be_to_cpu_32(rdmap->source_stag);
-	candidate = usiw_mr_lookup(qp->pd, rkey);
-	if (!candidate) {
+	mr = usiw_mr_lookup(qp->pd, rkey);
+	if (!mr) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA READ failure: invalid rkey %" PRIx32 "\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				rkey);
@@ -1294,7 +2561,6 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 		return;
 	}
 
-	mr = *candidate;
 	uintptr_t vaddr = (uintptr_t)rte_be_to_cpu_64(rdmap->source_offset);
 	uint32_t rdma_length = rte_be_to_cpu_32(rdmap->read_msg_size);
 	if (vaddr < (uintptr_t)mr->mr.addr || vaddr + rdma_length
@@ -1323,6 +2589,7 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	TAILQ_INSERT_TAIL(&qp->readresp_active, readresp, qp_entry);
 
 	readresp->vaddr = (void *)vaddr;
+	usiw_mr_phys_range(mr, readresp->vaddr, &readresp->phys);
 	readresp->msg_size = rdma_length;
 	readresp->sink_stag = rdmap->untagged.head.sink_stag;
 	readresp->sink_offset = rte_be_to_cpu_64(rdmap->sink_offset);
@@ -1335,17 +2602,16 @@ process_rdma_read_response(struct usiw_qp *qp, struct packet_context *orig)
 {
 	struct rdmap_tagged_packet *rdmap;
 	struct usiw_send_wqe *read_wqe;
-	struct usiw_mr **mr;
 	uint32_t rdma_length;
 	int ret;
 
 	rdmap = (struct rdmap_tagged_packet *)orig->rdmap;
-	/* FIXME: stag != msn; need to disambiguate */
-	ret = usiw_send_wqe_queue_lookup(&qp->sq,
-			usiw_wr_read, rte_be_to_cpu_32(rdmap->head.sink_stag),
-			&read_wqe);
+	/* The sink STag is STAG_RDMA_READ(msn) of the READ Request, which
+	 * indexes the WQE directly */
+	ret = usiw_send_wqe_queue_lookup_read(&qp->sq,
+			rte_be_to_cpu_32(rdmap->head.sink_stag), &read_wqe);
 
-	if (ret < 0 || !read_wqe || read_wqe->opcode != usiw_wr_read) {
+	if (ret < 0 || read_wqe->state != SEND_WQE_WAIT) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Unexpected RDMA READ response!\n",
 			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
 		do_rdmap_terminate(qp, orig, rdmap_error_opcode_unexpected);
@@ -1358,11 +2624,6 @@ process_rdma_read_response(struct usiw_qp *qp, struct packet_context *orig)
 	assert(read_wqe->bytes_sent <= read_wqe->iov[0].iov_len);
 	if (read_wqe->bytes_sent == read_wqe->iov[0].iov_len) {
 		/* We have received the last datagram */
-		mr = usiw_mr_lookup(qp->pd, STAG_RDMA_READ(read_wqe->msn));
-		if (mr) {
-			usiw_dereg_mr_real(qp->pd, mr);
-		}
-
 		rte_spinlock_lock(&qp->sq.lock);
 		if (read_wqe->flags & usiw_send_signaled) {
 			post_send_cqe(qp, read_wqe, IBV_WC_SUCCESS);
@@ -1393,6 +2654,7 @@ qp_shutdown(struct usiw_qp *qp)
 
 	sq_flush(qp);
 	rq_flush(qp);
+	shared_queue_unbind(qp);
 } /* qp_shutdown */
 
 
@@ -1404,7 +2666,6 @@ process_terminate(struct usiw_qp *qp, struct packet_context *orig)
 	struct rdmap_readreq_packet *rreq;
 	struct rdmap_tagged_packet *t;
 	enum ibv_wc_status wc_status;
-	struct usiw_mr **mr;
 	uint_fast16_t errcode;
 	int ret;
 
@@ -1422,19 +2683,15 @@ process_terminate(struct usiw_qp *qp, struct packet_context *orig)
 	case 0x0100:
 		/* RDMA Read Request Error */
 		rreq = (struct rdmap_readreq_packet *)(rdmap + 1);
-		ret = usiw_send_wqe_queue_lookup(&qp->sq, usiw_wr_read,
+		ret = usiw_send_wqe_queue_lookup_read(&qp->sq,
 				rte_be_to_cpu_32(rreq->untagged.head.sink_stag),
 				&wqe);
-		if (ret < 0 || !wqe || wqe->opcode != usiw_wr_read) {
+		if (ret < 0) {
 			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> TERMINATE sink_stag=%" PRIu32 " has no matching RDMA Read Request\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				rte_be_to_cpu_32(rreq->untagged.head.sink_stag));
 			return;
 		}
-		mr = usiw_mr_lookup(qp->pd, STAG_RDMA_READ(wqe->msn));
-		if (mr) {
-			usiw_dereg_mr_real(qp->pd, mr);
-		}
 		wc_status = IBV_WC_REM_ACCESS_ERR;
 		break;
 	case 0x1100:
@@ -1510,6 +2767,23 @@ static void
 do_process_ack(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 		struct pending_datagram_info *pending)
 {
+	struct usiw_send_wqe *next;
+	uint16_t x;
+
+	if (pending->flags & pending_coalesced) {
+		/* Each WQE was sent whole in this datagram, and they were
+		 * started one after the other */
+		for (x = 0; x < pending->wqe_count; ++x) {
+			next = wqe->active.tqe_next;
+			wqe->bytes_acked = wqe->total_length;
+			assert(wqe->state == SEND_WQE_WAIT);
+			wqe->state = SEND_WQE_COMPLETE;
+			try_complete_wqe(qp, wqe);
+			wqe = next;
+		}
+		return;
+	}
+
 	wqe->bytes_acked += pending->ddp_length;
 	assert(wqe->bytes_sent >= wqe->bytes_acked);
 
@@ -1522,46 +2796,200 @@ do_process_ack(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 } /* do_process_ack */
 
 
+/** Gives up on the segment failed, which has exceeded the retransmission
+ * limit: completes each WQE that it carries with IBV_WC_RETRY_EXC_ERR and
+ * moves the QP to the error state.  Every segment still in tx_pending is
+ * released first, so that no other timer of the same WQEs can fire and
+ * complete them again, and no entry is left pointing at a freed WQE. */
 static void
-maybe_sack_pending(struct pending_datagram_info *pending, uint32_t psn_min,
-		uint32_t psn_max)
+fail_unacked_segment(struct usiw_qp *qp, struct ee_state *ep,
+		struct pending_datagram_info *failed)
 {
-	if ((psn_min == pending->psn || serial_less_32(psn_min, pending->psn))
-			&& serial_less_32(pending->psn, psn_max)) {
-		pending->next_retransmit = UINT64_MAX;
+	struct pending_datagram_info *pending;
+	struct usiw_send_wqe *wqe, *next;
+	struct rte_mbuf *sendmsg;
+	uint16_t x, wqe_count;
+	int i;
+
+	wqe = failed->wqe;
+	wqe_count = (failed->flags & pending_coalesced)
+		? failed->wqe_count : 1;
+	for (i = 0; i < ep->tx_pending_size; ++i) {
+		sendmsg = ep->tx_pending[i];
+		if (sendmsg) {
+			pending = (struct pending_datagram_info *)(sendmsg + 1);
+			timer_wheel_cancel(&pending->retransmit);
+			pending->wqe = NULL;
+			rte_pktmbuf_free(sendmsg);
+			ep->tx_pending[i] = NULL;
+		}
 	}
-} /* maybe_sack_pending */
 
+	if (wqe) {
+		rte_spinlock_lock(&qp->sq.lock);
+		/* The WQEs of a coalesced datagram were started one after the
+		 * other */
+		for (x = 0; x < wqe_count && wqe; ++x) {
+			next = wqe->active.tqe_next;
+			post_send_cqe(qp, wqe, IBV_WC_RETRY_EXC_ERR);
+			wqe = next;
+		}
+		rte_spinlock_unlock(&qp->sq.lock);
+	}
+	atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
+} /* fail_unacked_segment */
 
+
+/** Resends the given unacknowledged segment, moving the QP to the error state
+ * if it has gone unacknowledged for the maximum retransmission timeout. */
 static void
-process_trp_sack(struct ee_state *ep, uint32_t psn_min, uint32_t psn_max)
+retransmit_segment(struct usiw_qp *qp, struct pending_datagram_info *pending)
 {
-	struct pending_datagram_info *info;
-	struct rte_mbuf **sendmsg, **start, **end;
+	struct rte_mbuf *sendmsg = (struct rte_mbuf *)pending - 1;
 
-	sendmsg = start = ep->tx_head;
-	end = ep->tx_pending + ep->tx_pending_size;
-	if (!*sendmsg) {
+	if (resend_ddp_segment(qp, sendmsg, &qp->remote_ep) == -EIO) {
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> retransmit limit exceeded psn=%" PRIu32 " after %" PRIu16 " transmissions\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				pending->psn, pending->transmit_count);
+		fail_unacked_segment(qp, &qp->remote_ep, pending);
+	}
+} /* retransmit_segment */
+
+
+/** Retransmits the segment whose retransmission timer has expired. */
+static void
+retransmit_expired(struct timer_wheel_entry *timer, void *arg)
+{
+	struct usiw_qp *qp = arg;
+
+	qp->stats.retransmit_timeout++;
+	retransmit_segment(qp, container_of(timer,
+				struct pending_datagram_info, retransmit));
+} /* retransmit_expired */
+
+
+/** Returns the segment with the given PSN if it is still in tx_pending. */
+static struct pending_datagram_info *
+tx_pending_lookup(struct ee_state *ep, uint32_t psn)
+{
+	struct pending_datagram_info *pending;
+	struct rte_mbuf *sendmsg;
+
+	sendmsg = *tx_pending_entry(ep, psn);
+	if (!sendmsg) {
+		return NULL;
+	}
+	pending = (struct pending_datagram_info *)(sendmsg + 1);
+	return (pending->psn == psn) ? pending : NULL;
+} /* tx_pending_lookup */
+
+
+/** Cancels the retransmission timer of every segment covered by one of the
+ * ranges in the SACK, so that only the holes between them are resent.  Each
+ * hole below the highest range is resent immediately, up to the
+ * fast_retransmit_limit tunable, unless it has already been fast
+ * retransmitted; any remaining holes wait for their timers. */
+static void
+process_trp_sack(struct usiw_qp *qp, struct ee_state *ep,
+		struct trp_sack *sack, size_t length)
+{
+	struct pending_datagram_info *pending;
+	uint32_t psn, psn_min, psn_max, hole;
+	unsigned int count, i, fast_count, fast_limit;
+
+	if (length < sizeof(*sack)) {
+		return;
+	}
+	count = rte_be_to_cpu_16(sack->range_count);
+	if (count > (length - sizeof(*sack)) / sizeof(sack->range[0])) {
 		return;
 	}
 
-	do {
-		info = (struct pending_datagram_info *)(sendmsg + 1);
-		maybe_sack_pending(info, psn_min, psn_max);
+	fast_count = 0;
+	fast_limit = qp->dev->tunables.fast_retransmit_limit;
+	hole = ep->send_last_acked_psn;
+	for (i = 0; i < count; ++i) {
+		psn_min = rte_be_to_cpu_32(sack->range[i].min);
+		psn_max = rte_be_to_cpu_32(sack->range[i].max);
+		/* Only segments that we have sent and that are not yet
+		 * cumulatively acknowledged can be in tx_pending */
+		if (serial_less_32(psn_min, ep->send_last_acked_psn)) {
+			psn_min = ep->send_last_acked_psn;
+		}
+		if (serial_greater_32(psn_min, ep->send_next_psn)) {
+			psn_min = ep->send_next_psn;
+		}
+		if (serial_greater_32(psn_max, ep->send_next_psn)) {
+			psn_max = ep->send_next_psn;
+		}
+		/* Skip stale or corrupt ranges, which would otherwise have us
+		 * walk far outside of the send window */
+		if (serial_greater_32(psn_min, psn_max)) {
+			continue;
+		}
 
-		if (++sendmsg == end) {
-			sendmsg = ep->tx_pending;
+		/* The receiver lists ranges in increasing order, so everything
+		 * between the previous range and this one is missing */
+		for (; serial_less_32(hole, psn_min) && fast_count < fast_limit;
+				++hole) {
+			pending = tx_pending_lookup(ep, hole);
+			if (pending && timer_wheel_entry_armed(
+						&pending->retransmit)
+					&& !(pending->flags
+						& pending_fast_retransmitted)) {
+				pending->flags |= pending_fast_retransmitted;
+				qp->stats.retransmit_fast++;
+				fast_count++;
+				retransmit_segment(qp, pending);
+			}
+		}
+
+		for (psn = psn_min; serial_less_32(psn, psn_max); ++psn) {
+			pending = tx_pending_lookup(ep, psn);
+			if (pending) {
+				timer_wheel_cancel(&pending->retransmit);
+			}
 		}
-	} while (sendmsg != start && *sendmsg);
+		if (serial_greater_32(psn_max, hole)) {
+			hole = psn_max;
+		}
+	}
 } /* process_trp_sack */
 
 
+/** Updates the smoothed round-trip time and retransmission timeout of the
+ * endpoint with a new RTT sample, as in RFC 6298. */
+static void
+update_rtt(struct ee_state *ep, uint64_t rtt)
+{
+	uint64_t delta;
+
+	if (ep->srtt == 0) {
+		ep->srtt = rtt;
+		ep->rttvar = rtt / 2;
+	} else {
+		delta = (ep->srtt > rtt) ? ep->srtt - rtt : rtt - ep->srtt;
+		ep->rttvar = (3 * ep->rttvar + delta) / 4;
+		ep->srtt = (7 * ep->srtt + rtt) / 8;
+	}
+	ep->rto = ep->srtt + RTE_MAX(ep->retransmit_timers.tick,
+			4 * ep->rttvar);
+	ep->rto = RTE_MAX(ep->rto, ep->rto_min);
+	ep->rto = RTE_MIN(ep->rto, ep->rto_max);
+} /* update_rtt */
+
+
+/** Frees all acknowledged segments at the head of tx_pending and then
+ * retransmits those segments whose retransmission timer has expired.  The
+ * newest newly acknowledged segment provides an RTT sample, unless it was
+ * retransmitted, in which case the sample would be ambiguous. */
 static void
 sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 {
 	struct pending_datagram_info *pending;
 	struct ee_state *ep = &qp->remote_ep;
-	struct rte_mbuf **end, **p, *sendmsg;
+	struct rte_mbuf **end, *sendmsg;
+	uint64_t sample_time;
 	int count;
 
 	end = ep->tx_pending + ep->tx_pending_size;
@@ -1569,14 +2997,18 @@ sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 		return;
 	}
 
+	sample_time = 0;
 	for (count = 0; count < ep->tx_pending_size
 			&& (sendmsg = *ep->tx_head) != NULL; count++) {
 		pending = (struct pending_datagram_info *)(sendmsg + 1);
 		if (serial_less_32(pending->psn, ep->send_last_acked_psn)) {
 			/* Packet was acked */
+			sample_time = (pending->transmit_count == 1)
+					? pending->send_time : 0;
 			if (pending->wqe) {
 				do_process_ack(qp, pending->wqe, pending);
 			}
+			timer_wheel_cancel(&pending->retransmit);
 			rte_pktmbuf_free(sendmsg);
 			*ep->tx_head = NULL;
 			if (++ep->tx_head == end) {
@@ -1586,35 +3018,11 @@ sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 			break;
 		}
 	}
-
-	p = ep->tx_head;
-	while (count < ep->tx_pending_size && (sendmsg = *p) != NULL) {
-		pending = (struct pending_datagram_info *)(sendmsg + 1);
-		if (now > pending->next_retransmit
-				&& resend_ddp_segment(qp, sendmsg, ep) < 0) {
-			RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> retransmit limit (%d) exceeded psn=%" PRIu32 "\n",
-					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-					RETRANSMIT_MAX,
-					pending->psn);
-			if (pending->wqe) {
-				rte_spinlock_lock(&qp->sq.lock);
-				post_send_cqe(qp, pending->wqe, IBV_WC_RETRY_EXC_ERR);
-				rte_spinlock_unlock(&qp->sq.lock);
-			}
-			atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
-			if (p == ep->tx_head) {
-				*ep->tx_head = NULL;
-				if (++ep->tx_head == end) {
-					ep->tx_head = ep->tx_pending;
-				}
-			} else {
-				pending->next_retransmit = UINT64_MAX;
-			}
-		}
-		if (++p == end) {
-			p = ep->tx_pending;
-		}
+	if (sample_time && now > sample_time) {
+		update_rtt(ep, now - sample_time);
 	}
+
+	timer_wheel_expire(&ep->retransmit_timers, now, retransmit_expired, qp);
 } /* sweep_unacked_packets */
 
 
@@ -1622,34 +3030,39 @@ static void
 ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 {
 	struct rdmap_tagged_packet *rdmap;
-	struct usiw_mr **candidate;
+	struct usiw_send_wqe *read_wqe;
 	struct usiw_mr *mr;
-	uintptr_t vaddr;
+	uintptr_t vaddr, base;
+	size_t length;
 	uint32_t rkey;
 	uint32_t rdma_length;
 	unsigned int opcode;
 
 	rdmap = (struct rdmap_tagged_packet *)orig->rdmap;
 	rkey = rte_be_to_cpu_32(rdmap->head.sink_stag);
-	candidate = usiw_mr_lookup(qp->pd, rkey);
-	if (!candidate) {
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received DDP tagged message with invalid stag %" PRIx32 "\n",
-				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-				rkey);
-		do_rdmap_terminate(qp, orig, ddp_error_tagged_stag_invalid);
-		return;
+	if ((rkey & STAG_TYPE_MASK) == STAG_TYPE_RDMA_READ) {
+		if (usiw_send_wqe_queue_lookup_read(&qp->sq, rkey,
+							&read_wqe) < 0) {
+			goto invalid_stag;
+		}
+		base = (uintptr_t)read_wqe->iov[0].iov_base;
+		length = read_wqe->iov[0].iov_len;
+	} else {
+		mr = usiw_mr_lookup(qp->pd, rkey);
+		if (!mr) {
+			goto invalid_stag;
+		}
+		base = (uintptr_t)mr->mr.addr;
+		length = mr->mr.length;
 	}
 
-	mr = *candidate;
 	vaddr = (uintptr_t)rte_be_to_cpu_64(rdmap->offset);
 	rdma_length = orig->ddp_seg_length - sizeof(*rdmap);
-	if (vaddr < (uintptr_t)mr->mr.addr || vaddr + rdma_length
-			> (uintptr_t)mr->mr.addr + mr->mr.length) {
+	if (vaddr < base || vaddr + rdma_length > base + length) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received DDP tagged message with destination [%" PRIxPTR ", %" PRIxPTR "] outside of memory region [%" PRIxPTR ", %" PRIxPTR "]\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				vaddr, vaddr + rdma_length,
-				(uintptr_t)mr->mr.addr,
-				(uintptr_t)mr->mr.addr + mr->mr.length);
+				base, base + length);
 		do_rdmap_terminate(qp, orig,
 				ddp_error_tagged_base_or_bounds_violation);
 		return;
@@ -1673,18 +3086,142 @@ ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 				opcode);
 		do_rdmap_terminate(qp, orig, rdmap_error_opcode_unexpected);
 	}
+	return;
+
+invalid_stag:
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received DDP tagged message with invalid stag %" PRIx32 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			rkey);
+	do_rdmap_terminate(qp, orig, ddp_error_tagged_stag_invalid);
 } /* ddp_place_tagged_data */
 
 
+/** Places a single DDP segment, whose TRP header has already been processed,
+ * and starts any resulting RDMAP actions. */
 static void
-process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
+process_ddp_segment(struct usiw_qp *qp, struct packet_context *ctx)
+{
+	if (DDP_GET_DV(ctx->rdmap->ddp_flags) != 0x1) {
+		do_rdmap_terminate(qp, ctx,
+				DDP_GET_T(ctx->rdmap->ddp_flags)
+				? ddp_error_tagged_version_invalid
+				: ddp_error_untagged_version_invalid);
+		return;
+	}
+
+	if (RDMAP_GET_RV(ctx->rdmap->rdmap_info) != 0x1) {
+		do_rdmap_terminate(qp, ctx, rdmap_error_version_invalid);
+		return;
+	}
+
+	if (DDP_GET_T(ctx->rdmap->ddp_flags)) {
+		return ddp_place_tagged_data(qp, ctx);
+	} else {
+		switch (RDMAP_GET_OPCODE(ctx->rdmap->rdmap_info)) {
+			case rdmap_opcode_send:
+			case rdmap_opcode_send_inv:
+			case rdmap_opcode_send_se:
+			case rdmap_opcode_send_se_inv:
+				process_send(qp, ctx);
+				break;
+			case rdmap_opcode_rdma_read_request:
+				process_rdma_read_request(qp, ctx);
+				break;
+			case rdmap_opcode_terminate:
+				process_terminate(qp, ctx);
+				break;
+			default:
+				do_rdmap_terminate(qp, ctx,
+						rdmap_error_opcode_unexpected);
+				return;
+		}
+	}
+} /* process_ddp_segment */
+
+
+/** Verifies the IPv4 header and UDP checksums of a received frame for NICs
+ * that cannot do so.  This is done before any TRP processing, since a corrupt
+ * datagram must not be acknowledged. */
+static bool
+verify_rx_cksum(struct rte_mbuf *mbuf)
+{
+	struct ipv4_hdr *ipv4_hdr;
+	struct udp_hdr *udp_hdr;
+	size_t ip_hdr_length;
+	uint16_t udp_length;
+	uint32_t sum;
+
+	ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf, struct ipv4_hdr *,
+			sizeof(struct ether_hdr));
+	ip_hdr_length = (ipv4_hdr->version_ihl & 0xf) * 4;
+	if (cksum_raw(ipv4_hdr, ip_hdr_length) != UINT16_MAX) {
+		return false;
+	}
+
+	udp_hdr = (struct udp_hdr *)((char *)ipv4_hdr + ip_hdr_length);
+	if (udp_hdr->dgram_cksum == 0) {
+		/* The sender did not compute a checksum */
+		return true;
+	}
+	udp_length = rte_be_to_cpu_16(udp_hdr->dgram_len);
+	if (sizeof(struct ether_hdr) + ip_hdr_length + udp_length
+			> rte_pktmbuf_data_len(mbuf)) {
+		return false;
+	}
+	sum = (uint32_t)rte_ipv4_phdr_cksum(ipv4_hdr, 0)
+		+ cksum_raw(udp_hdr, udp_length);
+	return cksum_fold(sum) == UINT16_MAX;
+} /* verify_rx_cksum */
+
+
+/** Classes of received datagrams.  process_receive_queue() sorts each burst
+ * into these classes and then handles each class in turn. */
+enum rx_class {
+	rx_class_drop,
+		/**< Malformed, corrupt, or not for this queue pair. */
+	rx_class_ack,
+		/**< Carries only an acknowledgement and credits. */
+	rx_class_data,
+		/**< Carries one or more DDP segments as well. */
+	rx_class_sack,
+		/**< Selective acknowledgement. */
+	rx_class_fin,
+		/**< The peer is closing the connection. */
+};
+
+/** Returns the TRP header of a received datagram that has been accepted by
+ * classify_rx_packet(). */
+static inline struct trp_hdr *
+rx_trp_hdr(struct rte_mbuf *mbuf)
+{
+	return rte_pktmbuf_mtod_offset(mbuf, struct trp_hdr *,
+			sizeof(struct usiw_tx_hdr));
+} /* rx_trp_hdr */
+
+/** Returns the length of everything following the TRP header of a received
+ * datagram that has been accepted by classify_rx_packet(). */
+static inline size_t
+rx_trp_payload_length(struct rte_mbuf *mbuf)
+{
+	struct udp_hdr *udp_hdr;
+
+	udp_hdr = rte_pktmbuf_mtod_offset(mbuf, struct udp_hdr *,
+			sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+	return rte_be_to_cpu_16(udp_hdr->dgram_len)
+				- sizeof(*udp_hdr) - sizeof(struct trp_hdr);
+} /* rx_trp_payload_length */
+
+
+/** Validates the headers of a received datagram, up to and including the TRP
+ * header, and returns its class.  This does not change any queue pair
+ * state. */
+static enum rx_class
+classify_rx_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 {
-	struct packet_context ctx;
-	struct ether_hdr *eth_hdr;
 	struct ipv4_hdr *ipv4_hdr;
 	struct udp_hdr *udp_hdr;
-	struct trp_hdr *trp_hdr;
 	uint16_t trp_opcode;
+	uint16_t udp_length;
 
 #ifdef DEBUG_PACKET_HEADERS
 	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Begin processing received packet:\n",
@@ -1696,10 +3233,12 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 		if (RTE_LOG_LEVEL >= RTE_LOG_DEBUG) {
 			uint16_t actual_udp_checksum, actual_ipv4_cksum;
 			ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,
-					struct ipv4_hdr *, sizeof(*eth_hdr));
+					struct ipv4_hdr *,
+					sizeof(struct ether_hdr));
 			udp_hdr = rte_pktmbuf_mtod_offset(mbuf,
 					struct udp_hdr *,
-					sizeof(*eth_hdr) + sizeof(*ipv4_hdr));
+					sizeof(struct ether_hdr)
+					+ sizeof(*ipv4_hdr));
 			actual_udp_checksum = udp_hdr->dgram_cksum;
 			udp_hdr->dgram_cksum = 0;
 			actual_ipv4_cksum = ipv4_hdr->hdr_checksum;
@@ -1713,175 +3252,173 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 		}
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with bad UDP/IP checksum\n",
 			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
-		return;
+		return rx_class_drop;
 	}
 
-	eth_hdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr *);
-
-	ipv4_hdr = (struct ipv4_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*eth_hdr));
-	assert(ipv4_hdr->next_proto_id == IP_HDR_PROTO_UDP);
-	assert(ipv4_hdr->dst_addr == qp->dev->ipv4_addr);
+	if (rte_pktmbuf_data_len(mbuf)
+			< sizeof(struct usiw_tx_hdr) + sizeof(struct trp_hdr)
+			|| !rx_hdr_match(qp, rte_pktmbuf_mtod(mbuf, void *))) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with unexpected headers\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		return rx_class_drop;
+	}
 
-	udp_hdr = (struct udp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*ipv4_hdr));
-	assert(udp_hdr->dst_port == qp->shm_qp->local_udp_port);
+	udp_hdr = rte_pktmbuf_mtod_offset(mbuf, struct udp_hdr *,
+			sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+	udp_length = rte_be_to_cpu_16(udp_hdr->dgram_len);
+	if (udp_length < sizeof(*udp_hdr) + sizeof(struct trp_hdr)
+			|| sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+				+ udp_length > rte_pktmbuf_data_len(mbuf)) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with bad UDP length %" PRIu16 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id, udp_length);
+		return rx_class_drop;
+	}
 
-	ctx.src_ep = &qp->remote_ep;
-	if (!ctx.src_ep) {
-		/* Drop the packet; do not send TERMINATE */
-		return;
+	if (!(qp->dev->flags & port_rx_checksum_offload)
+			&& !verify_rx_cksum(mbuf)) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with bad UDP/IP checksum\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		return rx_class_drop;
 	}
 
-	trp_hdr = (struct trp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*udp_hdr));
-	trp_opcode = rte_be_to_cpu_16(trp_hdr->opcode) & trp_opcode_mask;
+	trp_opcode = rte_be_to_cpu_16(rx_trp_hdr(mbuf)->opcode)
+							& trp_opcode_mask;
 	switch (trp_opcode) {
 	case 0:
 		/* Normal opcode */
-		break;
+		return (udp_length > sizeof(*udp_hdr) + sizeof(struct trp_hdr))
+			? rx_class_data : rx_class_ack;
+	case trp_coalesced:
+		if (!qp->remote_ep.coalesce_max) {
+			RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive coalesced packet without negotiating it; dropping\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+			return rx_class_drop;
+		}
+		return rx_class_data;
 	case trp_sack:
-		/* This is a selective acknowledgement */
-		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive SACK [%" PRIu32 ", %" PRIu32 "); send_ack_psn %" PRIu32 "\n",
-				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-				rte_be_to_cpu_32(trp_hdr->psn),
-				rte_be_to_cpu_32(trp_hdr->ack_psn),
-				ctx.src_ep->send_last_acked_psn);
-		process_trp_sack(ctx.src_ep, rte_be_to_cpu_32(trp_hdr->psn),
-				rte_be_to_cpu_32(trp_hdr->ack_psn));
-		return;
+		return rx_class_sack;
 	case trp_fin:
-		/* This is a finalize packet */
-		qp_shutdown(qp);
-		return;
+		return rx_class_fin;
 	default:
 		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive unexpected opcode %" PRIu16 "; dropping\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				trp_opcode >> trp_opcode_shift);
-		return;
+		return rx_class_drop;
 	}
+} /* classify_rx_packet */
 
-	/* Update sender state based on received ack_psn */
-	ctx.src_ep->send_last_acked_psn = rte_be_to_cpu_32(trp_hdr->ack_psn);
-	ctx.src_ep->send_max_psn = ctx.src_ep->send_last_acked_psn
-					+ ctx.src_ep->tx_pending_size - 1;
 
-	if (rte_be_to_cpu_16(udp_hdr->dgram_len) <=
-					sizeof(*udp_hdr) + sizeof(*trp_hdr)) {
-		/* No DDP segment attached; ignore PSN */
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got ACK psn %" PRIu32 "; now last_acked_psn %" PRIu32 " send_next_psn %" PRIu32 " send_max_psn %" PRIu32 "\n",
-						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-						ctx.psn,
-						ctx.src_ep->send_last_acked_psn,
-						ctx.src_ep->send_next_psn,
-						ctx.src_ep->send_max_psn);
-		return;
-	}
+/** Handles the PSN of a received datagram of class rx_class_data, and then
+ * places each DDP segment that it carries.  The acknowledgement and credits
+ * in its TRP header have already been applied by process_receive_queue(). */
+static void
+process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
+{
+	struct packet_context ctx;
+	struct trp_hdr *trp_hdr;
+	uint16_t seg_length;
+	size_t payload_length;
+	char *payload;
 
+	ctx.src_ep = &qp->remote_ep;
+	trp_hdr = rx_trp_hdr(mbuf);
 	ctx.psn = rte_be_to_cpu_32(trp_hdr->psn);
+	if (ctx.src_ep->ecn && IPTOS_ECN(rte_pktmbuf_mtod_offset(mbuf,
+				struct ipv4_hdr *, sizeof(struct ether_hdr))
+					->type_of_service) == IPTOS_ECN_CE) {
+		/* Echo the mark in the next TRP header we send, which we send
+		 * right away */
+		qp->stats.ecn_ce_received++;
+		ctx.src_ep->trp_flags |= trp_recv_ce|trp_ack_update
+			|trp_ack_now;
+	}
 	if (ctx.psn == ctx.src_ep->recv_ack_psn) {
 		ctx.src_ep->recv_ack_psn++;
-		if ((ctx.src_ep->trp_flags & trp_recv_missing)
-				&& ctx.src_ep->recv_ack_psn
-				== ctx.src_ep->recv_sack_psn.min) {
-			ctx.src_ep->recv_ack_psn
-				= ctx.src_ep->recv_sack_psn.max;
-			ctx.src_ep->trp_flags &= ~trp_recv_missing;
+		if (ctx.src_ep->trp_flags & trp_recv_missing) {
+			/* Pass over any datagrams that we already received out
+			 * of order */
+			while (ctx.src_ep->recv_ack_psn
+					!= ctx.src_ep->recv_sack_max_psn
+					&& recv_bitmap_test(ctx.src_ep,
+						ctx.src_ep->recv_ack_psn)) {
+				recv_bitmap_clear(ctx.src_ep,
+						ctx.src_ep->recv_ack_psn);
+				ctx.src_ep->recv_ack_psn++;
+			}
+			if (ctx.src_ep->recv_ack_psn
+					== ctx.src_ep->recv_sack_max_psn) {
+				ctx.src_ep->trp_flags &= ~trp_recv_missing;
+			}
 		}
 		ctx.src_ep->trp_flags |= trp_ack_update;
+		ctx.src_ep->ack_pending_count++;
 	} else if (serial_less_32(ctx.src_ep->recv_ack_psn, ctx.psn)) {
-		/* We detected a sequence number gap.  Try to build a
-		 * contiguous range so we can send a SACK to lower the number
+		/* We detected a sequence number gap.  Record the datagram in
+		 * the receive bitmap so we can send a SACK to lower the number
 		 * of retransmissions. */
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive psn %" PRIu32 "; next expected psn %" PRIu32 "\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				ctx.psn,
 				ctx.src_ep->recv_ack_psn);
-		if (ctx.src_ep->trp_flags & trp_recv_missing) {
-			if (ctx.psn == ctx.src_ep->recv_sack_psn.max) {
-				ctx.src_ep->recv_sack_psn.max = ctx.psn + 1;
-				ctx.src_ep->trp_flags |= trp_ack_update;
-			} else if (ctx.psn + 1
-					== ctx.src_ep->recv_sack_psn.min) {
-				ctx.src_ep->recv_sack_psn.min = ctx.psn;
-				if (ctx.src_ep->recv_sack_psn.min
-						== ctx.src_ep->recv_ack_psn) {
-					ctx.src_ep->recv_ack_psn
-						= ctx.src_ep->recv_sack_psn.max;
-					ctx.src_ep->trp_flags &= ~trp_recv_missing;
-				}
-				ctx.src_ep->trp_flags |= trp_ack_update;
-			} else if (serial_less_32(ctx.psn,
-						ctx.src_ep->recv_sack_psn.min)
-					|| serial_greater_32(ctx.psn,
-						ctx.src_ep->recv_sack_psn.max)) {
-				/* We've run out of ways to track this
-				 * datagram; drop it and wait for it to be
-				 * retransmitted along with the surrounding
-				 * datagrams. */
-				RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got out of range psn %" PRIu32 "; next expected %" PRIu32 " sack range: [%" PRIu32 ",%" PRIu32 "]\n",
-						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-						ctx.psn, ctx.src_ep->recv_ack_psn,
-						ctx.src_ep->recv_sack_psn.min,
-						ctx.src_ep->recv_sack_psn.max);
-				return;
-			} else {
-				/* This segment has been handled; drop the
-				 * duplicate. */
-				return;
-			}
-		} else {
-			ctx.src_ep->trp_flags |= trp_recv_missing|trp_ack_update;
-			ctx.src_ep->recv_sack_psn.min = ctx.psn;
-			ctx.src_ep->recv_sack_psn.max = ctx.psn + 1;
+		if (ctx.psn - ctx.src_ep->recv_ack_psn
+					>= ctx.src_ep->recv_window_size) {
+			/* The sender has exceeded its credits; drop it and
+			 * wait for it to be retransmitted. */
+			RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got out of range psn %" PRIu32 "; next expected %" PRIu32 " window size %" PRIu32 "\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+					ctx.psn, ctx.src_ep->recv_ack_psn,
+					ctx.src_ep->recv_window_size);
+			return;
+		} else if (recv_bitmap_test(ctx.src_ep, ctx.psn)) {
+			/* This segment has been handled; drop the
+			 * duplicate. */
+			return;
 		}
+		recv_bitmap_set(ctx.src_ep, ctx.psn);
+		if (!(ctx.src_ep->trp_flags & trp_recv_missing)
+				|| serial_greater_32(ctx.psn + 1,
+					ctx.src_ep->recv_sack_max_psn)) {
+			ctx.src_ep->recv_sack_max_psn = ctx.psn + 1;
+		}
+		ctx.src_ep->trp_flags |= trp_recv_missing|trp_ack_update;
 	} else {
 		/* This is a retransmission of a packet which we have already
-		 * acknowledged; throw it away. */
+		 * acknowledged; throw it away, but acknowledge it again right
+		 * away in case our acknowledgement was lost. */
 		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got retransmission psn %" PRIu32 "; expected psn %" PRIu32 "\n",
 						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 						ctx.psn, ctx.src_ep->recv_ack_psn);
+		ctx.src_ep->trp_flags |= trp_ack_update|trp_ack_now;
 		return;
 	}
 
-	ctx.ddp_seg_length = rte_be_to_cpu_16(udp_hdr->dgram_len)
-					- sizeof(*udp_hdr) - sizeof(*trp_hdr);
-	ctx.rdmap = (struct rdmap_packet *)rte_pktmbuf_adj(mbuf,
-							sizeof(*trp_hdr));
-
-	if (DDP_GET_DV(ctx.rdmap->ddp_flags) != 0x1) {
-		do_rdmap_terminate(qp, &ctx,
-				DDP_GET_T(ctx.rdmap->ddp_flags)
-				? ddp_error_tagged_version_invalid
-				: ddp_error_untagged_version_invalid);
+	payload_length = rx_trp_payload_length(mbuf);
+	payload = (char *)(trp_hdr + 1);
+	if ((rte_be_to_cpu_16(trp_hdr->opcode) & trp_opcode_mask)
+							!= trp_coalesced) {
+		ctx.ddp_seg_length = payload_length;
+		ctx.rdmap = (struct rdmap_packet *)payload;
+		process_ddp_segment(qp, &ctx);
 		return;
 	}
 
-	if (RDMAP_GET_RV(ctx.rdmap->rdmap_info) != 0x1) {
-		do_rdmap_terminate(qp, &ctx, rdmap_error_version_invalid);
-		return;
-	}
-
-	if (DDP_GET_T(ctx.rdmap->ddp_flags)) {
-		return ddp_place_tagged_data(qp, &ctx);
-	} else {
-		switch (RDMAP_GET_OPCODE(ctx.rdmap->rdmap_info)) {
-			case rdmap_opcode_send:
-			case rdmap_opcode_send_inv:
-			case rdmap_opcode_send_se:
-			case rdmap_opcode_send_se_inv:
-				process_send(qp, &ctx);
-				break;
-			case rdmap_opcode_rdma_read_request:
-				process_rdma_read_request(qp, &ctx);
-				break;
-			case rdmap_opcode_terminate:
-				process_terminate(qp, &ctx);
-				break;
-			default:
-				do_rdmap_terminate(qp, &ctx,
-						rdmap_error_opcode_unexpected);
-				return;
+	while (payload_length >= sizeof(seg_length)) {
+		seg_length = rte_be_to_cpu_16(*(uint16_t *)payload);
+		payload += sizeof(seg_length);
+		payload_length -= sizeof(seg_length);
+		if (seg_length > payload_length) {
+			RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> coalesced segment length %" PRIu16 " exceeds remaining %zu bytes of psn %" PRIu32 "\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+					seg_length, payload_length, ctx.psn);
+			return;
 		}
+		ctx.ddp_seg_length = seg_length;
+		ctx.rdmap = (struct rdmap_packet *)payload;
+		process_ddp_segment(qp, &ctx);
+		payload += seg_length;
+		payload_length -= seg_length;
 	}
-}	/* process_ipv4_packet */
+}	/* process_data_packet */
 
 
 static void
@@ -1906,109 +3443,255 @@ progress_send_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 } /* progress_send_wqe */
 
 
+/** Frees a burst of received mbufs.  Those that are not referenced elsewhere
+ * and came from the same mempool as the first are returned to it in one
+ * operation; any others are freed individually. */
+static void
+rx_mbuf_free_bulk(struct rte_mbuf **mbuf, uint16_t count)
+{
+	struct rte_mbuf *bulk[RX_BURST_SIZE];
+	struct rte_mempool *pool;
+	uint16_t bulk_count, i;
+
+	pool = mbuf[0]->pool;
+	bulk_count = 0;
+	for (i = 0; i < count; ++i) {
+		if (mbuf[i]->pool != pool || mbuf[i]->nb_segs != 1) {
+			rte_pktmbuf_free(mbuf[i]);
+		} else if (__rte_pktmbuf_prefree_seg(mbuf[i])) {
+			bulk[bulk_count++] = mbuf[i];
+		}
+	}
+	if (bulk_count) {
+		rte_mempool_put_bulk(pool, (void **)bulk, bulk_count);
+	}
+} /* rx_mbuf_free_bulk */
+
+
+/** Receives a burst of datagrams and processes it in stages: all datagrams are
+ * validated and classified first, then the newest acknowledgement in the
+ * burst is applied once, then the data, SACK and FIN datagrams are handled in
+ * turn, and finally all mbufs are freed together.  Datagrams within each
+ * class are handled in the order that they arrived. */
 static int
 process_receive_queue(struct usiw_qp *qp, void *prefetch_addr, uint64_t *now)
 {
 	struct rte_mbuf *rxmbuf[RX_BURST_SIZE];
-	uint16_t rx_count, pkt, i;
+	struct rte_mbuf *data[RX_BURST_SIZE];
+	struct rte_mbuf *sack[RX_BURST_SIZE];
+	struct ee_state *ep = &qp->remote_ep;
+	struct trp_hdr *trp_hdr, *ack_hdr;
+	uint16_t rx_count, data_count, sack_count, pkt;
+	uint64_t start;
+	bool fin, echo;
 
 	/* Get burst of RX packets */
-	if (qp->dev->flags & port_fdir) {
+	if (ep->rx_queue) {
+		if (qp->shared_queue) {
+			shared_queue_receive(qp);
+		}
+		rx_count = rte_ring_dequeue_burst(ep->rx_queue,
+				(void **)rxmbuf, RX_BURST_SIZE);
+	} else if (qp->dev->flags & port_fdir) {
 		rx_count = rte_eth_rx_burst(qp->dev->portid,
 				qp->shm_qp->rx_queue,
 				rxmbuf, RX_BURST_SIZE);
-	} else if (qp->remote_ep.rx_queue) {
-		rx_count = rte_ring_dequeue_burst(qp->remote_ep.rx_queue,
-				(void **)rxmbuf, RX_BURST_SIZE);
 	} else {
 		rx_count = 0;
 	}
 	qp->stats.recv_count_histo[rx_count]++;
-	if (rx_count != 0) {
-		rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[0], void *));
-		if (now) {
-			*now = rte_get_timer_cycles();
-		}
-		for (pkt = 0; pkt < rx_count - 1; ++pkt) {
-			rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[pkt + 1], void *));
-			process_data_packet(qp, rxmbuf[pkt]);
-			rte_pktmbuf_free(rxmbuf[pkt]);
+	start = rte_get_timer_cycles();
+	if (now) {
+		*now = start;
+	}
+	if (rx_count == 0) {
+		return 0;
+	}
+
+	/* Validate and classify the whole burst */
+	for (pkt = 0; pkt < RX_PREFETCH_OFFSET && pkt < rx_count; ++pkt) {
+		rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[pkt], void *));
+	}
+	ack_hdr = NULL;
+	data_count = sack_count = 0;
+	fin = echo = false;
+	for (pkt = 0; pkt < rx_count; ++pkt) {
+		if (pkt + RX_PREFETCH_OFFSET < rx_count) {
+			rte_prefetch0(rte_pktmbuf_mtod(
+					rxmbuf[pkt + RX_PREFETCH_OFFSET],
+					void *));
+		}
+		switch (classify_rx_packet(qp, rxmbuf[pkt])) {
+		case rx_class_data:
+			data[data_count++] = rxmbuf[pkt];
+			break;
+		case rx_class_ack:
+			break;
+		case rx_class_sack:
+			sack[sack_count++] = rxmbuf[pkt];
+			break;
+		case rx_class_fin:
+			fin = true;
+			/* fallthrough */
+		case rx_class_drop:
+		default:
+			continue;
+		}
+
+		/* The acknowledgement and credits are cumulative, so only
+		 * the newest one in the burst matters */
+		trp_hdr = rx_trp_hdr(rxmbuf[pkt]);
+		if (ep->ecn && (rte_be_to_cpu_16(trp_hdr->opcode)
+							& trp_ecn_echo)) {
+			echo = true;
 		}
-		if (prefetch_addr) {
+		if (!ack_hdr || !serial_less_32(
+					rte_be_to_cpu_32(trp_hdr->ack_psn),
+					rte_be_to_cpu_32(ack_hdr->ack_psn))) {
+			ack_hdr = trp_hdr;
+		}
+	}
+
+	/* Update sender state based on received ack_psn and credits */
+	if (ack_hdr) {
+		trp_update_send_window(ep, rte_be_to_cpu_32(ack_hdr->ack_psn),
+				rte_be_to_cpu_16(ack_hdr->opcode)
+							& trp_credits_mask);
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got ACK; now last_acked_psn %" PRIu32 " send_next_psn %" PRIu32 " send_max_psn %" PRIu32 "\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				ep->send_last_acked_psn, ep->send_next_psn,
+				ep->send_max_psn);
+	}
+
+	/* Any number of echoes in one burst count as a single congestion
+	 * notification */
+	if (echo) {
+		qp->stats.ecn_echo_received++;
+		if (dcqcn_notify(&qp->cc, &qp->dev->cc_params, start)) {
+			cc_apply_rate(qp);
+		}
+	}
+
+	for (pkt = 0; pkt < data_count; ++pkt) {
+		if (pkt + 1 < data_count) {
+			rte_prefetch0(rx_trp_hdr(data[pkt + 1]) + 1);
+		} else if (prefetch_addr) {
 			rte_prefetch0(prefetch_addr);
 		}
-		process_data_packet(qp, rxmbuf[rx_count - 1]);
-		rte_pktmbuf_free(rxmbuf[rx_count - 1]);
-	} else if (now) {
-		*now = rte_get_timer_cycles();
+		process_data_packet(qp, data[pkt]);
+	}
+
+	for (pkt = 0; pkt < sack_count; ++pkt) {
+		trp_hdr = rx_trp_hdr(sack[pkt]);
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive SACK ack_psn %" PRIu32 "; send_ack_psn %" PRIu32 "\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				rte_be_to_cpu_32(trp_hdr->ack_psn),
+				ep->send_last_acked_psn);
+		process_trp_sack(qp, ep, (struct trp_sack *)(trp_hdr + 1),
+				rx_trp_payload_length(sack[pkt]));
+	}
+
+	if (fin) {
+		/* This is a finalize packet */
+		qp_shutdown(qp);
 	}
 
+	rx_mbuf_free_bulk(rxmbuf, rx_count);
+	qp->stats.recv_cycles_histo[rx_count]
+					+= rte_get_timer_cycles() - start;
+
 	return rx_count;
-}
+} /* process_receive_queue */
 
 /* Make forward progress on the queue pair.  This does not guarantee that
  * everything that could be done will be done, but rather that if this function
  * is called at a regular interval, user operations will eventually complete
- * (given that the network and remote nodes are operational). */
-static void
+ * (given that the network and remote nodes are operational).  Returns true if
+ * any packet was received or any operation is still outstanding, i.e., if the
+ * queue pair is not idle. */
+static bool
 progress_qp(struct usiw_qp *qp)
 {
 	struct usiw_send_wqe *send_wqe, **prev;
 	uint64_t now;
-	int scount, ret;
+	bool stalled;
+	int ret, rx_count;
 
 	/* Receive loop fills in now for us */
-	process_receive_queue(qp, qp->sq.active_head.tqh_first, &now);
+	rx_count = process_receive_queue(qp, qp->sq.active_head.tqh_first,
+			&now);
+	tx_pacing_update(qp);
+	if (qp->remote_ep.ecn && dcqcn_tick(&qp->cc, &qp->dev->cc_params,
+				now)) {
+		cc_apply_rate(qp);
+	}
 
 	/* Call any timers only once per millisecond */
 	sweep_unacked_packets(qp, now);
 
-	scount = 0;
+	stalled = false;
 	TAILQ_FOR_EACH(send_wqe, &qp->sq.active_head, active, prev) {
 		if (send_wqe->active.tqe_next) {
 			rte_prefetch0(send_wqe->active.tqe_next);
 		}
 		assert(send_wqe->state != SEND_WQE_INIT);
 		progress_send_wqe(qp, send_wqe);
-		if (send_wqe->state == SEND_WQE_TRANSFER
-				|| send_wqe->opcode == usiw_wr_write) {
-			scount++;
+		if (send_wqe->state == SEND_WQE_TRANSFER) {
+			stalled = true;
 		}
 	}
-	if (scount == 0) {
+
+	/* Keep starting new WQEs for as long as every WQE before them has been
+	 * fully handed to TRP.  A WQE left in TRANSFER state is waiting for
+	 * send window, transmit backlog space, ird_max or mbufs, and no later
+	 * WQE may overtake it since
+	 * messages must go on the wire in the order they were posted. */
+	while (!stalled && tx_window_open(qp, &qp->remote_ep)) {
 		ret = rte_ring_dequeue(qp->sq.ring, (void **)&send_wqe);
-		if (ret == 0) {
-			assert(send_wqe->state == SEND_WQE_INIT);
-			send_wqe->state = SEND_WQE_TRANSFER;
-			switch (send_wqe->opcode) {
-				case usiw_wr_send:
-					send_wqe->msn = send_wqe->remote_ep
-							->next_send_msn++;
-					break;
-				case usiw_wr_read:
-					send_wqe->msn = send_wqe->remote_ep
-							->next_read_msn++;
-					break;
-				case usiw_wr_write:
-					break;
-			}
-			usiw_send_wqe_queue_add_active(&qp->sq, send_wqe);
-			progress_send_wqe(qp, send_wqe);
-			scount = 1;
+		if (ret < 0) {
+			break;
 		}
+		assert(send_wqe->state == SEND_WQE_INIT);
+		send_wqe->state = SEND_WQE_TRANSFER;
+		switch (send_wqe->opcode) {
+			case usiw_wr_send:
+				send_wqe->msn = send_wqe->remote_ep
+						->next_send_msn++;
+				break;
+			case usiw_wr_read:
+				send_wqe->msn = send_wqe->remote_ep
+						->next_read_msn++;
+				break;
+			case usiw_wr_write:
+				break;
+		}
+		usiw_send_wqe_queue_add_active(&qp->sq, send_wqe);
+		progress_send_wqe(qp, send_wqe);
+		stalled = (send_wqe->state == SEND_WQE_TRANSFER);
 	}
+	flush_coalesced_segments(qp, &qp->remote_ep);
 
-	scount += respond_rdma_read(qp);
+	respond_rdma_read(qp);
 
+	/* Any data sent above has already carried the acknowledgement; if
+	 * there was none, a separate acknowledgement may wait for more
+	 * datagrams to arrive, up to a limit */
 	if (qp->remote_ep.trp_flags & trp_ack_update) {
 		if (unlikely(qp->remote_ep.trp_flags & trp_recv_missing)) {
 			send_trp_sack(qp);
-		} else {
+		} else if (trp_ack_due(&qp->remote_ep, now)) {
 			send_trp_ack(qp);
 		}
 	}
 
 	flush_tx_queue(qp);
+
+	return rx_count > 0 || qp->sq.active_head.tqh_first
+		|| (qp->remote_ep.trp_flags & trp_ack_update)
+		|| !rte_ring_empty(qp->sq.ring)
+		|| qp->readresp_active.tqh_first || tx_backlog_count(qp)
+		|| qp->remote_ep.send_last_acked_psn
+					!= qp->remote_ep.send_next_psn;
 } /* progress_qp */
 
 
@@ -2021,6 +3704,14 @@ urdma_do_destroy_cq(struct usiw_cq *cq)
 } /* urdma_do_destroy_cq */
 
 
+void
+urdma_do_destroy_srq(struct usiw_srq *srq)
+{
+	usiw_recv_wqe_queue_destroy(&srq->rq);
+	free(srq);
+} /* urdma_do_destroy_srq */
+
+
 void
 usiw_do_destroy_qp(struct usiw_qp *qp)
 {
@@ -2035,9 +3726,17 @@ usiw_do_destroy_qp(struct usiw_qp *qp)
 		}
 	}
 
+	if (qp->srq && atomic_fetch_sub(&qp->srq->refcnt, 1) == 1) {
+		urdma_do_destroy_srq(qp->srq);
+	}
+
+	discard_tx_queue(qp);
+	shared_queue_unbind(qp);
+	shared_queue_free_ring(qp);
 	usiw_recv_wqe_queue_destroy(&qp->rq0);
 	usiw_send_wqe_queue_destroy(&qp->sq);
 	free(qp->readresp_store);
+	free(qp->remote_ep.recv_bitmap);
 
 	memset(&msg, 0, sizeof(msg));
 	msg.hdr.opcode = rte_cpu_to_be_32(urdma_sock_destroy_qp_req);
@@ -2052,6 +3751,7 @@ usiw_do_destroy_qp(struct usiw_qp *qp)
 static void
 start_qp(struct usiw_qp *qp)
 {
+	uint64_t cycles_per_us;
 	unsigned int x;
 	ssize_t ret;
 
@@ -2072,8 +3772,10 @@ start_qp(struct usiw_qp *qp)
 				qp_entry);
 	}
 
-	/* FIXME: Get this from the peer */
-	qp->remote_ep.send_max_psn = qp->shm_qp->rx_desc_count / 2;
+	/* The peer advertises its real credits in every TRP header; until we
+	 * hear from it, assume only a conservative number */
+	qp->remote_ep.send_max_psn = qp->remote_ep.send_last_acked_psn
+		+ RTE_MIN(TRP_CREDITS_INITIAL, qp->shm_qp->rx_desc_count / 2);
 	qp->remote_ep.tx_pending_size = qp->shm_qp->rx_desc_count / 2;
 	qp->remote_ep.tx_pending = calloc(qp->remote_ep.tx_pending_size,
 			sizeof(*qp->remote_ep.tx_pending));
@@ -2082,11 +3784,81 @@ start_qp(struct usiw_qp *qp)
 						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 						strerror(errno));
 		atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
-		free(qp->readresp_store);
+		/* usiw_do_destroy_qp() frees readresp_store */
 		rte_spinlock_unlock(&qp->shm_qp->conn_event_lock);
 		return;
 	}
 	qp->remote_ep.tx_head = qp->remote_ep.tx_pending;
+	qp->remote_ep.recv_window_size = qp->shm_qp->rx_desc_count / 2;
+	qp->remote_ep.recv_bitmap = calloc(
+			(qp->remote_ep.recv_window_size + 63) / 64,
+			sizeof(*qp->remote_ep.recv_bitmap));
+	if (!qp->remote_ep.recv_bitmap) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up recv_bitmap failed: %s\n",
+						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+						strerror(errno));
+		atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
+		/* usiw_do_destroy_qp() frees readresp_store */
+		free(qp->remote_ep.tx_pending);
+		rte_spinlock_unlock(&qp->shm_qp->conn_event_lock);
+		return;
+	}
+	if (qp->shared_queue) {
+		ret = shared_queue_bind(qp);
+		if (ret < 0) {
+			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Bind to shared queue %" PRIu16 " failed: %s\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+					qp->shm_qp->rx_queue, strerror(-ret));
+			atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
+			/* usiw_do_destroy_qp() frees recv_bitmap and
+			 * readresp_store */
+			free(qp->remote_ep.tx_pending);
+			rte_spinlock_unlock(&qp->shm_qp->conn_event_lock);
+			return;
+		}
+	}
+	/* The timer wheel needs to resolve the smallest allowed timeout */
+	cycles_per_us = rte_get_timer_hz() / 1000000;
+	qp->remote_ep.rto_min = cycles_per_us
+		* qp->dev->tunables.retransmit_timeout_min_us;
+	qp->remote_ep.rto_max = cycles_per_us
+		* qp->dev->tunables.retransmit_timeout_max_us;
+	qp->remote_ep.rto = RTE_MAX(qp->remote_ep.rto_min,
+			RTE_MIN(cycles_per_us * RETRANSMIT_TIMEOUT_INITIAL_US,
+				qp->remote_ep.rto_max));
+	qp->remote_ep.srtt = 0;
+	qp->remote_ep.rttvar = 0;
+	build_tx_hdr_template(qp);
+	build_rx_hdr_match(qp);
+	/* Coalesced payloads must always be copied, and at least two of them
+	 * must fit in a datagram */
+	qp->remote_ep.coalesce_msg = NULL;
+	qp->remote_ep.coalesce_max = 0;
+	if ((qp->shm_qp->features & trp_rr_coalesce)
+			&& qp->dev->tunables.zero_copy_threshold > 0) {
+		qp->remote_ep.coalesce_max = RTE_MIN(RTE_MIN(
+				qp->dev->tunables.coalesce_threshold,
+				qp->dev->tunables.zero_copy_threshold - 1),
+				qp->shm_qp->mtu / 2);
+	}
+	timer_wheel_init(&qp->remote_ep.retransmit_timers,
+			RTE_MAX(qp->remote_ep.rto_min / 4, cycles_per_us),
+			rte_get_timer_cycles());
+	qp->remote_ep.ack_pending_count = 0;
+	qp->remote_ep.ack_segments = RTE_MIN(
+			qp->dev->tunables.ack_segments,
+			RTE_MAX(qp->remote_ep.recv_window_size / 2, 1));
+	/* The peer must hear from us well before it retransmits */
+	qp->remote_ep.ack_delay = RTE_MIN(cycles_per_us
+			* qp->dev->tunables.ack_delay_us,
+			qp->remote_ep.rto_min / 2);
+	/* Congestion control starts at the line rate, with the pacer idle */
+	qp->remote_ep.ecn = !!(qp->shm_qp->features & trp_rr_ecn);
+	dcqcn_init(&qp->cc, &qp->dev->cc_params, rte_get_timer_cycles());
+	tx_pacer_init(&qp->cc_pacer, 0, 0);
+	if (qp->remote_ep.ecn) {
+		qp->stats.cc_rate_mbps = qp->cc.current_rate;
+	}
 
 	atomic_store(&qp->shm_qp->conn_state, usiw_qp_running);
 	atomic_fetch_sub(&qp->ctx->qp_init_count, 1);
@@ -2094,92 +3866,539 @@ start_qp(struct usiw_qp *qp)
 } /* start_qp */
 
 
-static struct usiw_qp *
-find_matching_qp(struct usiw_context *ctx, struct rte_mbuf *pkt)
+struct usiw_progress_lcore *
+progress_lcore_least_loaded(struct usiw_driver *driver)
 {
-	struct usiw_qp *qp, **prev;
-	struct ether_hdr *ether;
-	struct ipv4_hdr *ipv4;
-	struct udp_hdr *udp;
+	struct usiw_progress_lcore *best;
+	unsigned int i, count, best_count;
+
+	best = &driver->progress[0];
+	best_count = atomic_load(&best->qp_count);
+	for (i = 1; i < driver->progress_lcore_count; ++i) {
+		count = atomic_load(&driver->progress[i].qp_count);
+		if (count < best_count) {
+			best = &driver->progress[i];
+			best_count = count;
+		}
+	}
 
-	ether = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
-	if (ether->ether_type != ETHER_TYPE_IPv4) {
-		return NULL;
+	return best;
+} /* progress_lcore_least_loaded */
+
+
+/** Registers the receive queue interrupt of qp with the epoll instance of lc,
+ * and sets qp->rx_intr if lc is to enable it before sleeping.  A shared
+ * hardware queue has a single interrupt, which is registered with the lcore of
+ * the first queue pair on the queue to get here; other lcores are woken by
+ * progress_wake_qp() when that lcore hands them a datagram. */
+static void
+progress_lcore_register_rx_intr(struct usiw_progress_lcore *lc,
+		struct usiw_qp *qp)
+{
+	struct usiw_shared_queue *sq = qp->shared_queue;
+	int ret;
+
+	if (sq) {
+		rte_spinlock_lock(&sq->rx_lock);
+		if (sq->intr_lcore || sq->intr_unavailable) {
+			if (sq->intr_lcore == lc) {
+				sq->intr_qp_count++;
+				qp->rx_intr = true;
+			}
+			rte_spinlock_unlock(&sq->rx_lock);
+			return;
+		}
 	}
-	ipv4 = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, sizeof(*ether));
-	if (ipv4->next_proto_id != IP_HDR_PROTO_UDP) {
-		return NULL;
+
+	ret = rte_eth_dev_rx_intr_ctl_q(qp->dev->portid, qp->shm_qp->rx_queue,
+			lc->epfd, RTE_INTR_EVENT_ADD, qp);
+	qp->rx_intr = (ret == 0);
+	if (ret) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> no receive interrupt: %s\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				rte_strerror(-ret));
 	}
-	udp = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *,
-			sizeof(*ether) + sizeof(*ipv4));
 
-	LIST_FOR_EACH(qp, &ctx->qp_active, ctx_entry, prev) {
-		if (qp->shm_qp->remote_ipv4_addr == ipv4->dst_addr
-				&& qp->shm_qp->remote_udp_port
-				== udp->dst_port) {
-			return qp;
+	if (sq) {
+		if (ret == 0) {
+			sq->intr_lcore = lc;
+			sq->intr_qp_count = 1;
+		} else {
+			sq->intr_unavailable = true;
 		}
+		rte_spinlock_unlock(&sq->rx_lock);
 	}
+} /* progress_lcore_register_rx_intr */
 
-	return NULL;
-} /* find_matching_qp */
 
+/** Undoes progress_lcore_register_rx_intr().  The interrupt of a shared
+ * hardware queue stays registered while other queue pairs of lc use it; once
+ * it is unregistered, the next lcore to sleep with a queue pair on the queue
+ * registers it again. */
+static void
+progress_lcore_unregister_rx_intr(struct usiw_progress_lcore *lc,
+		struct usiw_qp *qp)
+{
+	struct usiw_shared_queue *sq = qp->shared_queue;
 
-int
-kni_loop(void *arg)
+	if (!qp->rx_intr) {
+		return;
+	}
+	qp->rx_intr = false;
+	if (sq) {
+		rte_spinlock_lock(&sq->rx_lock);
+		if (--sq->intr_qp_count > 0) {
+			rte_spinlock_unlock(&sq->rx_lock);
+			return;
+		}
+		sq->intr_lcore = NULL;
+	}
+	rte_eth_dev_rx_intr_ctl_q(qp->dev->portid, qp->shm_qp->rx_queue,
+			lc->epfd, RTE_INTR_EVENT_DEL, qp);
+	if (sq) {
+		rte_spinlock_unlock(&sq->rx_lock);
+	}
+} /* progress_lcore_unregister_rx_intr */
+
+
+/** Takes ownership of a queue pair handed to this lcore, registering its
+ * receive queue interrupt so that the lcore can sleep until a packet arrives
+ * for it.  If the interrupt cannot be registered (the port was not configured
+ * with "rx_interrupts", the driver does not support it, or it is not available
+ * in a secondary process), sleeping is still bounded by
+ * PROGRESS_SLEEP_TIMEOUT_MS. */
+static void
+progress_lcore_adopt_qp(struct usiw_progress_lcore *lc, struct usiw_qp *qp)
+{
+	LIST_INSERT_HEAD(&lc->qp_active, qp, progress_entry);
+	atomic_store(&qp->progress_lcore, (uintptr_t)lc);
+	qp->cqe_batch = &lc->cqe_batch;
+	qp->rx_intr = false;
+	if (lc->epfd >= 0 && (qp->dev->flags & port_fdir)) {
+		progress_lcore_register_rx_intr(lc, qp);
+	}
+} /* progress_lcore_adopt_qp */
+
+
+/** Releases a queue pair from this lcore's qp_active list.  Its staged CQEs
+ * are published first, since the queue pair may be destroyed or progressed by
+ * another lcore right after this. */
+static void
+progress_lcore_release_qp(struct usiw_progress_lcore *lc, struct usiw_qp *qp)
+{
+	cqe_batch_flush(&lc->cqe_batch);
+	qp->cqe_batch = NULL;
+	LIST_REMOVE(qp, progress_entry);
+	progress_lcore_unregister_rx_intr(lc, qp);
+} /* progress_lcore_release_qp */
+
+
+/** Moves one queue pair from this lcore to the least loaded progress lcore if
+ * this lcore owns at least two more queue pairs than that lcore.  Only the
+ * owning lcore may remove a queue pair from its qp_active list, so each lcore
+ * sheds its own excess load when it notices that rebalance_gen has changed. */
+static void
+progress_lcore_rebalance(struct usiw_progress_lcore *lc)
+{
+	struct usiw_driver *driver = lc->driver;
+	struct usiw_progress_lcore *target;
+	struct usiw_qp *qp;
+
+	target = progress_lcore_least_loaded(driver);
+	if (target == lc || atomic_load(&target->qp_count) + 1
+					>= atomic_load(&lc->qp_count)) {
+		return;
+	}
+
+	qp = lc->qp_active.lh_first;
+	if (!qp) {
+		return;
+	}
+
+	progress_lcore_release_qp(lc, qp);
+	atomic_fetch_sub(&lc->qp_count, 1);
+	atomic_fetch_add(&target->qp_count, 1);
+	if (rte_ring_enqueue(target->new_qps, qp) == -ENOBUFS) {
+		/* The target is still busy adopting other queue pairs; keep
+		 * this one and try again later. */
+		atomic_fetch_sub(&target->qp_count, 1);
+		atomic_fetch_add(&lc->qp_count, 1);
+		progress_lcore_adopt_qp(lc, qp);
+	} else {
+		progress_lcore_wake(target);
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> migrate from lcore %u to lcore %u\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				lc->lcore_id, target->lcore_id);
+	}
+
+	/* Let the other lcores re-check in case more than one queue pair needs
+	 * to move. */
+	atomic_fetch_add(&driver->rebalance_gen, 1);
+} /* progress_lcore_rebalance */
+
+
+/** Drains the new context ring and drops handles for contexts that have been
+ * closed.  Only called from the first progress lcore, or from the
+ * housekeeping thread in application progress mode. */
+static void
+progress_contexts(struct usiw_driver *driver)
 {
 	struct usiw_context_handle *h, **h_prev;
-	struct usiw_context *ctx;
-	struct usiw_driver *driver;
-	struct usiw_qp *qp, **qp_prev;
-	struct rte_mbuf *rxmbuf[RX_BURST_SIZE];
 	void *ctxs_to_add[NEW_CTX_MAX];
 	unsigned int i, count;
-	int portid, ret;
 
-	driver = arg;
-	sem_wait(&driver->go);
+	count = rte_ring_dequeue_burst(driver->new_ctxs, ctxs_to_add,
+				     NEW_CTX_MAX);
+	for (i = 0; i < count; ++i) {
+		h = (struct usiw_context_handle *)ctxs_to_add[i];
+		LIST_INSERT_HEAD(&driver->ctxs, h, driver_entry);
+	}
+
+	LIST_FOR_EACH(h, &driver->ctxs, driver_entry, h_prev) {
+		if (unlikely(!atomic_load(&h->ctxp))) {
+			LIST_REMOVE(h, driver_entry);
+			free(h);
+		}
+	}
+} /* progress_contexts */
+
+
+/** Makes progress on the queue pair according to its connection state, and
+ * sets *busy if the queue pair is not idle.  Returns false once the queue pair
+ * has reached the error state and needs no further progress. */
+static bool
+progress_qp_state(struct usiw_qp *qp, bool *busy)
+{
+	switch (atomic_load(&qp->shm_qp->conn_state)) {
+	case usiw_qp_connected:
+		/* start_qp() transitions to usiw_qp_running */
+		start_qp(qp);
+		*busy = true;
+		/* fallthrough */
+	case usiw_qp_running:
+		if (progress_qp(qp)) {
+			*busy = true;
+		}
+		return true;
+	case usiw_qp_shutdown:
+		/* qp_shutdown() transitions to usiw_qp_error */
+		qp_shutdown(qp);
+		/* fallthrough */
+	case usiw_qp_error:
+		return false;
+	default:
+		return true;
+	}
+} /* progress_qp_state */
+
+
+void
+progress_lcore_wake(struct usiw_progress_lcore *lc)
+{
+	uint_fast64_t expected = 0;
+	uint64_t one = 1;
+	ssize_t ret;
+
+	if (!atomic_load(&lc->sleeping)) {
+		return;
+	}
+
+	/* Only the first request after the lcore goes to sleep writes to the
+	 * eventfd, and its time is used to measure the wake-up latency. */
+	if (atomic_compare_exchange_strong(&lc->wake_request_time, &expected,
+						rte_get_timer_cycles())) {
+		ret = write(lc->wake_fd, &one, sizeof(one));
+		assert(ret == sizeof(one));
+		(void)ret;
+	}
+} /* progress_lcore_wake */
+
+
+int
+progress_lcore_init_sleep(struct usiw_progress_lcore *lc)
+{
+	int ret;
+
+	lc->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lc->epfd < 0) {
+		return -errno;
+	}
+	lc->wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (lc->wake_fd < 0) {
+		ret = -errno;
+		goto close_epfd;
+	}
+	lc->wake_event.epdata.event = EPOLLIN;
+	lc->wake_event.epdata.data = lc;
+	ret = rte_epoll_ctl(lc->epfd, EPOLL_CTL_ADD, lc->wake_fd,
+			&lc->wake_event);
+	if (ret < 0) {
+		goto close_wake_fd;
+	}
+	return 0;
+
+close_wake_fd:
+	close(lc->wake_fd);
+close_epfd:
+	close(lc->epfd);
+	lc->epfd = lc->wake_fd = -1;
+	return ret;
+} /* progress_lcore_init_sleep */
+
+
+/** Consumes any pending wake-up request from the eventfd of the progress lcore.
+ * Returns true if one was pending. */
+static bool
+progress_lcore_consume_wake(struct usiw_progress_lcore *lc)
+{
+	uint64_t value;
+	ssize_t ret;
+
+	do {
+		ret = read(lc->wake_fd, &value, sizeof(value));
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && errno != EAGAIN) {
+		RTE_LOG(ERR, USER1, "progress lcore %u: read wake eventfd failed: %s\n",
+				lc->index, strerror(errno));
+	}
+	return ret == sizeof(value);
+} /* progress_lcore_consume_wake */
+
+
+/** Blocks until a receive queue interrupt fires for one of our queue pairs, a
+ * work request is posted to one of them, or PROGRESS_SLEEP_TIMEOUT_MS
+ * passes. */
+static void
+progress_lcore_sleep(struct usiw_progress_lcore *lc)
+{
+	struct rte_epoll_event events[PROGRESS_SLEEP_EVENTS_MAX];
+	struct usiw_qp *qp;
+	uint64_t start, end, requested, latency;
+	bool post;
+	int count, i;
+
+	/* Discard any wake-up requested while we were not sleeping */
+	progress_lcore_consume_wake(lc);
+	atomic_store(&lc->wake_request_time, 0);
+
+	/* A post that did not see sleeping set must be visible to us now,
+	 * since both sides use sequentially consistent atomics after the
+	 * ring operation. */
+	atomic_store(&lc->sleeping, true);
+	if (!rte_ring_empty(lc->new_qps)) {
+		goto cancel;
+	}
+	for (qp = lc->qp_active.lh_first; qp != NULL;
+			qp = qp->progress_entry.le_next) {
+		if (!rte_ring_empty(qp->sq.ring)) {
+			goto cancel;
+		}
+	}
+	for (qp = lc->qp_active.lh_first; qp != NULL;
+			qp = qp->progress_entry.le_next) {
+		/* Take over the interrupt of a shared queue that the lcore
+		 * which registered it has let go of */
+		if (!qp->rx_intr && qp->shared_queue
+					&& (qp->dev->flags & port_fdir)) {
+			progress_lcore_register_rx_intr(lc, qp);
+		}
+		if (qp->rx_intr) {
+			rte_eth_dev_rx_intr_enable(qp->dev->portid,
+					qp->shm_qp->rx_queue);
+		}
+	}
+
+	start = rte_get_timer_cycles();
+	count = rte_epoll_wait(lc->epfd, events, RTE_DIM(events),
+			PROGRESS_SLEEP_TIMEOUT_MS);
+	if (count < 0) {
+		count = 0;
+	}
+	end = rte_get_timer_cycles();
+	atomic_store(&lc->sleeping, false);
+
+	for (qp = lc->qp_active.lh_first; qp != NULL;
+			qp = qp->progress_entry.le_next) {
+		if (qp->rx_intr) {
+			rte_eth_dev_rx_intr_disable(qp->dev->portid,
+					qp->shm_qp->rx_queue);
+		}
+	}
+
+	post = false;
+	for (i = 0; i < count; ++i) {
+		if (events[i].epdata.data == lc) {
+			post = true;
+		} else {
+			lc->stats.wakeup_rx++;
+		}
+	}
+	if (progress_lcore_consume_wake(lc)) {
+		post = true;
+	}
+	requested = atomic_exchange(&lc->wake_request_time, 0);
+	if (post && requested) {
+		latency = end - requested;
+		lc->stats.wakeup_post++;
+		lc->stats.wakeup_latency_total += latency;
+		if (latency > lc->stats.wakeup_latency_max) {
+			lc->stats.wakeup_latency_max = latency;
+		}
+	}
+	if (count == 0) {
+		lc->stats.wakeup_timeout++;
+	}
+	lc->stats.sleep_cycles += end - start;
+	lc->stats.sleep_count++;
+	return;
+
+cancel:
+	atomic_store(&lc->sleeping, false);
+} /* progress_lcore_sleep */
+
+
+int
+kni_loop(void *arg)
+{
+	struct usiw_progress_lcore *lc;
+	struct usiw_driver *driver;
+	struct usiw_qp *qp, **qp_prev;
+	void *qps_to_add[NEW_QP_BURST];
+	unsigned int i, count, gen;
+	uint64_t now, idle_cycles;
+	bool busy;
+
+	lc = arg;
+	driver = lc->driver;
+	idle_cycles = driver->tunables.progress_idle_us * rte_get_timer_hz()
+								/ 1000000;
+	lc->start_time = lc->idle_since = rte_get_timer_cycles();
 	while (1) {
-		count = rte_ring_dequeue_burst(driver->new_ctxs, ctxs_to_add,
-					     NEW_CTX_MAX);
+		if (lc->index == 0) {
+			progress_contexts(driver);
+		}
+
+		count = rte_ring_dequeue_burst(lc->new_qps, qps_to_add,
+					     NEW_QP_BURST);
 		for (i = 0; i < count; ++i) {
-			h = (struct usiw_context_handle *)ctxs_to_add[i];
-			LIST_INSERT_HEAD(&driver->ctxs, h, driver_entry);
+			qp = (struct usiw_qp *)qps_to_add[i];
+			progress_lcore_adopt_qp(lc, qp);
 		}
+		busy = count > 0;
 
-		LIST_FOR_EACH(h, &driver->ctxs, driver_entry, h_prev) {
-			ctx = (void *)atomic_load(&h->ctxp);
-			if (unlikely(!ctx)) {
-				LIST_REMOVE(h, driver_entry);
-				free(h);
-				continue;
-			}
-			LIST_FOR_EACH(qp, &ctx->qp_active, ctx_entry, qp_prev) {
-				switch (atomic_load(&qp->shm_qp->conn_state)) {
-				case usiw_qp_connected:
-					/* start_qp() transitions to
-					 * usiw_qp_running */
-					start_qp(qp);
-				case usiw_qp_running:
-					progress_qp(qp);
-					break;
-				case usiw_qp_shutdown:
-					qp_shutdown(qp);
-					/* qp_shutdown() transitions to
-					 * usiw_qp_error */
-				case usiw_qp_error:
-					LIST_REMOVE(qp, ctx_entry);
-					if (atomic_fetch_sub(&qp->refcnt,
-								1) == 1) {
-						usiw_do_destroy_qp(qp);
-					}
-					break;
-				default:
-					break;
+		gen = atomic_load(&driver->rebalance_gen);
+		if (unlikely(gen != lc->rebalance_gen)) {
+			lc->rebalance_gen = gen;
+			progress_lcore_rebalance(lc);
+		}
+
+		LIST_FOR_EACH(qp, &lc->qp_active, progress_entry, qp_prev) {
+			if (!progress_qp_state(qp, &busy)) {
+				progress_lcore_release_qp(lc, qp);
+				atomic_fetch_sub(&lc->qp_count, 1);
+				atomic_fetch_add(&driver->rebalance_gen, 1);
+				if (atomic_fetch_sub(&qp->refcnt,
+							1) == 1) {
+					usiw_do_destroy_qp(qp);
 				}
 			}
 		}
+		cqe_batch_flush(&lc->cqe_batch);
+
+		if (lc->epfd < 0) {
+			continue;
+		}
+		now = rte_get_timer_cycles();
+		if (busy) {
+			lc->idle_since = now;
+		} else if (now - lc->idle_since >= idle_cycles) {
+			progress_lcore_sleep(lc);
+			lc->idle_since = rte_get_timer_cycles();
+		}
 	}
 
 	return EXIT_FAILURE;
 } /* kni_loop */
+
+
+void
+app_progress_housekeeping_loop(struct usiw_driver *driver)
+{
+	static const struct timespec interval = { .tv_nsec = 10000000 };
+
+	while (1) {
+		progress_contexts(driver);
+		nanosleep(&interval, NULL);
+	}
+} /* app_progress_housekeeping_loop */
+
+
+void
+progress_cq_add_qp(struct usiw_qp *qp)
+{
+	qp->send_cq_link.qp = qp;
+	rte_spinlock_lock(&qp->send_cq->qp_links_lock);
+	LIST_INSERT_HEAD(&qp->send_cq->qp_links, &qp->send_cq_link, entry);
+	rte_spinlock_unlock(&qp->send_cq->qp_links_lock);
+
+	if (qp->recv_cq != qp->send_cq) {
+		qp->recv_cq_link.qp = qp;
+		rte_spinlock_lock(&qp->recv_cq->qp_links_lock);
+		LIST_INSERT_HEAD(&qp->recv_cq->qp_links, &qp->recv_cq_link,
+				entry);
+		rte_spinlock_unlock(&qp->recv_cq->qp_links_lock);
+	}
+} /* progress_cq_add_qp */
+
+
+void
+progress_cq_remove_qp(struct usiw_qp *qp)
+{
+	rte_spinlock_lock(&qp->send_cq->qp_links_lock);
+	LIST_REMOVE(&qp->send_cq_link, entry);
+	rte_spinlock_unlock(&qp->send_cq->qp_links_lock);
+
+	if (qp->recv_cq != qp->send_cq) {
+		rte_spinlock_lock(&qp->recv_cq->qp_links_lock);
+		LIST_REMOVE(&qp->recv_cq_link, entry);
+		rte_spinlock_unlock(&qp->recv_cq->qp_links_lock);
+	}
+
+	/* A thread that called progress_qp_inline() may still be using it */
+	rte_spinlock_lock(&qp->progress_lock);
+	rte_spinlock_unlock(&qp->progress_lock);
+} /* progress_cq_remove_qp */
+
+
+void
+progress_qp_inline(struct usiw_qp *qp)
+{
+	struct usiw_cqe_batch batch;
+	bool busy;
+
+	if (rte_spinlock_trylock(&qp->progress_lock)) {
+		/* Publish before unlocking, so that CQEs of this queue pair
+		 * are never published out of order by another thread */
+		batch.cq_count = 0;
+		batch.srq_event_count = 0;
+		qp->cqe_batch = &batch;
+		progress_qp_state(qp, &busy);
+		cqe_batch_flush(&batch);
+		qp->cqe_batch = NULL;
+		rte_spinlock_unlock(&qp->progress_lock);
+	}
+} /* progress_qp_inline */
+
+
+void
+progress_cq(struct usiw_cq *cq)
+{
+	struct usiw_cq_qp_link *link;
+
+	rte_spinlock_lock(&cq->qp_links_lock);
+	for (link = cq->qp_links.lh_first; link != NULL;
+			link = link->entry.le_next) {
+		progress_qp_inline(link->qp);
+	}
+	rte_spinlock_unlock(&cq->qp_links_lock);
+} /* progress_cq */
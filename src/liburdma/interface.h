@@ -52,19 +52,27 @@
 
 #include <rte_ethdev.h>
 #include <rte_ether.h>
+#include <rte_interrupts.h>
+#include <rte_ip.h>
 #include <rte_kni.h>
 #include <rte_mbuf.h>
 #include <rte_mempool.h>
 #include <rte_ring.h>
 #include <rte_spinlock.h>
+#include <rte_udp.h>
 
+#include "urdma_kabi.h"
 #include "urdmad_private.h"
+#include "dcqcn.h"
 #include "list.h"
+#include "timer_wheel.h"
 #include "verbs.h"
 
 #define TX_BURST_SIZE 8
+#define TX_BURST_SIZE_MAX 32
+#define TX_BACKLOG_SIZE 256
 #define RX_BURST_SIZE 32
-#define DPDKV_MAX_QP 64
+#define DPDKV_MAX_QP 1024
 #define MAX_ARP_ENTRIES 32
 #define MAX_RECV_WR 1023
 #define MAX_SEND_WR 1023
@@ -72,17 +80,65 @@
 #define DPDK_VERBS_RDMA_READ_IOV_LEN_MAX 1
 #define MAX_MR_SIZE (UINT32_C(1) << 30)
 #define USIW_IRD_MAX 128
+/* MUST be a power of 2 */
 #define USIW_ORD_MAX 128
+#define ZERO_COPY_THRESHOLD_DEFAULT 1024
+#define FAST_RETRANSMIT_LIMIT_DEFAULT 8
+#define RETRANSMIT_TIMEOUT_INITIAL_US 10000
+/* Credits assumed before the peer has advertised any */
+#define TRP_CREDITS_INITIAL 16
+#define RETRANSMIT_TIMEOUT_MIN_US_DEFAULT 100
+#define RETRANSMIT_TIMEOUT_MAX_US_DEFAULT 100000
+#define COALESCE_THRESHOLD_MAX UINT16_MAX
+#define ACK_SEGMENTS_DEFAULT 4
+#define ACK_DELAY_US_DEFAULT 10
+/* Longest a sleeping progress lcore waits before checking its queue pairs for
+ * connection state changes and expired timers */
+#define PROGRESS_SLEEP_TIMEOUT_MS 1
+#define PROGRESS_SLEEP_EVENTS_MAX 16
+#define TX_PACER_FRAC_BITS 16
+#define TX_PACER_BURST_MAX (16 * 1024 * 1024)
+#define RATE_BURST_DEFAULT 65536
+/* Line rate assumed by congestion control if the link speed is unknown */
+#define CC_LINE_RATE_DEFAULT_MBPS 10000
+
+/* Completion queues and CQEs per completion queue that a progress pass stages
+ * before publishing them */
+#define CQE_BATCH_CQ_MAX 8
+#define CQE_BATCH_SIZE 32
+#define CQE_BATCH_SRQ_EVENT_MAX 4
 
 /* MUST be a power of 2 minus 1 */
 #define NEW_CTX_MAX 31
 
+/* MUST be a power of 2 minus 1.  Large enough that a progress lcore's ring
+ * can hold every queue pair of a device at once, so queue pair creation never
+ * has to wait for the progress lcore to drain it. */
+#define NEW_QP_MAX (DPDKV_MAX_QP - 1)
+
+/* Queue pairs a progress lcore adopts from its ring per loop iteration */
+#define NEW_QP_BURST 64
+
 #define STAG_TYPE_MASK      UINT32_C(0xFF000000)
 #define STAG_MASK           UINT32_C(0x00FFFFFF)
 #define STAG_TYPE_MR        (UINT32_C(0x00) << 24)
 #define STAG_TYPE_RDMA_READ (UINT32_C(0x01) << 24)
 #define STAG_RDMA_READ(x) (STAG_TYPE_RDMA_READ | ((x) & STAG_MASK))
 
+/* An STAG_TYPE_MR STag holds the index of the region in its memory region
+ * table in bits 8-23 and an 8-bit key in bits 0-7.  The key is advanced each
+ * time the table entry is freed so that stale STags do not match. */
+#define STAG_MR_INDEX_SHIFT 8
+#define STAG_MR_KEY_MASK    UINT32_C(0x000000FF)
+#define STAG_MR_INDEX_MAX   (STAG_MASK >> STAG_MR_INDEX_SHIFT)
+#define STAG_MR(index, key) (STAG_TYPE_MR \
+		| (((index) << STAG_MR_INDEX_SHIFT) & STAG_MASK) \
+		| ((key) & STAG_MR_KEY_MASK))
+#define STAG_MR_INDEX(x)    (((x) & STAG_MASK) >> STAG_MR_INDEX_SHIFT)
+
+/* Sentinel for the end of the memory region table free list */
+#define USIW_MR_FREE_END    UINT32_MAX
+
 struct usiw_context;
 struct usiw_device;
 struct usiw_qp;
@@ -108,7 +164,6 @@ struct usiw_wc {
 struct usiw_recv_wqe {
 	void *wr_context;
 	struct ee_state *remote_ep;
-	TAILQ_ENTRY(usiw_recv_wqe) active;
 	uint32_t msn;
 	uint32_t index;
 	size_t total_request_size;
@@ -120,14 +175,31 @@ struct usiw_recv_wqe {
 };
 
 struct pending_datagram_info {
-	uint64_t next_retransmit;
+	struct timer_wheel_entry retransmit;
+	uint64_t send_time;
+		/**< rte_get_timer_cycles() at the most recent transmission. */
+	uint64_t first_send_time;
+		/**< rte_get_timer_cycles() at the first transmission. */
 	struct usiw_send_wqe *wqe;
 	uint16_t transmit_count;
+	uint16_t flags;
 	uint16_t ddp_length;
+	uint16_t wqe_count;
+		/**< Number of WQEs with a segment in this datagram, starting
+		 * with wqe and following sq.active_head; 1 unless
+		 * pending_coalesced is set. */
 	uint32_t ddp_raw_cksum;
 	uint32_t psn;
 };
 
+enum {
+	pending_fast_retransmitted = 1,
+		/**< Segment was already resent once in response to a SACK. */
+	pending_coalesced = 2,
+		/**< Datagram is a trp_coalesced packet holding the whole
+		 * payload of each of its WQEs. */
+};
+
 enum usiw_send_wqe_state {
 	SEND_WQE_INIT = 0,
 	SEND_WQE_TRANSFER,
@@ -146,6 +218,17 @@ enum {
 	usiw_send_inline = 2,
 };
 
+/** Where a buffer lies in DPDK hugepage memory, so that it can be handed to the
+ * NIC without copying. */
+struct usiw_phys_range {
+	phys_addr_t addr;
+		/**< Physical address of the first byte, or RTE_BAD_PHYS_ADDR if
+		 * the buffer is not in hugepage memory. */
+	size_t len;
+		/**< Bytes starting at addr which are physically contiguous.  Any
+		 * bytes past this must be looked up with hugepage_virt2phy(). */
+};
+
 struct usiw_send_wqe {
 	enum usiw_send_opcode opcode;
 	void *wr_context;
@@ -162,28 +245,44 @@ struct usiw_send_wqe {
 	size_t bytes_sent;
 	size_t bytes_acked;
 
+	struct usiw_phys_range *iov_phys;
+		/**< Physical location of each entry of iov; points past the
+		 * end of iov so that inline data cannot overwrite it. */
 	size_t iov_count;
 	struct iovec iov[];
 };
 
 struct usiw_mr {
 	struct ibv_mr mr;
-	struct usiw_mr *next;
 	int access;
+	bool in_use;
+	struct usiw_phys_range phys;
+		/**< Physical location of mr.addr, looked up at registration. */
+	uint8_t key; /**< Key byte of the next STag issued for this entry. */
+	uint32_t next_free; /**< Free list links; only valid if !in_use. */
+	uint32_t prev_free;
 };
 
-/* Lookup table for memory regions */
+/* Lookup table for memory regions, indexed by STAG_MR_INDEX(rkey).  All
+ * entries are preallocated with the protection domain; registration takes an
+ * entry off of the free list under lock, while lookup from the progress thread
+ * is a lockless load of a single entry. */
 struct usiw_mr_table {
 	struct ibv_pd pd;
+	rte_spinlock_t lock;
+	uint32_t free_head;
 	size_t capacity;
 	size_t mr_count;
-	struct usiw_mr *entries[0];
+	struct usiw_mr entries[];
 };
 
 struct usiw_send_wqe_queue {
 	struct rte_ring *ring;
 	struct rte_ring *free_ring;
 	TAILQ_HEAD(usiw_send_wqe_active_head, usiw_send_wqe) active_head;
+	struct usiw_send_wqe *read_active[USIW_ORD_MAX];
+		/**< Active RDMA READ WQEs, indexed by msn so that READ
+		 * Responses can find their WQE in constant time. */
 	char *storage;
 	int max_wr;
 	int max_sge;
@@ -194,21 +293,50 @@ struct usiw_send_wqe_queue {
 struct usiw_recv_wqe_queue {
 	struct rte_ring *ring;
 	struct rte_ring *free_ring;
-	TAILQ_HEAD(usiw_recv_wqe_active_head, usiw_recv_wqe) active_head;
+	struct usiw_recv_wqe **active;
+		/**< Active WQEs, indexed by msn & active_mask.  An entry is
+		 * only valid if the msn of the WQE stored there matches. */
+	uint32_t active_mask;
 	char *storage;
 	int max_wr;
 	int max_sge;
 	rte_spinlock_t lock;
 };
 
-struct psn_range {
-	uint32_t min;
-	uint32_t max;
+enum usiw_recv_wqe_queue_flags {
+	usiw_rq_shared = 1,
+		/**< The queue is the WQE pool of a shared receive queue: WQEs
+		 * are posted and consumed from many threads, and there is no
+		 * active table. */
+	usiw_rq_srq_user = 2,
+		/**< The queue belongs to a queue pair attached to a shared
+		 * receive queue: only the active table is allocated. */
+};
+
+struct usiw_srq {
+	atomic_uint refcnt;
+		/**< One reference for the user, plus one for each queue pair
+		 * attached to the SRQ. */
+	struct ibv_srq ib_srq;
+	struct usiw_recv_wqe_queue rq;
+	uint32_t srq_id;
+	atomic_uint srq_limit;
+		/**< When the number of posted WQEs drops below this value, the
+		 * IBV_EVENT_SRQ_LIMIT_REACHED event is raised and the limit is
+		 * reset to 0, which disarms it. */
 };
 
 enum {
 	trp_recv_missing = 1,
 	trp_ack_update = 2,
+	trp_recv_ce = 4,
+		/**< A datagram marked Congestion Experienced has arrived since
+		 * we last sent a TRP header with trp_ecn_echo. */
+	trp_ack_now = 8,
+		/**< The pending acknowledgement may not be delayed. */
+	trp_ack_delayed = 16,
+		/**< The pending acknowledgement is being delayed, until
+		 * ack_deadline at the latest. */
 };
 
 struct ee_state {
@@ -228,19 +356,69 @@ struct ee_state {
 	uint32_t recv_ack_psn;
 
 	uint32_t trp_flags;
-	struct psn_range recv_sack_psn;
+	uint32_t recv_sack_max_psn;
+		/**< One past the highest PSN received out of order; only
+		 * valid if trp_recv_missing is set. */
+	uint64_t *recv_bitmap;
+		/**< One bit per PSN in the receive window, indexed by
+		 * psn & (recv_window_size - 1), which is set if the PSN has
+		 * been received beyond recv_ack_psn. */
+	uint32_t recv_window_size;
+		/**< Number of PSNs starting at recv_ack_psn that we accept
+		 * from the peer.  MUST be a power of 2. */
 
 	struct rte_mbuf **tx_pending;
 	struct rte_mbuf **tx_head;
 	int tx_pending_size;
+	struct timer_wheel retransmit_timers;
+		/**< Retransmission timers for the segments in tx_pending,
+		 * keyed by rte_get_timer_cycles(). */
+	uint64_t srtt;
+		/**< Smoothed round-trip time in timer cycles, or 0 if no RTT
+		 * sample has been taken yet. */
+	uint64_t rttvar;
+		/**< Round-trip time variation in timer cycles. */
+	uint64_t rto;
+		/**< Retransmission timeout in timer cycles for a segment's
+		 * first transmission; doubled for each retransmission. */
+	uint64_t rto_min;
+	uint64_t rto_max;
+	struct rte_mbuf *coalesce_msg;
+		/**< trp_coalesced datagram that has been assigned a PSN but to
+		 * which more segments may still be added before it is sent,
+		 * or NULL. */
+	uint16_t coalesce_max;
+		/**< Largest SEND or RDMA WRITE payload that may be added to
+		 * coalesce_msg, or 0 if the peer did not agree to
+		 * trp_rr_coalesce. */
+	bool ecn;
+		/**< Set if both ends agreed to trp_rr_ecn: our DDP segments are
+		 * sent ECT(0), we echo CE marks with trp_ecn_echo, and the
+		 * peer's echoes drive our congestion control. */
+	uint16_t ack_pending_count;
+		/**< Number of datagrams accepted in order since we last sent
+		 * our acknowledgement. */
+	uint16_t ack_segments;
+		/**< Value of ack_pending_count at which an acknowledgement is
+		 * sent without waiting for ack_delay. */
+	uint64_t ack_delay;
+		/**< Longest time in timer cycles that an acknowledgement waits
+		 * for a data packet to carry it. */
+	uint64_t ack_deadline;
 
-	/* This fields are only used if the NIC does not support
-	 * filtering. */
 	struct rte_ring *rx_queue;
+		/**< Datagrams demultiplexed from a shared hardware queue for
+		 * this queue pair, or NULL if the queue pair has its own
+		 * hardware receive queue. */
+	struct usiw_shared_queue *shared_queue;
+		/**< The shared hardware queue that rx_queue is filled from, whose
+		 * receive descriptors are divided among the queue pairs bound to
+		 * it, or NULL. */
 };
 
 struct read_response_state {
 	char *vaddr;
+	struct usiw_phys_range phys; /**< Physical location of vaddr */
 	uint32_t msg_size;
 	uint32_t sink_stag; /* network byte order */
 	uint64_t sink_offset; /* host byte order */
@@ -254,6 +432,49 @@ enum {
 
 DECLARE_TAILQ_HEAD(read_response_state);
 
+/** Ethernet, IPv4 and UDP headers of every datagram sent on a queue pair. */
+struct usiw_tx_hdr {
+	struct ether_hdr eth;
+	struct ipv4_hdr ip;
+	struct udp_hdr udp;
+} __attribute__((__packed__));
+
+/** The headers of a datagram received on a queue pair, padded to a whole
+ * number of 16-byte vectors so that they can be compared against the
+ * expected values in a few vector operations. */
+union usiw_rx_hdr_match {
+	struct usiw_tx_hdr hdr;
+	uint8_t bytes[48];
+	uint64_t words[6];
+};
+
+/** Token bucket that limits the rate at which a queue pair, or all queue pairs
+ * of a port, start sending new DDP segments.  Tokens are counted in timer
+ * cycles, so that refilling the bucket needs only the time elapsed since the
+ * last refill: sending n bytes costs n * cycles_per_byte tokens, and the bucket
+ * holds at most burst tokens.  A datagram may be sent whenever the bucket is
+ * not in debt, even if that puts it in debt, so that datagrams larger than the
+ * burst are not held back forever. */
+struct usiw_tx_pacer {
+	uint64_t cycles_per_byte;
+		/**< Cost of one byte in timer cycles, as a fixed-point number
+		 * with TX_PACER_FRAC_BITS fractional bits; 0 if the rate is
+		 * unlimited. */
+	int64_t burst;
+		/**< Maximum number of tokens. */
+	int64_t tokens;
+	uint64_t last_refill;
+		/**< Timer cycles at which tokens was last brought up to
+		 * date. */
+};
+
+/** Links a queue pair into the list of queue pairs that use a CQ, which are
+ * progressed by polling it in application progress mode. */
+struct usiw_cq_qp_link {
+	LIST_ENTRY(usiw_cq_qp_link) entry;
+	struct usiw_qp *qp;
+};
+
 /** This structure contains fields used by my initial reliable datagram-style
  * verbs interface.  This will be used for transition to the reliable connected
  * queue pairs and the libibverbs interface. */
@@ -262,18 +483,34 @@ struct usiw_qp {
 	struct urdmad_qp *shm_qp;
 	uint16_t qp_flags;
 
-	LIST_ENTRY(usiw_qp) ctx_entry;
+	LIST_ENTRY(usiw_qp) progress_entry;
 	UT_hash_handle hh;
 	struct usiw_context *ctx;
 	struct usiw_device *dev;
 	struct usiw_cq *send_cq;
 
-	/* txq_end points one entry beyond the last entry in the table
-	 * the table is full when txq_end == txq + TX_BURST_SIZE
-	 * the burst should be flushed at that point
-	 */
-	struct rte_mbuf **txq_end;
-	struct rte_mbuf *txq[TX_BURST_SIZE];
+	struct rte_mbuf *txq[TX_BACKLOG_SIZE];
+		/**< Frames waiting to be accepted by the NIC, from txq_head up
+		 * to txq_tail.  The indices are free-running and are taken
+		 * modulo TX_BACKLOG_SIZE. */
+	uint16_t txq_head;
+	uint16_t txq_tail;
+	uint16_t tx_burst_size;
+		/**< Number of frames that enqueue_tx_frame() collects before
+		 * offering them to the NIC, between TX_BURST_SIZE and
+		 * TX_BURST_SIZE_MAX.  Adjusted by flush_tx_queue(). */
+	struct usiw_tx_hdr tx_hdr;
+		/**< Header template built by build_tx_hdr_template(). */
+	uint16_t tx_hdr_ip_cksum;
+		/**< Raw checksum of tx_hdr.ip with total_length 0. */
+	uint16_t tx_hdr_udp_cksum;
+		/**< Raw checksum of the UDP pseudo-header with length 0, plus
+		 * the UDP ports if the checksum is computed in software. */
+	union usiw_rx_hdr_match rx_hdr_value;
+	union usiw_rx_hdr_match rx_hdr_mask;
+		/**< Every received datagram must have the headers in
+		 * rx_hdr_value for each bit set in rx_hdr_mask.  Built by
+		 * build_rx_hdr_match(). */
 
 	struct usiw_send_wqe_queue sq;
 
@@ -289,8 +526,52 @@ struct usiw_qp {
 	uint8_t ird_active;
 
 	struct usiw_cq *recv_cq;
+	struct usiw_srq *srq;
+		/**< Shared receive queue from which receive WQEs are taken, or
+		 * NULL to use the WQEs posted to rq0. */
 	struct usiw_mr_table *pd;
 
+	struct usiw_cq_qp_link send_cq_link;
+	struct usiw_cq_qp_link recv_cq_link;
+		/**< Entries in the qp_links lists of send_cq and recv_cq;
+		 * recv_cq_link is unused if both are the same CQ. */
+	rte_spinlock_t progress_lock;
+		/**< In application progress mode, held by whichever thread is
+		 * currently making progress on this queue pair. */
+	atomic_uintptr_t progress_lcore;
+		/**< The usiw_progress_lcore that currently owns this queue pair,
+		 * which post functions wake up if it is sleeping; 0 in
+		 * application progress mode. */
+	bool rx_intr;
+		/**< True if the receive queue interrupt of this queue pair is
+		 * registered with the epoll instance of its progress lcore. */
+	struct usiw_cqe_batch *cqe_batch;
+		/**< Batch in which the CQEs of this queue pair are staged while
+		 * it is being progressed, or NULL to publish each CQE
+		 * immediately. */
+	struct usiw_shared_queue *shared_queue;
+		/**< The hardware queue pair that this queue pair shares with
+		 * other queue pairs, or NULL if it has its own. */
+	uint16_t shared_queue_port;
+		/**< Local UDP port (network byte order) under which this queue
+		 * pair is in shared_queue->qp_by_port, or 0 if it is not. */
+	UT_hash_handle hh_port;
+	struct usiw_tx_pacer pacer;
+		/**< Limits the rate of new DDP segments on this queue pair.
+		 * Only touched by the thread progressing the queue pair. */
+	atomic_uint_fast64_t pacer_request;
+		/**< Rate limit in Mbit/s in the upper 32 bits and burst size in
+		 * bytes in the lower 32 bits, as last set by
+		 * urdma_set_qp_rate_limit(). */
+	uint64_t pacer_config;
+		/**< The value of pacer_request that pacer was set up with. */
+	struct dcqcn cc;
+		/**< Congestion control state; only used if remote_ep.ecn is
+		 * set. */
+	struct usiw_tx_pacer cc_pacer;
+		/**< Limits the rate of new DDP segments to the rate allowed by
+		 * cc; unlimited while cc is at the line rate. */
+
 	struct ee_state remote_ep;
 
 	struct ibv_qp ib_qp;
@@ -306,11 +587,65 @@ struct usiw_cq {
 	size_t qp_count;
 	uint32_t cq_id;
 	atomic_bool notify_flag;
+	LIST_HEAD(usiw_cq_qp_head, usiw_cq_qp_link) qp_links;
+		/**< In application progress mode, the queue pairs that use
+		 * this CQ, which are progressed by each call to poll it.
+		 * Guarded by qp_links_lock. */
+	rte_spinlock_t qp_links_lock;
+};
+
+/** CQEs that have been filled in during a progress pass but not yet placed on
+ * the cqe_ring of their CQ, and SRQ limit events raised during the pass.
+ * Publishing them together takes one ring operation per CQ, and one write to
+ * the event file per context for the SRQ limit events and the CQs that have
+ * completion notification armed. */
+struct usiw_cqe_batch {
+	struct {
+		struct usiw_cq *cq;
+		unsigned int count;
+		struct usiw_wc *cqe[CQE_BATCH_SIZE];
+	} entry[CQE_BATCH_CQ_MAX];
+	unsigned int cq_count;
+		/**< Number of valid elements of entry. */
+	struct {
+		struct usiw_context *ctx;
+		struct urdma_srq_event event;
+	} srq_event[CQE_BATCH_SRQ_EVENT_MAX];
+	unsigned int srq_event_count;
+		/**< Number of valid elements of srq_event. */
+};
+
+/** A hardware queue pair that urdmad assigned to several queue pairs of this
+ * process.  Whichever thread holds rx_lock receives a burst from the hardware
+ * queue and moves each datagram to the rx_queue ring of the queue pair bound
+ * to its destination UDP port, so no thread ever waits for another to finish
+ * polling. */
+struct usiw_shared_queue {
+	rte_spinlock_t rx_lock;
+		/**< Guards the hardware receive queue and qp_by_port. */
+	rte_spinlock_t tx_lock;
+		/**< Guards the hardware transmit queue. */
+	struct usiw_qp *qp_by_port;
+		/**< Hash table of queue pairs, keyed by shared_queue_port. */
+	atomic_uint qp_count;
+		/**< Number of queue pairs in qp_by_port, among which the
+		 * receive credits are divided. */
+	struct usiw_progress_lcore *intr_lcore;
+		/**< The progress lcore whose epoll instance the receive queue
+		 * interrupt is registered with, or NULL.  Guarded by
+		 * rx_lock. */
+	unsigned int intr_qp_count;
+		/**< Number of queue pairs of intr_lcore on this queue, whose
+		 * rx_intr is set.  Guarded by rx_lock. */
+	bool intr_unavailable;
+		/**< Set once registering the receive queue interrupt has failed,
+		 * so that it is not retried.  Guarded by rx_lock. */
 };
 
 enum usiw_device_flags {
 	port_checksum_offload = 1,
 	port_fdir = 2,
+	port_rx_checksum_offload = 4,
 };
 
 /* A context handle which provides an indirection for accessing the actual
@@ -329,7 +664,6 @@ struct usiw_context {
 	struct usiw_device *dev;
 	int event_fd;
 	struct usiw_context_handle *h;
-	LIST_HEAD(usiw_qp_head, usiw_qp) qp_active;
 	atomic_uint qp_init_count;
 		/**< The number of queue pairs in the INIT state. */
 	struct usiw_qp *qp;
@@ -346,12 +680,71 @@ usiw_get_context(struct ibv_context *ctx)
 	return container_of(vctx, struct usiw_context, vcontext);
 } /* usiw_get_context */
 
+/** Tunables read from the root object of the configuration file. */
+struct usiw_tunables {
+	unsigned int progress_lcores;
+		/**< Number of lcores to request from urdmad for progress.  If
+		 * 0, no lcores are requested and queue pairs are progressed
+		 * by the application threads that poll their CQs or post
+		 * send work requests (application progress mode). */
+	unsigned int zero_copy_threshold;
+		/**< Minimum payload length, in bytes, for which we attempt to
+		 * transmit directly from user memory instead of copying. */
+	unsigned int fast_retransmit_limit;
+		/**< Maximum number of segments resent immediately in response
+		 * to a single SACK; 0 disables fast retransmit. */
+	unsigned int retransmit_timeout_min_us;
+	unsigned int retransmit_timeout_max_us;
+		/**< Bounds on the retransmission timeout computed from the
+		 * measured round-trip time, in microseconds. */
+	unsigned int coalesce_threshold;
+		/**< Largest SEND or RDMA WRITE payload, in bytes, that may be
+		 * packed into one datagram with other messages if the peer
+		 * agrees; 0 disables coalescing. */
+	unsigned int progress_idle_us;
+		/**< Time, in microseconds, that a progress lcore must find all
+		 * of its queue pairs idle before it sleeps until a packet or
+		 * a new work request arrives; 0 disables sleeping. */
+	unsigned int qp_rate_limit_mbps;
+	unsigned int qp_rate_burst;
+		/**< Initial rate limit of each queue pair in Mbit/s (0 for no
+		 * limit), and the number of bytes it may send at once after
+		 * being idle. */
+	unsigned int port_rate_limit_mbps;
+	unsigned int port_rate_burst;
+		/**< The same for all queue pairs of this process on a port
+		 * together. */
+	unsigned int ecn;
+		/**< Set to offer ECN-based congestion control to the peer of
+		 * each connection. */
+	unsigned int ack_segments;
+	unsigned int ack_delay_us;
+		/**< An acknowledgement that no data packet has carried is sent
+		 * once this many datagrams are unacknowledged, or this many
+		 * microseconds after the first of them arrived. */
+};
+
 struct usiw_device {
 	struct verbs_device vdev;
 	struct rte_mempool *rx_mempool;
 	struct rte_mempool *tx_ddp_mempool;
 	struct rte_mempool *tx_hdr_mempool;
+	struct rte_mempool *tx_ext_mempool;
+		/**< Data-less mbufs used to attach user payloads to outgoing
+		 * DDP segments without copying them. */
+	struct usiw_tunables tunables;
 	struct urdmad_queue_range *queue_ranges;
+	struct usiw_shared_queue shared_queues[URDMAD_MAX_QUEUES];
+		/**< State of each hardware queue pair that is shared between
+		 * queue pairs, indexed by queue id. */
+	struct usiw_tx_pacer pacer;
+		/**< Limits the combined rate of new DDP segments on all queue
+		 * pairs of this process on the port. */
+	rte_spinlock_t pacer_lock;
+		/**< Guards pacer, which all progress threads share. */
+	struct dcqcn_params cc_params;
+		/**< Congestion control parameters, with times in timer cycles
+		 * and the link speed of the port as the line rate. */
 	uint16_t portid;
 	uint16_t max_qp;
 	uint64_t flags;
@@ -360,6 +753,45 @@ struct usiw_device {
 	int urdmad_fd;
 };
 
+/** State belonging to a single progress lcore.  Queue pairs are handed to a
+ * progress lcore through its new_qps ring; from then on only that lcore walks
+ * or modifies its qp_active list, until it hands the queue pair to another
+ * lcore while rebalancing. */
+struct usiw_progress_lcore {
+	LIST_HEAD(usiw_qp_head, usiw_qp) qp_active;
+		/**< Queue pairs owned by this lcore. */
+	struct rte_ring *new_qps;
+		/**< Queue pairs handed to this lcore but not yet on
+		 * qp_active. */
+	atomic_uint qp_count;
+		/**< Number of queue pairs owned by or in flight to this lcore;
+		 * used to pick the least loaded lcore. */
+	unsigned int rebalance_gen;
+		/**< Last value of driver->rebalance_gen seen by this lcore. */
+	unsigned int lcore_id;
+	unsigned int index;
+	struct usiw_driver *driver;
+
+	int epfd;
+		/**< epoll instance used to sleep, or -1 if this lcore never
+		 * sleeps. */
+	int wake_fd;
+		/**< eventfd written by progress_lcore_wake(). */
+	struct rte_epoll_event wake_event;
+	atomic_bool sleeping;
+		/**< True while this lcore is (about to be) blocked on epfd. */
+	atomic_uint_fast64_t wake_request_time;
+		/**< Timer cycles at which wake_fd was first written since the
+		 * lcore last woke up, or 0. */
+	uint64_t idle_since;
+		/**< Timer cycles at which this lcore last did useful work. */
+	uint64_t start_time;
+	struct urdma_progress_stats stats;
+	struct usiw_cqe_batch cqe_batch;
+		/**< CQEs of the queue pairs on qp_active, published at the end
+		 * of each pass over the list. */
+};
+
 struct usiw_driver {
 	sem_t go;
 	struct nl_sock *sock;
@@ -369,8 +801,45 @@ struct usiw_driver {
 	struct rte_ring *new_ctxs;
 	int urdmad_fd;
 	uint32_t lcore_mask[RTE_MAX_LCORE / 32];
+	struct usiw_tunables tunables;
+	unsigned int progress_lcore_count;
+		/**< Number of lcores actually running the progress engine. */
+	atomic_uint rebalance_gen;
+		/**< Incremented whenever the QP distribution across progress
+		 * lcores changes such that it may need to be rebalanced. */
+	struct usiw_progress_lcore *progress;
+		/**< Array of progress_lcore_count progress lcores. */
 };
 
+/** Wakes the progress lcore if it is sleeping.  Called after work has been
+ * handed to it. */
+void
+progress_lcore_wake(struct usiw_progress_lcore *lc);
+
+/** Wakes the progress lcore owning the queue pair, if any, after a send work
+ * request has been posted to it. */
+static inline void
+progress_wake_qp(struct usiw_qp *qp)
+{
+	struct usiw_progress_lcore *lc;
+
+	lc = (struct usiw_progress_lcore *)atomic_load(&qp->progress_lcore);
+	if (lc && atomic_load(&lc->sleeping)) {
+		progress_lcore_wake(lc);
+	}
+} /* progress_wake_qp */
+
+/** Sets up pacer to allow rate_mbps Mbit/s, with bursts of up to burst_bytes
+ * bytes, starting with a full bucket.  A rate_mbps of 0 removes the limit. */
+void
+tx_pacer_init(struct usiw_tx_pacer *pacer, unsigned int rate_mbps,
+		unsigned int burst_bytes);
+
+/** Sets up the epoll instance and eventfd that let an idle progress lcore
+ * sleep.  Returns 0 or a negative errno value. */
+int
+progress_lcore_init_sleep(struct usiw_progress_lcore *lc);
+
 /** Starts the progress thread. */
 void
 start_progress_thread(void);
@@ -380,12 +849,44 @@ start_progress_thread(void);
 int
 driver_add_context(struct usiw_context *ctx);
 
-struct usiw_mr **
+/** Hands a newly created queue pair to the least loaded progress lcore, or
+ * in application progress mode to its CQs. */
+int
+driver_add_qp(struct usiw_qp *qp);
+
+/** In application progress mode, stops progressing the queue pair from its
+ * CQs and drops the reference held for progress.  Does nothing if there are
+ * progress lcores, which drop that reference themselves. */
+void
+driver_remove_qp(struct usiw_qp *qp);
+
+/** Returns the progress lcore which currently owns the fewest queue pairs. */
+struct usiw_progress_lcore *
+progress_lcore_least_loaded(struct usiw_driver *driver);
+
+/** Returns the registered memory region whose STag is rkey, or NULL if no
+ * such region exists. */
+struct usiw_mr *
 usiw_mr_lookup(struct usiw_mr_table *tbl, uint32_t rkey);
 
+/** Returns the physical address of vaddr if it lies within DPDK hugepage
+ * memory, and sets *contig_len to the number of bytes starting at vaddr which
+ * are physically contiguous.  Returns RTE_BAD_PHYS_ADDR for any other memory,
+ * which is not pinned and thus cannot be handed to the NIC.  This scans every
+ * memory segment, so the fast path uses the range cached in the memory region
+ * instead. */
+phys_addr_t
+hugepage_virt2phy(const char *vaddr, size_t *contig_len);
+
+/** Fills in *phys with the physical location of vaddr, which must lie within
+ * the memory region mr, or marks it as not in hugepage memory if mr is NULL. */
+void
+usiw_mr_phys_range(const struct usiw_mr *mr, const char *vaddr,
+		struct usiw_phys_range *phys);
+
 /* Internal-only helper used by usiw_dereg_mr */
 void
-usiw_dereg_mr_real(struct usiw_mr_table *tbl, struct usiw_mr **mr);
+usiw_dereg_mr_real(struct usiw_mr_table *tbl, struct usiw_mr *mr);
 
 /* Places a pointer to the next send WQE in *wqe and returns 0 if one is
  * available.  If one is not available, returns -ENOSPC.
@@ -419,7 +920,7 @@ usiw_send_wqe_queue_destroy(struct usiw_send_wqe_queue *q);
 
 int
 usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
-		uint32_t max_recv_wr, uint32_t max_sge);
+		uint32_t max_recv_wr, uint32_t max_sge, unsigned int flags);
 
 void
 usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q);
@@ -427,12 +928,39 @@ usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q);
 void
 urdma_do_destroy_cq(struct usiw_cq *cq);
 
+void
+urdma_do_destroy_srq(struct usiw_srq *srq);
+
 void
 usiw_do_destroy_qp(struct usiw_qp *qp);
 
 int
 kni_loop(void *arg);
 
+/** Runs the housekeeping that the first progress lcore would otherwise do,
+ * for processes in application progress mode.  Never returns. */
+void
+app_progress_housekeeping_loop(struct usiw_driver *driver);
+
+/** Adds the queue pair to the qp_links lists of its CQs. */
+void
+progress_cq_add_qp(struct usiw_qp *qp);
+
+/** Removes the queue pair from the qp_links lists of its CQs, and waits for
+ * any thread still making progress on it to finish. */
+void
+progress_cq_remove_qp(struct usiw_qp *qp);
+
+/** Makes progress on every queue pair that uses the CQ from the calling
+ * thread, skipping any that another thread is already progressing. */
+void
+progress_cq(struct usiw_cq *cq);
+
+/** Makes progress on the queue pair from the calling thread, unless another
+ * thread is already doing so. */
+void
+progress_qp_inline(struct usiw_qp *qp);
+
 #ifdef NDEBUG
 #define cq_check_sanity(x) do { } while (0)
 #else
@@ -52,11 +52,11 @@
 #include <rte_ethdev.h>
 #include <rte_errno.h>
 #include <rte_ip.h>
-#include <rte_jhash.h>
 #include <rte_malloc.h>
 #include <rte_ring.h>
 
 #include "interface.h"
+#include "proto_trp.h"
 #include "urdma_kabi.h"
 #include "util.h"
 #include "verbs.h"
@@ -82,37 +82,68 @@ next_pow2(int in)
 } /* next_pow2 */
 
 
-static int
-usiw_hash_mr(uintptr_t addr, size_t len)
+/* Removes the free entry at index from the free list of tbl and fills it in.
+ * Must be called with tbl->lock held. */
+static struct ibv_mr *
+usiw_mr_table_claim(struct usiw_mr_table *tbl, uint32_t index, void *addr,
+		size_t len, int access)
 {
-	return rte_jhash_3words(addr >> 32, addr & UINT32_MAX,
-			len & UINT32_MAX, 0) & 0xffffff;
-} /* usiw_hash_mr */
+	struct usiw_mr *mr = &tbl->entries[index];
 
+	if (mr->prev_free != USIW_MR_FREE_END) {
+		tbl->entries[mr->prev_free].next_free = mr->next_free;
+	} else {
+		tbl->free_head = mr->next_free;
+	}
+	if (mr->next_free != USIW_MR_FREE_END) {
+		tbl->entries[mr->next_free].prev_free = mr->prev_free;
+	}
+	tbl->mr_count++;
 
+	mr->mr.addr = addr;
+	mr->mr.length = len;
+	mr->mr.handle = 0;
+	mr->access = access;
+	mr->in_use = true;
+	mr->phys.addr = hugepage_virt2phy(addr, &mr->phys.len);
+	/* Publish the STag last; the progress thread may look it up as soon
+	 * as it matches. */
+	mr->mr.lkey = STAG_MR(index, mr->key);
+	rte_wmb();
+	mr->mr.rkey = mr->mr.lkey;
+	return &mr->mr;
+} /* usiw_mr_table_claim */
+
+
+/** Registers a memory region with a caller-chosen STag.  The rkey must be
+ * a valid memory region STag (see STAG_MR) whose table entry is currently
+ * unused; otherwise this fails with errno set to EINVAL or EBUSY. */
 __attribute__((__visibility__("default")))
 struct ibv_mr *
 urdma_reg_mr_with_rkey(struct ibv_pd *pd, void *addr, size_t len, int access,
 		uint32_t rkey)
 {
 	struct usiw_mr_table *tbl = container_of(pd, struct usiw_mr_table, pd);
-	uint32_t hash = rkey % tbl->capacity;
-	struct usiw_mr *mr;
+	struct ibv_mr *mr;
+	uint32_t index;
 
-	mr = malloc(sizeof(*mr));
-	if (!mr) {
+	index = STAG_MR_INDEX(rkey);
+	if ((rkey & STAG_TYPE_MASK) != STAG_TYPE_MR || index >= tbl->capacity
+			|| len > MAX_MR_SIZE) {
+		errno = EINVAL;
 		return NULL;
 	}
 
-	mr->mr.addr = addr;
-	mr->mr.length = len;
-	mr->mr.handle = 0;
-	mr->mr.lkey = rkey;
-	mr->mr.rkey = rkey;
-	mr->next = tbl->entries[hash];
-	mr->access = access;
-	tbl->entries[hash] = mr;
-	return &mr->mr;
+	rte_spinlock_lock(&tbl->lock);
+	if (tbl->entries[index].in_use) {
+		rte_spinlock_unlock(&tbl->lock);
+		errno = EBUSY;
+		return NULL;
+	}
+	tbl->entries[index].key = rkey & STAG_MR_KEY_MASK;
+	mr = usiw_mr_table_claim(tbl, index, addr, len, access);
+	rte_spinlock_unlock(&tbl->lock);
+	return mr;
 } /* urdma_reg_mr_with_rkey */
 
 
@@ -131,6 +162,9 @@ urdma_accl_post_recvv(struct ibv_qp *ib_qp, const struct iovec *iov, size_t iov_
 	}
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	if (qp->srq) {
+		return -EINVAL;
+	}
 	x = qp_get_next_recv_wqe(qp, &wqe);
 	if (x < 0)
 		return x;
@@ -227,6 +261,11 @@ urdma_accl_post_sendv(struct ibv_qp *ib_qp, struct iovec *iov, size_t iov_size,
 	wqe->bytes_acked = 0;
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
+	if (qp->dev->tunables.progress_lcores == 0) {
+		progress_qp_inline(qp);
+	} else {
+		progress_wake_qp(qp);
+	}
 
 	return 0;
 } /* urdma_accl_post_sendv */
@@ -272,6 +311,11 @@ urdma_accl_post_write(struct ibv_qp *ib_qp, void *addr, size_t length,
 	wqe->total_length = length;
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
+	if (qp->dev->tunables.progress_lcores == 0) {
+		progress_qp_inline(qp);
+	} else {
+		progress_wake_qp(qp);
+	}
 
 	return 0;
 } /* urdma_accl_post_write */
@@ -317,6 +361,11 @@ urdma_accl_post_read(struct ibv_qp *ib_qp, void *addr, size_t length,
 	wqe->bytes_sent = 0;
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
+	if (qp->dev->tunables.progress_lcores == 0) {
+		progress_qp_inline(qp);
+	} else {
+		progress_wake_qp(qp);
+	}
 
 	return 0;
 } /* urdma_accl_post_read */
@@ -369,7 +418,9 @@ usiw_query_device(struct ibv_context *context,
 	device_attr->max_total_mcast_qp_attach = 0;
 	device_attr->max_ah = MAX_ARP_ENTRIES;
 	device_attr->max_fmr = 0;
-	device_attr->max_srq = 0;
+	device_attr->max_srq = INT_MAX;
+	device_attr->max_srq_wr = MAX_RECV_WR;
+	device_attr->max_srq_sge = DPDK_VERBS_IOV_LEN_MAX;
 	device_attr->max_pkeys = 0;
 	device_attr->local_ca_ack_delay = 0;
 	device_attr->phys_port_cnt = 1;
@@ -404,8 +455,10 @@ usiw_alloc_pd(struct ibv_context *context)
 	struct ibv_alloc_pd cmd;
 	struct ibv_alloc_pd_resp resp;
 	struct usiw_mr_table *tbl;
-	int ret;
+	struct usiw_mr *mr;
+	int ret, i;
 
+	assert(default_capacity <= STAG_MR_INDEX_MAX + 1);
 	tbl = calloc(1, sizeof(*tbl)
 			+ default_capacity * sizeof(struct usiw_mr));
 	if (!tbl) {
@@ -420,6 +473,15 @@ usiw_alloc_pd(struct ibv_context *context)
 		return NULL;
 	}
 
+	rte_spinlock_init(&tbl->lock);
+	for (i = 0; i < default_capacity; i++) {
+		mr = &tbl->entries[i];
+		mr->mr.lkey = mr->mr.rkey = STAG_TYPE_MASK;
+		mr->prev_free = (i > 0) ? i - 1 : USIW_MR_FREE_END;
+		mr->next_free = (i < default_capacity - 1)
+					? i + 1 : USIW_MR_FREE_END;
+	}
+	tbl->free_head = 0;
 	tbl->capacity = default_capacity;
 	return &tbl->pd;
 } /* usiw_alloc_pd */
@@ -443,13 +505,23 @@ usiw_dealloc_pd(struct ibv_pd *pd)
 static struct ibv_mr *
 usiw_reg_mr(struct ibv_pd *pd, void *addr, size_t len, int access)
 {
-	uint32_t rkey;
+	struct usiw_mr_table *tbl = container_of(pd, struct usiw_mr_table, pd);
+	struct ibv_mr *mr;
+
 	if (len > MAX_MR_SIZE) {
 		errno = EINVAL;
 		return NULL;
 	}
-	rkey = usiw_hash_mr((uintptr_t)addr, len);
-	return urdma_reg_mr_with_rkey(pd, addr, len, access, rkey);
+
+	rte_spinlock_lock(&tbl->lock);
+	if (tbl->free_head == USIW_MR_FREE_END) {
+		rte_spinlock_unlock(&tbl->lock);
+		errno = ENOMEM;
+		return NULL;
+	}
+	mr = usiw_mr_table_claim(tbl, tbl->free_head, addr, len, access);
+	rte_spinlock_unlock(&tbl->lock);
+	return mr;
 } /* usiw_reg_mr */
 
 static int
@@ -457,14 +529,13 @@ usiw_dereg_mr(struct ibv_mr *mr)
 {
 	struct usiw_mr_table *tbl = container_of(mr->pd,
 			struct usiw_mr_table, pd);
-	struct usiw_mr **candidate = usiw_mr_lookup(tbl, mr->rkey);
 	struct usiw_mr *ourmr = container_of(mr, struct usiw_mr, mr);
-	/* TODO: deal with hash collisions and lookup failure */
-	if (ourmr != *candidate) {
+
+	if (ourmr != usiw_mr_lookup(tbl, mr->rkey)) {
 		return -EINVAL;
 	}
 
-	usiw_dereg_mr_real(tbl, candidate);
+	usiw_dereg_mr_real(tbl, ourmr);
 	return 0;
 } /* usiw_dereg_mr */
 
@@ -540,7 +611,9 @@ usiw_create_cq(struct ibv_context *context, int size,
 		free(cq);
 		return NULL;
 	}
-	ret = rte_ring_init(cq->cqe_ring, name, size + 1, RING_F_SP_ENQ);
+	/* Queue pairs sharing this CQ may be progressed by different lcores,
+	 * so CQEs can be posted by multiple producers. */
+	ret = rte_ring_init(cq->cqe_ring, name, size + 1, 0);
 	if (ret) {
 		errno = -ret;
 		rte_free(cq->cqe_ring);
@@ -558,7 +631,7 @@ usiw_create_cq(struct ibv_context *context, int size,
 		free(cq);
 		return NULL;
 	}
-	ret = rte_ring_init(cq->free_ring, name, size + 1, RING_F_SC_DEQ);
+	ret = rte_ring_init(cq->free_ring, name, size + 1, 0);
 	if (!cq->free_ring) {
 		errno = ret;
 		rte_free(cq->free_ring);
@@ -574,6 +647,8 @@ usiw_create_cq(struct ibv_context *context, int size,
 		rte_ring_enqueue(cq->free_ring, &cq->storage[x]);
 	}
 	cq->qp_count = 0;
+	LIST_INIT(&cq->qp_links);
+	rte_spinlock_init(&cq->qp_links_lock);
 	atomic_init(&cq->notify_flag, false);
 	return &cq->ib_cq;
 } /* usiw_create_cq */
@@ -625,6 +700,9 @@ usiw_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
 	int count;
 
 	ourcq = container_of(cq, struct usiw_cq, ib_cq);
+	if (usiw_get_context(cq->context)->dev->tunables.progress_lcores == 0) {
+		progress_cq(ourcq);
+	}
 	count = do_poll_cq(ourcq, num_entries, cqe);
 	convert_cqes(cqe, count, wc);
 	return count;
@@ -684,22 +762,77 @@ usiw_create_srq_ex(__attribute__((unused)) struct ibv_context *context,
 static struct ibv_srq *
 usiw_create_srq(struct ibv_pd *pd, struct ibv_srq_init_attr *init_attr)
 {
-	struct ibv_srq_init_attr_ex init_attr_ex;
-	init_attr_ex.srq_context = init_attr->srq_context;
-	memcpy(&init_attr_ex.attr, &init_attr->attr, sizeof(init_attr_ex.attr));
-	init_attr_ex.comp_mask = IBV_SRQ_INIT_ATTR_TYPE|IBV_SRQ_INIT_ATTR_PD;
-	init_attr_ex.srq_type = IBV_SRQT_BASIC;
-	init_attr_ex.pd = pd;
-	return usiw_create_srq_ex(pd->context, &init_attr_ex);
+	struct ibv_create_srq cmd;
+	struct {
+		struct ibv_create_srq_resp ibv;
+		struct urdma_uresp_create_srq priv;
+	} resp;
+	struct usiw_srq *srq;
+	int ret;
+
+	if (init_attr->attr.max_wr > MAX_RECV_WR
+			|| init_attr->attr.max_sge > DPDK_VERBS_IOV_LEN_MAX
+			|| init_attr->attr.srq_limit > init_attr->attr.max_wr) {
+		errno = EINVAL;
+		return NULL;
+	}
+	init_attr->attr.max_wr
+		= RTE_MAX(next_pow2(init_attr->attr.max_wr + 1) - 1, 63);
+	if (!init_attr->attr.max_sge) {
+		init_attr->attr.max_sge = 3;
+	}
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq) {
+		return NULL;
+	}
+	atomic_init(&srq->refcnt, 1);
+
+	ret = ibv_cmd_create_srq(pd, &srq->ib_srq, init_attr, &cmd,
+			sizeof(cmd), &resp.ibv, sizeof(resp));
+	if (ret) {
+		errno = ret;
+		goto free_srq;
+	}
+	srq->srq_id = resp.priv.srq_id;
+	atomic_init(&srq->srq_limit, init_attr->attr.srq_limit);
+
+	ret = usiw_recv_wqe_queue_init(srq->srq_id, &srq->rq,
+			init_attr->attr.max_wr, init_attr->attr.max_sge,
+			usiw_rq_shared);
+	if (ret < 0) {
+		errno = -ret;
+		goto destroy_kernel_srq;
+	}
+
+	return &srq->ib_srq;
+
+destroy_kernel_srq:
+	ibv_cmd_destroy_srq(&srq->ib_srq);
+	usiw_recv_wqe_queue_destroy(&srq->rq);
+free_srq:
+	free(srq);
+	return NULL;
 } /* usiw_create_srq */
 
 
 static int
-usiw_modify_srq(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_srq_attr *srq_attr,
-		__attribute__((unused)) int srq_attr_mask)
+usiw_modify_srq(struct ibv_srq *ib_srq, struct ibv_srq_attr *srq_attr,
+		int srq_attr_mask)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+
+	/* Resizing would require reallocating WQEs that may be in use */
+	if (srq_attr_mask & IBV_SRQ_MAX_WR) {
+		return EINVAL;
+	}
+	if (srq_attr_mask & IBV_SRQ_LIMIT) {
+		if (srq_attr->srq_limit > (unsigned int)srq->rq.max_wr) {
+			return EINVAL;
+		}
+		atomic_store(&srq->srq_limit, srq_attr->srq_limit);
+	}
+	return 0;
 } /* usiw_modify_srq */
 
 
@@ -712,26 +845,80 @@ usiw_get_srq_num(__attribute__((unused)) struct ibv_srq *srq,
 
 
 static int
-usiw_query_srq(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_srq_attr *srq_attr)
+usiw_query_srq(struct ibv_srq *ib_srq, struct ibv_srq_attr *srq_attr)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+
+	srq_attr->max_wr = srq->rq.max_wr;
+	srq_attr->max_sge = srq->rq.max_sge;
+	srq_attr->srq_limit = atomic_load(&srq->srq_limit);
+	return 0;
 } /* usiw_query_srq */
 
 
 static int
-usiw_destroy_srq(__attribute__((unused)) struct ibv_srq *srq)
+usiw_destroy_srq(struct ibv_srq *ib_srq)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+	int ret;
+
+	/* The kernel refuses this while any queue pair still uses the SRQ */
+	ret = ibv_cmd_destroy_srq(ib_srq);
+	if (ret) {
+		return ret;
+	}
+
+	if (atomic_fetch_sub(&srq->refcnt, 1) == 1) {
+		urdma_do_destroy_srq(srq);
+	}
+	return 0;
 } /* usiw_destroy_srq */
 
 
 static int
-usiw_post_srq_recv(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_recv_wr *recv_wr,
-		__attribute__((unused)) struct ibv_recv_wr **bad_recv_wr)
+usiw_post_srq_recv(struct ibv_srq *ib_srq, struct ibv_recv_wr *wr,
+		struct ibv_recv_wr **bad_wr)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+	struct usiw_recv_wqe *wqe;
+	int x, ret;
+
+	for (; wr != NULL; wr = wr->next) {
+		if (wr->num_sge > srq->rq.max_sge) {
+			ret = EINVAL;
+			goto errout;
+		}
+
+		x = rte_ring_dequeue(srq->rq.free_ring, (void **)&wqe);
+		if (x < 0) {
+			ret = ENOSPC;
+			goto errout;
+		}
+
+		wqe->wr_context = (void *)(uintptr_t)wr->wr_id;
+		wqe->total_request_size = 0;
+		wqe->iov_count = wr->num_sge;
+		for (x = 0; x < wr->num_sge; ++x) {
+			wqe->iov[x].iov_base
+				= (void *)(uintptr_t)wr->sg_list[x].addr;
+			wqe->iov[x].iov_len = wr->sg_list[x].length;
+			wqe->total_request_size += wqe->iov[x].iov_len;
+		}
+		/* remote_ep and msn are assigned by the queue pair that
+		 * consumes the WQE */
+		wqe->remote_ep = NULL;
+		wqe->msn = 0;
+		wqe->recv_size = 0;
+		wqe->input_size = 0;
+		x = rte_ring_enqueue(srq->rq.ring, wqe);
+		assert(x == 0);
+	}
+
+	return 0;
+
+errout:
+	*bad_wr = wr;
+	return ret;
 } /* usiw_post_srq_recv */
 
 
@@ -753,6 +940,11 @@ port_get_next_qp(struct usiw_device *dev)
 						!= urdma_sock_create_qp_resp) {
 		return NULL;
 	}
+	if (!msg.ptr) {
+		/* urdmad has no queue pair or hardware queue left for us */
+		errno = ENOMEM;
+		return NULL;
+	}
 	return (struct urdmad_qp *)(uintptr_t)rte_be_to_cpu_64(msg.ptr);
 } /* port_get_next_qp */
 
@@ -830,6 +1022,10 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	if (!qp->shm_qp) {
 		goto free_user_qp;
 	}
+	if (qp->shm_qp->flags & urdmad_qp_shared_queue) {
+		qp->shared_queue
+			= &ctx->dev->shared_queues[qp->shm_qp->rx_queue];
+	}
 
 	/* Create kernel QP for connection manager */
 	cmd.priv.urdmad_dev_id = ctx->dev->portid;
@@ -838,6 +1034,9 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	cmd.priv.ord_max = qp->shm_qp->ord_max = USIW_ORD_MAX;
 	cmd.priv.rxq = qp->shm_qp->rx_queue;
 	cmd.priv.txq = qp->shm_qp->tx_queue;
+	cmd.priv.features = qp->shm_qp->features
+		= (ctx->dev->tunables.coalesce_threshold ? trp_rr_coalesce : 0)
+		| (ctx->dev->tunables.ecn ? trp_rr_ecn : 0);
 	retval = ibv_cmd_create_qp(pd, &qp->ib_qp, qp_init_attr,
 			&cmd.ibv, sizeof(cmd), &resp.ibv, sizeof(resp));
 	if (retval != 0) {
@@ -856,6 +1055,12 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	if (!qp->stats.recv_count_histo) {
 		goto free_kernel_qp;
 	}
+	qp->stats.recv_cycles_histo = calloc(qp->stats.recv_max_burst_size + 1,
+			sizeof(*qp->stats.recv_cycles_histo));
+	if (!qp->stats.recv_cycles_histo) {
+		free(qp->stats.recv_count_histo);
+		goto free_kernel_qp;
+	}
 
 	qp->send_cq = container_of(qp_init_attr->send_cq,
 			struct usiw_cq, ib_cq);
@@ -867,8 +1072,20 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 		atomic_fetch_add(&qp->recv_cq->refcnt, 1);
 		qp->recv_cq->qp_count++;
 	}
-	qp->txq_end = qp->txq;
+	if (qp_init_attr->srq) {
+		qp->srq = container_of(qp_init_attr->srq,
+				struct usiw_srq, ib_srq);
+		atomic_fetch_add(&qp->srq->refcnt, 1);
+	}
+	qp->txq_head = qp->txq_tail = 0;
+	qp->tx_burst_size = TX_BURST_SIZE;
+	qp->pacer_config = ((uint64_t)ctx->dev->tunables.qp_rate_limit_mbps
+			<< 32) | ctx->dev->tunables.qp_rate_burst;
+	atomic_init(&qp->pacer_request, qp->pacer_config);
+	tx_pacer_init(&qp->pacer, ctx->dev->tunables.qp_rate_limit_mbps,
+			ctx->dev->tunables.qp_rate_burst);
 	qp->timer_last = 0;
+	rte_spinlock_init(&qp->progress_lock);
 	qp->pd = container_of(pd, struct usiw_mr_table, pd);
 
 	retval = usiw_send_wqe_queue_init(qp->ib_qp.qp_num,
@@ -880,9 +1097,15 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	}
 	qp->sq.max_inline = qp_init_attr->cap.max_inline_data;
 
-	retval = usiw_recv_wqe_queue_init(qp->ib_qp.qp_num,
-			&qp->rq0, qp_init_attr->cap.max_recv_wr,
-			qp_init_attr->cap.max_recv_sge);
+	if (qp->srq) {
+		retval = usiw_recv_wqe_queue_init(qp->ib_qp.qp_num,
+				&qp->rq0, qp->srq->rq.max_wr,
+				qp->srq->rq.max_sge, usiw_rq_srq_user);
+	} else {
+		retval = usiw_recv_wqe_queue_init(qp->ib_qp.qp_num,
+				&qp->rq0, qp_init_attr->cap.max_recv_wr,
+				qp_init_attr->cap.max_recv_sge, 0);
+	}
 	if (retval != 0) {
 		errno = -retval;
 		goto free_kernel_qp;
@@ -901,10 +1124,12 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	ee->next_read_msn = 1;
 	ee->next_ack_msn = 1;
 
-	/* Queue pairs start with two references; one for the internal qp_active
-	 * list that gets decremented when the progress thread notices that the
-	 * QP has reached the error state, and the other for the reference
-	 * returned to the user which will be freed by ibv_destroy_qp().  */
+	/* Queue pairs start with two references; one for the qp_active list of
+	 * the owning progress lcore that gets decremented when the progress
+	 * lcore notices that the QP has reached the error state, and the other
+	 * for the reference returned to the user which will be freed by
+	 * ibv_destroy_qp().  In application progress mode the first reference
+	 * is instead dropped by driver_remove_qp(). */
 	atomic_init(&qp->refcnt, 2);
 
 	rte_spinlock_lock(&ctx->qp_lock);
@@ -913,10 +1138,22 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 			sizeof(qp->ib_qp.qp_num), qp);
 	rte_spinlock_unlock(&ctx->qp_lock);
 
-	LIST_INSERT_HEAD(&qp->ctx->qp_active, qp, ctx_entry);
+	retval = driver_add_qp(qp);
+	if (retval < 0) {
+		errno = -retval;
+		goto unhash_qp;
+	}
 	return &qp->ib_qp;
 
+unhash_qp:
+	rte_spinlock_lock(&ctx->qp_lock);
+	atomic_fetch_sub(&ctx->qp_init_count, 1);
+	HASH_DEL(ctx->qp, qp);
+	rte_spinlock_unlock(&ctx->qp_lock);
 free_kernel_qp:
+	if (qp->srq) {
+		atomic_fetch_sub(&qp->srq->refcnt, 1);
+	}
 	ibv_cmd_destroy_qp(&qp->ib_qp);
 return_user_qp:
 	port_return_qp(qp);
@@ -1046,6 +1283,7 @@ usiw_destroy_qp(struct ibv_qp *ib_qp)
 	HASH_DEL(ctx->qp, qp);
 	rte_spinlock_unlock(&ctx->qp_lock);
 
+	driver_remove_qp(qp);
 	if (atomic_fetch_sub(&qp->refcnt, 1) == 1) {
 		usiw_do_destroy_qp(qp);
 	}
@@ -1083,7 +1321,7 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 {
 	struct usiw_qp *qp;
 	struct usiw_send_wqe *wqe;
-	struct usiw_mr **mr;
+	struct usiw_mr *mr;
 	int sge_limit, x, ret;
 
 	if (!wr) {
@@ -1144,11 +1382,11 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 			wqe->remote_addr = wr->wr.rdma.remote_addr;
 			wqe->rkey = wr->wr.rdma.rkey;
 			mr = usiw_mr_lookup(qp->pd, wr->sg_list[0].lkey);
-			if (!mr || !((*mr)->access & IBV_ACCESS_REMOTE_WRITE)) {
+			if (!mr || !(mr->access & IBV_ACCESS_REMOTE_WRITE)) {
 				ret = EINVAL;
 				goto free_wqe;
 			}
-			wqe->local_stag = (*mr)->mr.rkey;
+			wqe->local_stag = mr->mr.rkey;
 			break;
 		default:
 			ret = EOPNOTSUPP;
@@ -1166,6 +1404,18 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 					=(void *)(uintptr_t)wr->sg_list[x].addr;
 				wqe->iov[x].iov_len = wr->sg_list[x].length;
 				wqe->total_length += wqe->iov[x].iov_len;
+				mr = usiw_mr_lookup(qp->pd,
+						wr->sg_list[x].lkey);
+				if (mr && (wr->sg_list[x].addr
+						< (uintptr_t)mr->mr.addr
+					|| wr->sg_list[x].addr
+						+ wr->sg_list[x].length
+						> (uintptr_t)mr->mr.addr
+						+ mr->mr.length)) {
+					mr = NULL;
+				}
+				usiw_mr_phys_range(mr, wqe->iov[x].iov_base,
+						&wqe->iov_phys[x]);
 			}
 		}
 		wqe->bytes_sent = 0;
@@ -1173,6 +1423,11 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 		x = rte_ring_enqueue(qp->sq.ring, wqe);
 		assert(x == 0);
 	}
+	if (qp->dev->tunables.progress_lcores == 0) {
+		progress_qp_inline(qp);
+	} else {
+		progress_wake_qp(qp);
+	}
 
 	return 0;
 
@@ -1192,7 +1447,7 @@ usiw_post_recv(struct ibv_qp *ib_qp, struct ibv_recv_wr *wr,
 	int x, ret;
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
-	if (atomic_load(&qp->shm_qp->conn_state) == usiw_qp_error) {
+	if (qp->srq || atomic_load(&qp->shm_qp->conn_state) == usiw_qp_error) {
 		*bad_wr = wr;
 		return EINVAL;
 	}
@@ -1378,6 +1633,7 @@ usiw_num_completion_vectors(void)
 	return max_socket_id + 1;
 } /* usiw_num_completion_vectors */
 
+__attribute__((__visibility__("default")))
 void
 urdma_query_qp_stats(const struct ibv_qp *restrict ib_qp,
 		struct urdma_qp_stats *restrict stats)
@@ -1387,6 +1643,24 @@ urdma_query_qp_stats(const struct ibv_qp *restrict ib_qp,
 } /* usiw_port_get_stats */
 
 
+__attribute__((__visibility__("default")))
+int
+urdma_set_qp_rate_limit(struct ibv_qp *ib_qp, unsigned int rate_mbps,
+		unsigned int burst_bytes)
+{
+	struct usiw_qp *qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+
+	if (burst_bytes > TX_PACER_BURST_MAX) {
+		return EINVAL;
+	}
+	/* The progress thread picks this up on its next pass */
+	atomic_store(&qp->pacer_request,
+			((uint64_t)rate_mbps << 32) | burst_bytes);
+	progress_wake_qp(qp);
+	return 0;
+} /* urdma_set_qp_rate_limit */
+
+
 int
 usiw_init_context(struct verbs_device *device, struct ibv_context *context,
 		int cmd_fd)
@@ -1436,7 +1710,6 @@ usiw_init_context(struct verbs_device *device, struct ibv_context *context,
 	ctx->dev = dev;
 
 	atomic_init(&ctx->qp_init_count, 0);
-	LIST_INIT(&ctx->qp_active);
 
 	ctx->qp = NULL;
 	rte_spinlock_init(&ctx->qp_lock);
@@ -1456,7 +1729,7 @@ usiw_init_context(struct verbs_device *device, struct ibv_context *context,
 	ret = driver_add_context(ctx);
 	if (unlikely(ret < 0)) {
 		if (ret != -EDQUOT) {
-			errno = ret;
+			errno = -ret;
 			ret = -1;
 			goto free_ctx;
 		}
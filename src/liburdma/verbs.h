@@ -69,6 +69,76 @@ struct urdma_qp_stats {
 		 * rte_eth_rx_burst(). */
 	size_t recv_max_burst_size;
 		/**< The maximum burst size that usiw requests from DPDK. */
+	uintmax_t retransmit_fast;
+		/**< Number of segments resent because a selective
+		 * acknowledgement showed them missing. */
+	uintmax_t retransmit_timeout;
+		/**< Number of segments resent because their retransmission
+		 * timer expired. */
+	uintmax_t *recv_cycles_histo;
+		/**< An array of recv_max_burst_size + 1 elements.  The
+		 * element at index X is the total number of timer cycles spent
+		 * processing bursts of X received messages, so that the cost
+		 * per message is recv_cycles_histo[X] / (X *
+		 * recv_count_histo[X]). */
+	uintmax_t tx_full;
+		/**< Number of times that the NIC transmit ring could not take
+		 * every frame offered to it. */
+	uintmax_t tx_backlog_depth;
+		/**< Number of frames waiting in the transmit backlog after the
+		 * most recent flush. */
+	uintmax_t tx_backlog_max;
+		/**< Largest number of frames ever waiting in the transmit
+		 * backlog. */
+	uintmax_t tx_backlog_drop;
+		/**< Number of frames discarded because the transmit backlog was
+		 * full.  Any DDP segments among them are retransmitted when
+		 * their retransmission timers expire. */
+	uintmax_t tx_paced;
+		/**< Number of times that the send engine stopped sending new
+		 * data because the rate limit of the queue pair or its port,
+		 * or the rate allowed by congestion control, was reached. */
+	uintmax_t ecn_ce_received;
+		/**< Number of DDP segments received marked Congestion
+		 * Experienced. */
+	uintmax_t ecn_echo_received;
+		/**< Number of congestion notifications received from the
+		 * peer. */
+	uintmax_t cc_rate_mbps;
+		/**< Rate in Mbit/s currently allowed by congestion control, or
+		 * 0 if ECN is not in use on this queue pair. */
+	uintmax_t ack_pure;
+		/**< Number of acknowledgements, including SACKs, sent in
+		 * datagrams of their own. */
+	uintmax_t ack_piggybacked;
+		/**< Number of acknowledgements carried by an outgoing DDP
+		 * segment instead. */
+};
+
+/** Statistics about the sleeping of progress lcores, summed over every
+ * progress lcore of the process.  All times are in timer cycles; see
+ * rte_get_timer_hz(). */
+struct urdma_progress_stats {
+	uintmax_t elapsed_cycles;
+		/**< Time since the progress lcores started. */
+	uintmax_t sleep_cycles;
+		/**< Time spent blocked waiting for a packet or work request;
+		 * the progress lcores were busy for the remainder of
+		 * elapsed_cycles. */
+	uintmax_t sleep_count;
+		/**< Number of times that a progress lcore went to sleep. */
+	uintmax_t wakeup_rx;
+		/**< Number of wake-ups caused by a receive queue interrupt. */
+	uintmax_t wakeup_post;
+		/**< Number of wake-ups caused by a posted work request or a
+		 * newly created queue pair. */
+	uintmax_t wakeup_timeout;
+		/**< Number of wake-ups caused by the sleep timeout expiring. */
+	uintmax_t wakeup_latency_total;
+		/**< Sum over all wakeup_post wake-ups of the time from the
+		 * request to wake up to the progress lcore running again. */
+	uintmax_t wakeup_latency_max;
+		/**< Largest single wake-up latency. */
 };
 
 struct ibv_mr *
@@ -105,4 +175,15 @@ void
 urdma_query_qp_stats(const struct ibv_qp *restrict qp,
 		struct urdma_qp_stats *restrict stats);
 
+void
+urdma_query_progress_stats(struct urdma_progress_stats *stats);
+
+/** Limits the rate at which qp sends new data to rate_mbps Mbit/s, allowing
+ * bursts of up to burst_bytes bytes at line rate after it has been idle.  A
+ * rate_mbps of 0 removes the limit.  This may be called at any time after the
+ * queue pair is created.  Returns 0 or an errno value. */
+int
+urdma_set_qp_rate_limit(struct ibv_qp *qp, unsigned int rate_mbps,
+		unsigned int burst_bytes);
+
 #endif
@@ -0,0 +1,162 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Compares copying a DDP segment payload and then computing its checksum, as
+ * done for NICs without checksum offload, against the fused cksum_copy(), for
+ * payloads from 64 bytes to 8 KiB.  The reference checksum follows
+ * rte_raw_cksum(), and every length from 0 to 256 bytes at each source
+ * alignment is checked against it first.
+ *
+ * Build with:
+ *   cc -O2 -march=native -I src/util -o cksum_bench \
+ *	src/tests/cksum_bench.c src/util/cksum.c */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "cksum.h"
+
+#define BENCH_MIN_LENGTH 64
+#define BENCH_MAX_LENGTH 8192
+#define BENCH_BYTES (UINT64_C(1) << 30)
+
+static uint64_t
+read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+} /* read_cycles */
+
+/* Same algorithm as rte_raw_cksum() */
+static uint16_t
+ref_cksum(const void *buf, size_t len)
+{
+	const uint16_t *u16 = buf;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2) {
+		sum += *u16++;
+	}
+	if (len == 1) {
+		sum += *(const uint8_t *)u16;
+	}
+	return cksum_fold(sum);
+} /* ref_cksum */
+
+static int
+check(char *src, char *dest)
+{
+	size_t align, len;
+	uint16_t expect;
+
+	for (align = 0; align < 8; ++align) {
+		for (len = 0; len <= 256; ++len) {
+			memset(dest, 0, 256 + 8);
+			expect = ref_cksum(src + align, len);
+			if (cksum_copy(dest, src + align, len) != expect
+					|| memcmp(dest, src + align, len) != 0
+					|| cksum_raw(src + align, len) != expect) {
+				fprintf(stderr, "mismatch at align %zu len %zu\n",
+						align, len);
+				return 1;
+			}
+		}
+	}
+	return 0;
+} /* check */
+
+int
+main(void)
+{
+	uint64_t start, separate, fused, iter, count;
+	volatile uint16_t sink;
+	char *src, *dest;
+	size_t len, x;
+
+	src = malloc(BENCH_MAX_LENGTH);
+	dest = malloc(BENCH_MAX_LENGTH);
+	if (!src || !dest) {
+		return EXIT_FAILURE;
+	}
+	srand(1);
+	for (x = 0; x < BENCH_MAX_LENGTH; ++x) {
+		src[x] = rand();
+	}
+	if (check(src, dest)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %16s %16s\n", "length", "memcpy+cksum", "cksum_copy");
+	for (len = BENCH_MIN_LENGTH; len <= BENCH_MAX_LENGTH; len *= 2) {
+		count = BENCH_BYTES / len;
+
+		start = read_cycles();
+		for (iter = 0; iter < count; ++iter) {
+			memcpy(dest, src, len);
+			sink = ref_cksum(dest, len);
+		}
+		separate = read_cycles() - start;
+
+		start = read_cycles();
+		for (iter = 0; iter < count; ++iter) {
+			sink = cksum_copy(dest, src, len);
+		}
+		fused = read_cycles() - start;
+
+		printf("%8zu %16.1f %16.1f\n", len,
+				(double)separate / count,
+				(double)fused / count);
+	}
+	(void)sink;
+
+	free(src);
+	free(dest);
+	return EXIT_SUCCESS;
+} /* main */
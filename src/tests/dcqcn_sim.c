@@ -0,0 +1,269 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Loopback stand-in for a congested switch port, used to check the DCQCN rate
+ * control in src/util/dcqcn.c without a fabric.  Several senders share one
+ * bottleneck link that drains a FIFO queue at the line rate.  Each datagram
+ * that finds at least mark_depth datagrams queued ahead of it is marked CE,
+ * and the receiver echoes marks back to the sender with its next
+ * acknowledgement, as process_data_packet() does.  With -E the senders ignore
+ * the echoes and the queue is only bounded by the buffer size.
+ *
+ * Build with:
+ *   cc -O2 -I src/util -o dcqcn_sim src/tests/dcqcn_sim.c src/util/dcqcn.c
+ *
+ * Usage: dcqcn_sim [-E] [-f flows] [-k mark_depth] [-t duration_ms] */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dcqcn.h"
+
+/* Simulated time is in nanoseconds, advancing SIM_STEP per iteration */
+#define SIM_HZ UINT64_C(1000000000)
+#define SIM_STEP 10
+#define SIM_US (SIM_HZ / 1000000)
+
+#define LINE_RATE_MBPS 10000
+#define FRAME_BYTES 1078
+#define BUFFER_FRAMES 4096
+#define ACK_INTERVAL (2 * SIM_US)
+#define ONE_WAY_DELAY (5 * SIM_US)
+#define FLOWS_MAX 64
+#define ECHO_RING_SIZE 64
+
+struct frame {
+	unsigned int flow;
+	bool ce;
+};
+
+struct flow {
+	struct dcqcn cc;
+	uint64_t next_send;
+	uint64_t bytes_delivered;
+	bool ce_pending;
+		/**< Receiver side: a CE-marked datagram arrived since the last
+		 * acknowledgement. */
+	uint64_t echo_at[ECHO_RING_SIZE];
+	unsigned int echo_head, echo_tail;
+	unsigned int rate_cuts;
+};
+
+/** Returns the time it takes to put bytes on the wire at rate_mbps Mbit/s. */
+static uint64_t
+wire_time(uint64_t bytes, uint32_t rate_mbps)
+{
+	return bytes * 8 * SIM_HZ / ((uint64_t)rate_mbps * 1000000);
+} /* wire_time */
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-E] [-f flows] [-k mark_depth] [-t duration_ms]\n",
+			argv0);
+} /* usage */
+
+int
+main(int argc, char *argv[])
+{
+	static struct frame queue[BUFFER_FRAMES];
+	static struct flow flows[FLOWS_MAX];
+	static uint64_t depth_histo[BUFFER_FRAMES + 1];
+	struct dcqcn_params params;
+	unsigned int flow_count, mark_depth, head, depth, f;
+	unsigned long marked, dropped;
+	uint64_t now, duration, link_free, next_ack, samples, sum, seen;
+	unsigned int depth_max, depth_p99;
+	bool ecn;
+	int ch;
+
+	ecn = true;
+	flow_count = 4;
+	mark_depth = 64;
+	duration = 50 * 1000 * SIM_US;
+	while ((ch = getopt(argc, argv, "Ef:k:t:")) != -1) {
+		switch (ch) {
+		case 'E':
+			ecn = false;
+			break;
+		case 'f':
+			flow_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			mark_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			duration = strtoull(optarg, NULL, 0) * 1000 * SIM_US;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (flow_count == 0 || flow_count > FLOWS_MAX
+			|| mark_depth > BUFFER_FRAMES) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	params.line_rate = LINE_RATE_MBPS;
+	params.min_rate = DCQCN_MIN_RATE_MBPS;
+	params.additive_increase = DCQCN_ADDITIVE_INCREASE_MBPS;
+	params.hyper_increase = DCQCN_HYPER_INCREASE_MBPS;
+	params.fast_recovery_stages = DCQCN_FAST_RECOVERY_STAGES;
+	params.byte_counter = DCQCN_BYTE_COUNTER;
+	params.increase_period = DCQCN_INCREASE_PERIOD_US * SIM_US;
+	params.alpha_period = DCQCN_ALPHA_PERIOD_US * SIM_US;
+	params.decrease_period = DCQCN_DECREASE_PERIOD_US * SIM_US;
+
+	for (f = 0; f < flow_count; ++f) {
+		dcqcn_init(&flows[f].cc, &params, 0);
+		/* Stagger the start of each flow by a frame */
+		flows[f].next_send = f * wire_time(FRAME_BYTES,
+				LINE_RATE_MBPS);
+	}
+
+	head = depth = 0;
+	marked = dropped = 0;
+	link_free = next_ack = 0;
+	for (now = 0; now < duration; now += SIM_STEP) {
+		/* Senders */
+		for (f = 0; f < flow_count; ++f) {
+			struct flow *fl = &flows[f];
+
+			while (fl->echo_head != fl->echo_tail
+					&& fl->echo_at[fl->echo_head] <= now) {
+				fl->echo_head = (fl->echo_head + 1)
+							% ECHO_RING_SIZE;
+				if (ecn && dcqcn_notify(&fl->cc, &params,
+							now)) {
+					fl->rate_cuts++;
+				}
+			}
+			if (ecn) {
+				dcqcn_tick(&fl->cc, &params, now);
+			}
+			if (now < fl->next_send) {
+				continue;
+			}
+			fl->next_send = now + wire_time(FRAME_BYTES,
+					ecn ? fl->cc.current_rate
+						: LINE_RATE_MBPS);
+			if (ecn) {
+				dcqcn_sent(&fl->cc, &params, FRAME_BYTES);
+			}
+			if (depth == BUFFER_FRAMES) {
+				dropped++;
+				continue;
+			}
+			queue[(head + depth) % BUFFER_FRAMES].flow = f;
+			queue[(head + depth) % BUFFER_FRAMES].ce
+				= ecn && depth >= mark_depth;
+			depth++;
+		}
+
+		/* Bottleneck link and receiver */
+		depth_histo[depth]++;
+		if (depth && now >= link_free) {
+			struct frame *fr = &queue[head];
+
+			link_free = now + wire_time(FRAME_BYTES,
+					LINE_RATE_MBPS);
+			flows[fr->flow].bytes_delivered += FRAME_BYTES;
+			if (fr->ce) {
+				marked++;
+				flows[fr->flow].ce_pending = true;
+			}
+			head = (head + 1) % BUFFER_FRAMES;
+			depth--;
+		}
+
+		/* Acknowledgements carry any pending echo back */
+		if (now >= next_ack) {
+			next_ack = now + ACK_INTERVAL;
+			for (f = 0; f < flow_count; ++f) {
+				struct flow *fl = &flows[f];
+				unsigned int tail;
+
+				tail = (fl->echo_tail + 1) % ECHO_RING_SIZE;
+				if (!fl->ce_pending || tail == fl->echo_head) {
+					continue;
+				}
+				fl->echo_at[fl->echo_tail]
+					= now + ONE_WAY_DELAY;
+				fl->echo_tail = tail;
+				fl->ce_pending = false;
+			}
+		}
+	}
+
+	samples = duration / SIM_STEP;
+	sum = seen = 0;
+	depth_max = depth_p99 = 0;
+	for (depth = 0; depth <= BUFFER_FRAMES; ++depth) {
+		if (!depth_histo[depth]) {
+			continue;
+		}
+		sum += depth * depth_histo[depth];
+		if (seen < samples * 99 / 100) {
+			depth_p99 = depth;
+		}
+		seen += depth_histo[depth];
+		depth_max = depth;
+	}
+
+	printf("%u flows, ECN %s, mark depth %u frames, %" PRIu64 " ms\n",
+			flow_count, ecn ? "on" : "off", mark_depth,
+			duration / (1000 * SIM_US));
+	printf("queue depth: mean %.1f p99 %u max %u frames\n",
+			(double)sum / samples, depth_p99, depth_max);
+	printf("marked %lu dropped %lu\n", marked, dropped);
+	for (f = 0; f < flow_count; ++f) {
+		printf("flow %u: %.2f Gbit/s, %u rate cuts, final rate %" PRIu32 " Mbit/s\n",
+				f, (double)flows[f].bytes_delivered * 8
+					/ ((double)duration / SIM_HZ) / 1e9,
+				flows[f].rate_cuts, flows[f].cc.current_rate);
+	}
+
+	return EXIT_SUCCESS;
+}
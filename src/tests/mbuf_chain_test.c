@@ -0,0 +1,158 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Checks that a multi-segment DDP segment, as built for zero-copy transmit,
+ * can be linked behind a fresh header mbuf for its first transmission and for
+ * each retransmission, and that every one of these frames has the full length.
+ * This is what resend_ddp_segment() does with the segments in tx_pending.
+ * Pass "--no-huge" to run without hugepages.
+ *
+ * Build with:
+ *   cc -O2 -I src/util $(pkg-config --cflags libdpdk) -o mbuf_chain_test \
+ *	src/tests/mbuf_chain_test.c $(pkg-config --libs libdpdk) */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+
+#include "util.h"
+
+#define SEGMENT_COUNT 4
+#define SEGMENT_LEN 1000
+#define DDP_HDR_LEN 18
+#define TRP_HDR_LEN 10
+#define TRANSMIT_COUNT 5
+#define POOL_SIZE 63
+
+/* Builds a DDP segment the way attach_payload_from_iov() does: a header mbuf
+ * followed by SEGMENT_COUNT payload segments. */
+static struct rte_mbuf *
+build_ddp_segment(struct rte_mempool *pool)
+{
+	struct rte_mbuf *sendmsg, *m;
+	int i;
+
+	sendmsg = rte_pktmbuf_alloc(pool);
+	assert(sendmsg != NULL);
+	assert(rte_pktmbuf_append(sendmsg, DDP_HDR_LEN) != NULL);
+	for (i = 0; i < SEGMENT_COUNT; ++i) {
+		m = rte_pktmbuf_alloc(pool);
+		assert(m != NULL);
+		assert(rte_pktmbuf_append(m, SEGMENT_LEN) != NULL);
+		assert(rte_pktmbuf_chain(sendmsg, m) == 0);
+	}
+	return sendmsg;
+} /* build_ddp_segment */
+
+/* Links sendmsg behind a new header and checks the length of the frame.  The
+ * frame is freed as the NIC would after transmitting it, which leaves sendmsg
+ * intact because its segments were referenced first. */
+static int
+transmit(struct rte_mempool *pool, struct rte_mbuf *sendmsg, int attempt)
+{
+	struct rte_mbuf *hdr, *seg;
+	uint32_t expect;
+
+	hdr = rte_pktmbuf_alloc(pool);
+	assert(hdr != NULL);
+	assert(rte_pktmbuf_append(hdr, TRP_HDR_LEN) != NULL);
+	for (seg = sendmsg; seg != NULL; seg = seg->next) {
+		rte_mbuf_refcnt_update(seg, 1);
+	}
+
+	if (pktmbuf_chain_shared(hdr, sendmsg) < 0) {
+		fprintf(stderr, "transmit %d: chain failed\n", attempt);
+		return -1;
+	}
+	expect = TRP_HDR_LEN + DDP_HDR_LEN + SEGMENT_COUNT * SEGMENT_LEN;
+	if (rte_pktmbuf_pkt_len(hdr) != expect
+			|| hdr->nb_segs != SEGMENT_COUNT + 2) {
+		fprintf(stderr, "transmit %d: frame has %" PRIu32 " bytes in %u segments, expected %" PRIu32 " in %u\n",
+				attempt, rte_pktmbuf_pkt_len(hdr),
+				hdr->nb_segs, expect, SEGMENT_COUNT + 2);
+		return -1;
+	}
+	rte_pktmbuf_free(hdr);
+	return 0;
+} /* transmit */
+
+int
+main(int argc, char *argv[])
+{
+	struct rte_mempool *pool;
+	struct rte_mbuf *sendmsg;
+	int i, ret;
+
+	ret = rte_eal_init(argc, argv);
+	if (ret < 0) {
+		fprintf(stderr, "rte_eal_init failed\n");
+		return EXIT_FAILURE;
+	}
+	pool = rte_pktmbuf_pool_create("mbuf_chain_test", POOL_SIZE, 0, 0,
+			RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+	if (!pool) {
+		fprintf(stderr, "cannot create mbuf pool\n");
+		return EXIT_FAILURE;
+	}
+
+	sendmsg = build_ddp_segment(pool);
+	for (i = 0; i < TRANSMIT_COUNT; ++i) {
+		if (transmit(pool, sendmsg, i) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Acknowledged: drop the reference held by tx_pending */
+	rte_pktmbuf_free(sendmsg);
+	if (rte_mempool_avail_count(pool) != POOL_SIZE) {
+		fprintf(stderr, "%u mbufs leaked\n",
+				POOL_SIZE - rte_mempool_avail_count(pool));
+		return EXIT_FAILURE;
+	}
+
+	printf("%d transmissions of a %d-segment payload OK\n",
+			TRANSMIT_COUNT, SEGMENT_COUNT);
+	return EXIT_SUCCESS;
+} /* main */
@@ -0,0 +1,271 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Posts more RDMA READs back-to-back than the ORD of the device, each reading
+ * a different block of the server's buffer, and checks that every one
+ * completes successfully with the right data.  The requester has to hold the
+ * later READs back until earlier ones complete, rather than lose track of
+ * them.
+ *
+ * Build with:
+ *   cc -O2 -o read_burst_test src/tests/read_burst_test.c \
+ *	-lrdmacm -libverbs
+ *
+ * Usage: read_burst_test <port>                 (server)
+ *        read_burst_test <server address> <port> (client)
+ *
+ * Both ends wait for completions on a completion channel, so they must not
+ * use application progress mode ("progress_lcores": 0). */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+/* Must exceed USIW_ORD_MAX in src/liburdma/interface.h */
+#define READ_COUNT 300
+#define BLOCK_SIZE 64
+
+struct buffer_info {
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t length;
+};
+
+static void
+die(const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(EXIT_FAILURE);
+} /* die */
+
+static struct rdma_cm_id *
+init_ep(const char *node, const char *service)
+{
+	struct rdma_addrinfo hints, *info;
+	struct ibv_qp_init_attr attr;
+	struct rdma_cm_id *cm_id;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = RAI_FAMILY | (node ? 0 : RAI_PASSIVE);
+	hints.ai_family = AF_INET;
+	hints.ai_qp_type = IBV_QPT_RC;
+	hints.ai_port_space = RDMA_PS_TCP;
+	if (rdma_getaddrinfo((char *)node, (char *)service, &hints, &info)) {
+		die("rdma_getaddrinfo");
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_type = IBV_QPT_RC;
+	attr.cap.max_send_wr = READ_COUNT + 1;
+	attr.cap.max_recv_wr = 1;
+	attr.cap.max_send_sge = 1;
+	attr.cap.max_recv_sge = 1;
+	attr.sq_sig_all = 1;
+	if (rdma_create_ep(&cm_id, info, NULL, &attr)) {
+		die("rdma_create_ep");
+	}
+	rdma_freeaddrinfo(info);
+	return cm_id;
+} /* init_ep */
+
+static void
+wait_send(struct rdma_cm_id *cm_id, struct ibv_wc *wc)
+{
+	if (rdma_get_send_comp(cm_id, wc) <= 0) {
+		die("rdma_get_send_comp");
+	}
+} /* wait_send */
+
+static int
+run_server(const char *service)
+{
+	struct rdma_cm_id *listen_id, *cm_id;
+	struct buffer_info info, done;
+	struct ibv_mr *mr, *info_mr, *done_mr;
+	struct ibv_wc wc;
+	uint32_t *buf;
+	size_t i;
+
+	listen_id = init_ep(NULL, service);
+	if (rdma_listen(listen_id, 0) || rdma_get_request(listen_id, &cm_id)) {
+		die("rdma_listen");
+	}
+
+	buf = malloc(READ_COUNT * BLOCK_SIZE);
+	if (!buf) {
+		die("malloc");
+	}
+	for (i = 0; i < READ_COUNT * BLOCK_SIZE / sizeof(*buf); ++i) {
+		buf[i] = i;
+	}
+	mr = rdma_reg_read(cm_id, buf, READ_COUNT * BLOCK_SIZE);
+	info_mr = rdma_reg_msgs(cm_id, &info, sizeof(info));
+	done_mr = rdma_reg_msgs(cm_id, &done, sizeof(done));
+	if (!mr || !info_mr || !done_mr) {
+		die("ibv_reg_mr");
+	}
+	if (rdma_post_recv(cm_id, NULL, &done, sizeof(done), done_mr)) {
+		die("rdma_post_recv");
+	}
+	if (rdma_accept(cm_id, NULL)) {
+		die("rdma_accept");
+	}
+
+	info.addr = (uintptr_t)buf;
+	info.rkey = mr->rkey;
+	info.length = READ_COUNT * BLOCK_SIZE;
+	if (rdma_post_send(cm_id, NULL, &info, sizeof(info), info_mr, 0)) {
+		die("rdma_post_send");
+	}
+	wait_send(cm_id, &wc);
+
+	/* The client tells us when it has finished reading */
+	if (rdma_get_recv_comp(cm_id, &wc) <= 0) {
+		die("rdma_get_recv_comp");
+	}
+
+	rdma_disconnect(cm_id);
+	rdma_dereg_mr(done_mr);
+	rdma_dereg_mr(info_mr);
+	rdma_dereg_mr(mr);
+	free(buf);
+	rdma_destroy_ep(cm_id);
+	rdma_destroy_ep(listen_id);
+	return EXIT_SUCCESS;
+} /* run_server */
+
+static int
+run_client(const char *node, const char *service)
+{
+	struct rdma_cm_id *cm_id;
+	struct buffer_info info;
+	struct ibv_mr *mr, *info_mr;
+	struct ibv_wc wc;
+	uint32_t *buf;
+	size_t i, errors;
+	int status;
+
+	cm_id = init_ep(node, service);
+
+	buf = calloc(READ_COUNT, BLOCK_SIZE);
+	if (!buf) {
+		die("calloc");
+	}
+	mr = ibv_reg_mr(cm_id->pd, buf, READ_COUNT * BLOCK_SIZE,
+			IBV_ACCESS_LOCAL_WRITE);
+	info_mr = rdma_reg_msgs(cm_id, &info, sizeof(info));
+	if (!mr || !info_mr) {
+		die("ibv_reg_mr");
+	}
+	if (rdma_post_recv(cm_id, NULL, &info, sizeof(info), info_mr)) {
+		die("rdma_post_recv");
+	}
+	if (rdma_connect(cm_id, NULL)) {
+		die("rdma_connect");
+	}
+	if (rdma_get_recv_comp(cm_id, &wc) <= 0 || wc.status != IBV_WC_SUCCESS) {
+		die("rdma_get_recv_comp");
+	}
+
+	for (i = 0; i < READ_COUNT; ++i) {
+		if (rdma_post_read(cm_id, (void *)i, (char *)buf + i * BLOCK_SIZE,
+					BLOCK_SIZE, mr, 0,
+					info.addr + i * BLOCK_SIZE, info.rkey)) {
+			die("rdma_post_read");
+		}
+	}
+
+	status = EXIT_SUCCESS;
+	for (i = 0; i < READ_COUNT; ++i) {
+		wait_send(cm_id, &wc);
+		if (wc.status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "READ %" PRIu64 " completed with %s\n",
+					wc.wr_id, ibv_wc_status_str(wc.status));
+			status = EXIT_FAILURE;
+		} else if (wc.wr_id != i) {
+			fprintf(stderr, "READ %" PRIu64 " completed in place of READ %zu\n",
+					wc.wr_id, i);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	errors = 0;
+	for (i = 0; i < READ_COUNT * BLOCK_SIZE / sizeof(*buf); ++i) {
+		if (buf[i] != i) {
+			errors++;
+		}
+	}
+	if (errors) {
+		fprintf(stderr, "%zu words read incorrectly\n", errors);
+		status = EXIT_FAILURE;
+	}
+
+	if (rdma_post_send(cm_id, NULL, &info, sizeof(info), info_mr, 0)) {
+		die("rdma_post_send");
+	}
+	wait_send(cm_id, &wc);
+
+	if (status == EXIT_SUCCESS) {
+		printf("%d RDMA READs completed\n", READ_COUNT);
+	}
+	rdma_disconnect(cm_id);
+	rdma_dereg_mr(info_mr);
+	rdma_dereg_mr(mr);
+	free(buf);
+	rdma_destroy_ep(cm_id);
+	return status;
+} /* run_client */
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 2) {
+		return run_server(argv[1]);
+	} else if (argc == 3) {
+		return run_client(argv[1], argv[2]);
+	}
+	fprintf(stderr, "Usage: %s [<server address>] <port>\n", argv[0]);
+	return EXIT_FAILURE;
+} /* main */
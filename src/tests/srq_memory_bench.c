@@ -0,0 +1,202 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Measures the receive-side memory used by many queue pairs on a urdma
+ * device, first with a fully provisioned receive queue per queue pair and
+ * then with every queue pair attached to one shared receive queue of the same
+ * depth.  Memory is measured as the growth of the DPDK heaps (rings) plus the
+ * growth of the C heap (WQE storage and MSN tables) while the queue pairs
+ * exist.  urdmad must be running, but no connections are made.
+ *
+ * Build with:
+ *   cc -O2 $(pkg-config --cflags libdpdk) -o srq_memory_bench \
+ *	src/tests/srq_memory_bench.c -libverbs $(pkg-config --libs libdpdk)
+ *
+ * Usage: srq_memory_bench [qp_count [recv_wr [recv_sge]]] */
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include <rte_malloc.h>
+
+static size_t
+memory_in_use(void)
+{
+	struct rte_malloc_socket_stats stats;
+	struct mallinfo mi;
+	size_t total;
+	int socket;
+
+	total = 0;
+	for (socket = 0; socket < RTE_MAX_NUMA_NODES; ++socket) {
+		if (rte_malloc_get_socket_stats(socket, &stats) == 0) {
+			total += stats.heap_allocsz_bytes;
+		}
+	}
+	mi = mallinfo();
+	return total + mi.uordblks + mi.hblkhd;
+} /* memory_in_use */
+
+
+static size_t
+measure(struct ibv_pd *pd, struct ibv_cq *cq, struct ibv_srq *srq,
+		unsigned int qp_count, unsigned int recv_wr,
+		unsigned int recv_sge)
+{
+	struct ibv_qp_init_attr attr;
+	struct ibv_qp **qp;
+	size_t before, after;
+	unsigned int i;
+
+	qp = calloc(qp_count, sizeof(*qp));
+	if (!qp) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	before = memory_in_use();
+	for (i = 0; i < qp_count; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.send_cq = cq;
+		attr.recv_cq = cq;
+		attr.srq = srq;
+		attr.qp_type = IBV_QPT_RC;
+		attr.cap.max_send_wr = 1;
+		attr.cap.max_send_sge = 1;
+		attr.cap.max_recv_wr = srq ? 0 : recv_wr;
+		attr.cap.max_recv_sge = srq ? 0 : recv_sge;
+		qp[i] = ibv_create_qp(pd, &attr);
+		if (!qp[i]) {
+			fprintf(stderr, "ibv_create_qp %u: %s\n", i,
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	after = memory_in_use();
+
+	for (i = 0; i < qp_count; ++i) {
+		ibv_destroy_qp(qp[i]);
+	}
+	free(qp);
+	/* The progress thread frees destroyed queue pairs asynchronously; do
+	 * not let that overlap the next measurement */
+	sleep(1);
+	return after - before;
+} /* measure */
+
+
+int
+main(int argc, char *argv[])
+{
+	struct ibv_srq_init_attr srq_attr;
+	struct ibv_device **devices;
+	struct ibv_context *ctx;
+	struct ibv_pd *pd;
+	struct ibv_cq *cq;
+	struct ibv_srq *srq;
+	unsigned int qp_count, recv_wr, recv_sge;
+	size_t plain, shared, srq_size, before;
+	int i;
+
+	qp_count = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+	recv_wr = argc > 2 ? strtoul(argv[2], NULL, 0) : 1023;
+	recv_sge = argc > 3 ? strtoul(argv[3], NULL, 0) : 3;
+
+	devices = ibv_get_device_list(NULL);
+	if (!devices) {
+		perror("ibv_get_device_list");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; devices[i]; ++i) {
+		if (strncmp(ibv_get_device_name(devices[i]), "urdma", 5) == 0) {
+			break;
+		}
+	}
+	if (!devices[i]) {
+		fprintf(stderr, "no urdma device found\n");
+		return EXIT_FAILURE;
+	}
+	ctx = ibv_open_device(devices[i]);
+	if (!ctx) {
+		perror("ibv_open_device");
+		return EXIT_FAILURE;
+	}
+	pd = ibv_alloc_pd(ctx);
+	cq = ibv_create_cq(ctx, 64, NULL, NULL, 0);
+	if (!pd || !cq) {
+		perror("ibv_alloc_pd/ibv_create_cq");
+		return EXIT_FAILURE;
+	}
+
+	plain = measure(pd, cq, NULL, qp_count, recv_wr, recv_sge);
+
+	memset(&srq_attr, 0, sizeof(srq_attr));
+	srq_attr.attr.max_wr = recv_wr;
+	srq_attr.attr.max_sge = recv_sge;
+	before = memory_in_use();
+	srq = ibv_create_srq(pd, &srq_attr);
+	if (!srq) {
+		perror("ibv_create_srq");
+		return EXIT_FAILURE;
+	}
+	srq_size = memory_in_use() - before;
+	shared = measure(pd, cq, srq, qp_count, recv_wr, recv_sge);
+
+	printf("{ \"qp_count\": %u, \"recv_wr\": %u, \"recv_sge\": %u,\n"
+	       "  \"bytes_per_qp_without_srq\": %zu,\n"
+	       "  \"bytes_per_qp_with_srq\": %zu,\n"
+	       "  \"srq_bytes\": %zu,\n"
+	       "  \"total_without_srq\": %zu,\n"
+	       "  \"total_with_srq\": %zu }\n",
+	       qp_count, recv_wr, recv_sge,
+	       plain / qp_count, shared / qp_count, srq_size,
+	       plain, shared + srq_size);
+
+	ibv_destroy_srq(srq);
+	ibv_destroy_cq(cq);
+	ibv_dealloc_pd(pd);
+	ibv_close_device(ctx);
+	ibv_free_device_list(devices);
+	return EXIT_SUCCESS;
+} /* main */
@@ -0,0 +1,259 @@
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+
+/* Compares the cost per progress loop iteration of scanning every in-flight
+ * segment for an expired retransmission deadline against expiring timers from
+ * a timer_wheel, with BENCH_QP_COUNT queue pairs each holding
+ * BENCH_SEGMENT_COUNT unacknowledged segments.  The wheel fires a timer once
+ * its tick has passed, so every deadline is the last nanosecond of a tick,
+ * where both retransmit at the same time; the benchmark fails if they do not
+ * retransmit equally often.  Before measuring, it checks that a timer re-armed
+ * from its callback with a deadline that has already passed still fires by
+ * the next call to timer_wheel_expire().
+ *
+ * Build with:
+ *   cc -O2 -I src/util -o timer_wheel_bench \
+ *	src/tests/timer_wheel_bench.c src/util/timer_wheel.c */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "timer_wheel.h"
+
+#define BENCH_QP_COUNT 64
+#define BENCH_SEGMENT_COUNT 512
+#define BENCH_ITERATIONS 20000
+
+/* Simulated clock: 1 ms ticks and a 10 ms retransmission timeout, advancing
+ * one microsecond per progress loop iteration. */
+#define SIM_HZ UINT64_C(1000000000)
+#define SIM_TICK (SIM_HZ / 1000)
+#define SIM_RTO (SIM_HZ / 100)
+#define SIM_STEP (SIM_HZ / 1000000)
+
+struct segment {
+	struct timer_wheel_entry timer;
+	uint64_t next_retransmit;
+	unsigned int transmit_count;
+};
+
+struct qp {
+	struct timer_wheel wheel;
+	struct segment seg[BENCH_SEGMENT_COUNT];
+};
+
+static uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+} /* cycles */
+
+static void
+retransmit(struct timer_wheel_entry *timer, void *arg)
+{
+	struct timer_wheel *wheel = arg;
+	struct segment *seg = (struct segment *)timer;
+
+	seg->transmit_count++;
+	timer_wheel_arm(wheel, timer, timer->deadline + SIM_RTO);
+} /* retransmit */
+
+struct rearm_check {
+	struct timer_wheel_entry timer;
+	uint64_t rearm_deadline;
+	unsigned int fired;
+};
+
+static void
+rearm_once(struct timer_wheel_entry *timer, void *arg)
+{
+	struct timer_wheel *wheel = arg;
+	struct rearm_check *check = (struct rearm_check *)timer;
+
+	if (check->fired++ == 0) {
+		timer_wheel_arm(wheel, timer, check->rearm_deadline);
+	}
+} /* rearm_once */
+
+/* Arms a timer at deadline, which re-arms itself at rearm_deadline the first
+ * time it fires, and returns true if it has fired twice after two calls to
+ * timer_wheel_expire() at now and now + 1 tick. */
+static bool
+check_rearm(uint64_t deadline, uint64_t rearm_deadline, uint64_t now)
+{
+	struct timer_wheel wheel;
+	struct rearm_check check;
+
+	timer_wheel_init(&wheel, 1, 0);
+	timer_wheel_entry_init(&check.timer);
+	check.rearm_deadline = rearm_deadline;
+	check.fired = 0;
+	timer_wheel_arm(&wheel, &check.timer, deadline);
+	timer_wheel_expire(&wheel, now, rearm_once, &wheel);
+	timer_wheel_expire(&wheel, now + 1, rearm_once, &wheel);
+	if (check.fired != 2) {
+		fprintf(stderr, "timer at %" PRIu64 " re-armed at %" PRIu64 " fired %u times by %" PRIu64 ", expected 2\n",
+				deadline, rearm_deadline, check.fired, now + 1);
+		return false;
+	}
+	return true;
+} /* check_rearm */
+
+static void
+setup(struct qp *qps)
+{
+	struct segment *seg;
+	unsigned int q, s;
+
+	for (q = 0; q < BENCH_QP_COUNT; ++q) {
+		timer_wheel_init(&qps[q].wheel, SIM_TICK, 0);
+		for (s = 0; s < BENCH_SEGMENT_COUNT; ++s) {
+			/* Segments were sent back to back over the last RTO,
+			 * and are due at the end of a tick */
+			seg = &qps[q].seg[s];
+			seg->transmit_count = 0;
+			seg->next_retransmit = ((uint64_t)s * (SIM_RTO / SIM_TICK)
+					/ BENCH_SEGMENT_COUNT + 1) * SIM_TICK - 1;
+			timer_wheel_entry_init(&seg->timer);
+			timer_wheel_arm(&qps[q].wheel, &seg->timer,
+					seg->next_retransmit);
+		}
+	}
+} /* setup */
+
+static unsigned long
+transmit_total(struct qp *qps)
+{
+	unsigned long total = 0;
+	unsigned int q, s;
+
+	for (q = 0; q < BENCH_QP_COUNT; ++q) {
+		for (s = 0; s < BENCH_SEGMENT_COUNT; ++s) {
+			total += qps[q].seg[s].transmit_count;
+		}
+	}
+	return total;
+} /* transmit_total */
+
+int
+main(void)
+{
+	struct segment *seg;
+	struct qp *qps;
+	uint64_t now, start, sweep_cycles, wheel_cycles;
+	unsigned long sweep_total, wheel_total;
+	unsigned int i, q, s;
+
+	/* Re-armed in the past, from a slot in the middle and from the last
+	 * slot that the expiring call visits */
+	if (!check_rearm(5, 3, 10) || !check_rearm(9, 9, 10)
+			|| !check_rearm(9, 0, 10)) {
+		return EXIT_FAILURE;
+	}
+
+	qps = malloc(BENCH_QP_COUNT * sizeof(*qps));
+	if (!qps) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* Full sweep of every in-flight segment, as sweep_unacked_packets()
+	 * used to do */
+	setup(qps);
+	start = cycles();
+	for (i = 0, now = 0; i < BENCH_ITERATIONS; ++i, now += SIM_STEP) {
+		for (q = 0; q < BENCH_QP_COUNT; ++q) {
+			for (s = 0; s < BENCH_SEGMENT_COUNT; ++s) {
+				seg = &qps[q].seg[s];
+				if (now > seg->next_retransmit) {
+					seg->transmit_count++;
+					seg->next_retransmit += SIM_RTO;
+				}
+			}
+		}
+	}
+	sweep_cycles = cycles() - start;
+	sweep_total = transmit_total(qps);
+
+	setup(qps);
+	start = cycles();
+	for (i = 0, now = 0; i < BENCH_ITERATIONS; ++i, now += SIM_STEP) {
+		for (q = 0; q < BENCH_QP_COUNT; ++q) {
+			timer_wheel_expire(&qps[q].wheel, now, retransmit,
+					&qps[q].wheel);
+		}
+	}
+	wheel_cycles = cycles() - start;
+	wheel_total = transmit_total(qps);
+
+	if (wheel_total != sweep_total) {
+		fprintf(stderr, "timer wheel made %lu retransmits, full sweep made %lu\n",
+				wheel_total, sweep_total);
+		free(qps);
+		return EXIT_FAILURE;
+	}
+
+	printf("%u QPs x %u segments, %u iterations, %lu retransmits\n",
+			BENCH_QP_COUNT, BENCH_SEGMENT_COUNT, BENCH_ITERATIONS,
+			sweep_total);
+	printf("full sweep:  %10.1f cycles/iteration\n",
+			(double)sweep_cycles / BENCH_ITERATIONS);
+	printf("timer wheel: %10.1f cycles/iteration\n",
+			(double)wheel_cycles / BENCH_ITERATIONS);
+	printf("speedup:     %10.1fx\n",
+			(double)sweep_cycles / wheel_cycles);
+
+	free(qps);
+	return EXIT_SUCCESS;
+}
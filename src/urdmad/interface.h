@@ -46,11 +46,14 @@
 #include <rte_kni.h>
 #include <rte_spinlock.h>
 
+#define MEMPOOL_CACHE_SIZE 128
 #define PENDING_DATAGRAM_INFO_SIZE 64
 #define RX_BURST_SIZE 32
 #define RX_DESC_COUNT_MAX 1024
 #define TX_DESC_COUNT_MAX 1024
+#define TX_HDR_DATA_ROOM 192
 #define URDMA_MAX_QP 31
+#define URDMA_MAX_SHARED_QP 1023
 
 #ifndef container_of
 #define container_of(ptr, type, field) \
@@ -60,6 +63,17 @@
 enum usiw_port_flags {
 	port_checksum_offload = 1,
 	port_fdir = 2,
+	port_shared_queues = 4,
+};
+
+/** Tracks which process uses a hardware queue pair in shared queue mode.
+ * Only queue pairs of the same process share a hardware queue, since that
+ * process must demultiplex everything that arrives on it. */
+struct urdmad_queue {
+	struct urdma_process *owner;
+		/**< Process whose queue pairs use this queue, or NULL. */
+	unsigned int qp_count;
+		/**< Number of queue pairs assigned to this queue. */
 };
 
 LIST_HEAD(urdmad_qp_head, urdmad_qp);
@@ -71,12 +85,20 @@ struct usiw_port {
 	struct rte_mempool *rx_mempool;
 	struct rte_mempool *tx_ddp_mempool;
 	struct rte_mempool *tx_hdr_mempool;
+	struct rte_mempool *tx_ext_mempool;
 
 	uint16_t rx_desc_count;
 	uint16_t tx_desc_count;
 	uint16_t max_qp;
+	uint16_t queue_count;
+		/**< Number of hardware queue pairs for queue pairs, not
+		 * counting queue 0.  Equal to max_qp unless port_shared_queues
+		 * is set. */
 	struct urdmad_qp_head avail_qp;
 	struct urdmad_qp *qp;
+	struct urdmad_queue *queues;
+		/**< Owner of each hardware queue pair, indexed by queue id;
+		 * only allocated if port_shared_queues is set. */
 
 	uint64_t flags;
 
@@ -68,6 +68,7 @@
 #include "interface.h"
 #include "list.h"
 #include "kni.h"
+#include "proto_trp.h"
 #include "util.h"
 #include "urdmad_private.h"
 #include "urdma_kabi.h"
@@ -204,11 +205,16 @@ handle_qp_disconnected_event(struct urdma_qp_disconnected_event *event, size_t c
 					qp->qp_id, rte_strerror(ret));
 		}
 
-		/* Drain the queue of any outstanding messages. */
-		do {
-			ret = rte_eth_rx_burst(dev->portid, qp->rx_queue,
-					mbuf, mbuf_count);
-		} while (ret > 0);
+		/* Drain the queue of any outstanding messages.  A shared
+		 * queue is still in use by the owning process, which drops
+		 * datagrams for ports that no longer have a queue pair. */
+		if (!(qp->flags & urdmad_qp_shared_queue)) {
+			do {
+				ret = rte_eth_rx_burst(dev->portid,
+						qp->rx_queue, mbuf,
+						mbuf_count);
+			} while (ret > 0);
+		}
 	}
 } /* handle_qp_disconnected_event */
 
@@ -250,6 +256,7 @@ handle_qp_connected_event(struct urdma_qp_connected_event *event, size_t count)
 	qp->remote_ipv4_addr = event->dst_ipv4;
 	qp->ord_max = event->ord_max;
 	qp->ird_max = event->ird_max;
+	qp->features = event->features;
 	switch (dev->mtu) {
 	case 9000:
 		qp->mtu = 8192;
@@ -258,7 +265,7 @@ handle_qp_connected_event(struct urdma_qp_connected_event *event, size_t count)
 		qp->mtu = 1024;
 	}
 	ret = rte_eth_rx_queue_info_get(event->urdmad_dev_id,
-			event->urdmad_qp_id, &rxq_info);
+			event->rxq, &rxq_info);
 	if (ret < 0) {
 		qp->rx_desc_count = dev->rx_desc_count;
 	} else {
@@ -380,15 +387,18 @@ chardev_data_ready(struct urdma_fd *fd)
 } /* chardev_data_ready */
 
 
+/** Sends the queue pair assigned to the process in response to its
+ * create_qp_req, or a NULL pointer if qp is NULL because none is available. */
 static int
-send_create_qp_resp(struct urdma_process *process, struct urdmad_qp *qp)
+send_create_qp_resp(struct urdma_process *process, uint16_t dev_id,
+		struct urdmad_qp *qp)
 {
 	struct urdmad_sock_qp_msg msg;
 	int ret;
 
 	msg.hdr.opcode = rte_cpu_to_be_32(urdma_sock_create_qp_resp);
-	msg.hdr.dev_id = rte_cpu_to_be_16(qp->dev_id);
-	msg.hdr.qp_id = rte_cpu_to_be_16(qp->qp_id);
+	msg.hdr.dev_id = rte_cpu_to_be_16(dev_id);
+	msg.hdr.qp_id = rte_cpu_to_be_16(qp ? qp->qp_id : 0);
 	msg.ptr = rte_cpu_to_be_64((uintptr_t)qp);
 	ret = send(process->fd.fd, &msg, sizeof(msg), 0);
 	if (ret < 0) {
@@ -402,6 +412,63 @@ send_create_qp_resp(struct urdma_process *process, struct urdmad_qp *qp)
 } /* send_create_qp_resp */
 
 
+/** Assigns a hardware queue pair to qp in shared queue mode.  All queue pairs
+ * of a process on this port share the first queue that the process was
+ * given, so that the process can demultiplex it without coordinating with
+ * other processes.  Returns false if the process does not own a queue yet and
+ * every queue is owned by another process. */
+static bool
+assign_shared_queue(struct usiw_port *port, struct urdma_process *process,
+		struct urdmad_qp *qp)
+{
+	struct urdmad_queue *queue, *free_queue;
+	uint16_t q;
+
+	free_queue = NULL;
+	for (q = 1; q <= port->queue_count; ++q) {
+		queue = &port->queues[q];
+		if (queue->owner == process) {
+			break;
+		}
+		if (!queue->owner && !free_queue) {
+			free_queue = queue;
+		}
+	}
+	if (q > port->queue_count) {
+		if (!free_queue) {
+			return false;
+		}
+		queue = free_queue;
+		q = queue - port->queues;
+	}
+
+	queue->owner = process;
+	queue->qp_count++;
+	qp->rx_queue = q;
+	qp->tx_queue = q;
+	return true;
+} /* assign_shared_queue */
+
+
+/** Returns qp to the pool of available queue pairs, giving up its hardware
+ * queue if no other queue pair of the owning process still uses it. */
+static void
+return_qp(struct usiw_port *port, struct urdmad_qp *qp)
+{
+	struct urdmad_queue *queue;
+
+	if (qp->flags & urdmad_qp_shared_queue) {
+		queue = &port->queues[qp->rx_queue];
+		if (--queue->qp_count == 0) {
+			queue->owner = NULL;
+		}
+		qp->rx_queue = 0;
+		qp->tx_queue = 0;
+	}
+	LIST_INSERT_HEAD(&port->avail_qp, qp, urdmad__entry);
+} /* return_qp */
+
+
 static int
 handle_hello(struct urdma_process *process, struct urdmad_sock_hello_req *req)
 {
@@ -450,8 +517,7 @@ process_data_ready(struct urdma_fd *process_fd)
 			RTE_LOG(DEBUG, USER1, "Return QP %" PRIu16 " to pool\n",
 					qp->qp_id);
 			LIST_REMOVE(qp, urdmad__entry);
-			LIST_INSERT_HEAD(&driver->ports[qp->dev_id].avail_qp,
-					qp, urdmad__entry);
+			return_qp(&driver->ports[qp->dev_id], qp);
 		}
 		return_lcores(process->core_mask);
 		goto err;
@@ -465,11 +531,22 @@ process_data_ready(struct urdma_fd *process_fd)
 		}
 		port = &driver->ports[dev_id];
 		qp = port->avail_qp.lh_first;
+		if (!qp || ((port->flags & port_shared_queues)
+				&& !assign_shared_queue(port, process, qp))) {
+			RTE_LOG(DEBUG, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d => no queue pair available\n",
+					dev_id, process->fd.fd);
+			ret = send_create_qp_resp(process, dev_id, NULL);
+			if (ret < 0) {
+				goto err;
+			}
+			break;
+		}
 		LIST_REMOVE(qp, urdmad__entry);
-		RTE_LOG(DEBUG, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d => qp_id=%" PRIu16 "\n",
-				dev_id, process->fd.fd, qp->qp_id);
+		RTE_LOG(DEBUG, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d => qp_id=%" PRIu16 " rx_queue=%" PRIu16 "\n",
+				dev_id, process->fd.fd, qp->qp_id,
+				qp->rx_queue);
 		LIST_INSERT_HEAD(&process->owned_qps, qp, urdmad__entry);
-		ret = send_create_qp_resp(process, qp);
+		ret = send_create_qp_resp(process, dev_id, qp);
 		if (ret < 0) {
 			goto err;
 		}
@@ -486,8 +563,7 @@ process_data_ready(struct urdma_fd *process_fd)
 		port = &driver->ports[dev_id];
 		qp = &port->qp[qp_id];
 		LIST_REMOVE(qp, urdmad__entry);
-		LIST_INSERT_HEAD(&driver->ports[dev_id].avail_qp, qp,
-					urdmad__entry);
+		return_qp(port, qp);
 		break;
 	case urdma_sock_hello_req:
 		fprintf(stderr, "HELLO on fd %d\n", process->fd.fd);
@@ -678,6 +754,26 @@ setup_base_filters(struct usiw_port *iface)
 } /* setup_base_filters */
 
 
+/* Every TRP header that liburdma sends, including a selective
+ * acknowledgement with the most ranges, must fit in a tx_hdr_mempool mbuf; the
+ * Ethernet, IPv4 and UDP headers go in the headroom. */
+static_assert(sizeof(struct trp_hdr) + sizeof(struct trp_sack)
+		+ TRP_SACK_RANGES_MAX * sizeof(struct trp_sack_range)
+		<= TX_HDR_DATA_ROOM, "TX_HDR_DATA_ROOM too small for trp_sack");
+
+
+/** Returns the per-lcore cache size to use for a mempool with count
+ * elements.  The progress lcores of each process then allocate and free
+ * their mbufs without touching the shared ring most of the time. */
+static unsigned int
+mempool_cache_size(unsigned int count)
+{
+	/* rte_mempool_create() rejects caches that could hold more than 2/3
+	 * of the pool, so leave some margin for small pools */
+	return RTE_MIN(MEMPOOL_CACHE_SIZE, count / 2);
+} /* mempool_cache_size */
+
+
 static int
 usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 {
@@ -687,6 +783,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		= DEV_TX_OFFLOAD_UDP_CKSUM|DEV_TX_OFFLOAD_IPV4_CKSUM;
 
 	char name[RTE_MEMPOOL_NAMESIZE];
+	unsigned int mbuf_count;
 	struct rte_eth_txconf txconf;
 	struct rte_eth_rxconf rxconf;
 	struct rte_eth_conf port_conf;
@@ -725,14 +822,29 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	} else {
 		port_conf.fdir_conf.mode = RTE_FDIR_MODE_NONE;
 	}
-	iface->max_qp = URDMA_MAX_QP;
+	port_conf.intr_conf.rxq = port_config->rx_interrupts;
+	iface->queue_count = URDMA_MAX_QP;
 	fprintf(stderr, "max_rx_queues %d\n", iface->dev_info.max_rx_queues);
-	if (iface->max_qp > iface->dev_info.max_rx_queues) {
-		iface->max_qp = iface->dev_info.max_rx_queues;
+	if (iface->queue_count > iface->dev_info.max_rx_queues) {
+		iface->queue_count = iface->dev_info.max_rx_queues;
 	}
 	fprintf(stderr, "max_tx_queues %d\n", iface->dev_info.max_tx_queues);
-	if (iface->max_qp > iface->dev_info.max_tx_queues) {
-		iface->max_qp = iface->dev_info.max_tx_queues;
+	if (iface->queue_count > iface->dev_info.max_tx_queues) {
+		iface->queue_count = iface->dev_info.max_tx_queues;
+	}
+	iface->max_qp = iface->queue_count;
+	if (port_config->shared_queues && !(iface->flags & port_fdir)) {
+		RTE_LOG(WARNING, USER1, "Port %u does not support flow director; ignoring shared_queues\n",
+				iface->portid);
+	} else if (port_config->shared_queues) {
+		/* Each datagram is steered to the hardware queue of the
+		 * process that owns its destination port, and demultiplexed
+		 * to a queue pair in software by that process */
+		iface->flags |= port_shared_queues;
+		if (iface->queue_count > port_config->shared_queues) {
+			iface->queue_count = port_config->shared_queues;
+		}
+		iface->max_qp = URDMA_MAX_SHARED_QP;
 	}
 
 	/* TODO: Do performance testing to determine optimal descriptor
@@ -743,6 +855,10 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	if (iface->rx_desc_count > RX_DESC_COUNT_MAX) {
 		iface->rx_desc_count = RX_DESC_COUNT_MAX;
 	}
+	if (port_config->rx_desc_count
+			&& port_config->rx_desc_count < iface->rx_desc_count) {
+		iface->rx_desc_count = port_config->rx_desc_count;
+	}
 	fprintf(stderr, "rx_desc_count %" PRIu16 "\n", iface->rx_desc_count);
 	iface->tx_desc_count = iface->dev_info.tx_desc_lim.nb_max;
 	if (iface->tx_desc_count > TX_DESC_COUNT_MAX) {
@@ -757,43 +873,83 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		rte_exit(EXIT_FAILURE, "Cannot allocate QP array: %s\n",
 				rte_strerror(rte_errno));
 	}
+	if (iface->flags & port_shared_queues) {
+		iface->queues = rte_calloc("urdma_queue",
+				iface->queue_count + 1,
+				sizeof(*iface->queues), 0);
+		if (!iface->queues) {
+			rte_exit(EXIT_FAILURE, "Cannot allocate queue array: %s\n",
+					rte_strerror(rte_errno));
+		}
+	}
 	for (q = 1; q <= iface->max_qp; ++q) {
 		iface->qp[q].qp_id = q;
-		iface->qp[q].tx_queue = q;
-		iface->qp[q].rx_queue = q;
+		if (iface->flags & port_shared_queues) {
+			/* Assigned by assign_shared_queue() */
+			iface->qp[q].flags = urdmad_qp_shared_queue;
+		} else {
+			iface->qp[q].tx_queue = q;
+			iface->qp[q].rx_queue = q;
+		}
 		atomic_init(&iface->qp[q].conn_state, 0);
 		rte_spinlock_init(&iface->qp[q].conn_event_lock);
 		LIST_INSERT_HEAD(&iface->avail_qp, &iface->qp[q],
 				urdmad__entry);
 	}
 
+	mbuf_count = 2 * iface->queue_count * iface->rx_desc_count;
+	if (iface->flags & port_shared_queues) {
+		/* Queue pairs on a shared queue divide its receive credits
+		 * among themselves, but each may always have one datagram in
+		 * flight */
+		mbuf_count += iface->max_qp;
+	}
 	snprintf(name, RTE_MEMPOOL_NAMESIZE,
 			"port_%u_rx_mempool", iface->portid);
-	iface->rx_mempool = rte_pktmbuf_pool_create(name,
-		2 * iface->max_qp * iface->rx_desc_count,
-		0, 0, RTE_PKTMBUF_HEADROOM + port_config->mtu, socket_id);
+	iface->rx_mempool = rte_pktmbuf_pool_create(name, mbuf_count,
+		mempool_cache_size(mbuf_count), 0,
+		RTE_PKTMBUF_HEADROOM + port_config->mtu, socket_id);
 	if (iface->rx_mempool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create rx mempool with %u mbufs: %s\n",
-				2 * iface->max_qp * iface->rx_desc_count,
-				rte_strerror(rte_errno));
+				mbuf_count, rte_strerror(rte_errno));
 
+	/* These hold the DDP segments waiting in tx_pending to be
+	 * acknowledged; each is chained behind a fresh tx_hdr_mempool mbuf
+	 * whenever it is (re)transmitted. */
+	mbuf_count = 2 * iface->queue_count * iface->tx_desc_count;
 	snprintf(name, RTE_MEMPOOL_NAMESIZE,
 			"port_%u_tx_mempool", iface->portid);
-	iface->tx_ddp_mempool = rte_pktmbuf_pool_create(name,
-		2 * iface->max_qp * iface->tx_desc_count,
-		0, PENDING_DATAGRAM_INFO_SIZE,
+	iface->tx_ddp_mempool = rte_pktmbuf_pool_create(name, mbuf_count,
+		mempool_cache_size(mbuf_count), PENDING_DATAGRAM_INFO_SIZE,
 		RTE_PKTMBUF_HEADROOM + port_config->mtu, socket_id);
 	if (iface->tx_ddp_mempool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create tx mempool with %u mbufs: %s\n",
-				2 * iface->max_qp * iface->tx_desc_count,
-				rte_strerror(rte_errno));
+				mbuf_count, rte_strerror(rte_errno));
 
-	/* FIXME: make these actually separate */
-	iface->tx_hdr_mempool = iface->tx_ddp_mempool;
+	/* These hold only a TRP header, or a whole TRP ACK/SACK/FIN packet,
+	 * and live only until the NIC has transmitted them. */
+	snprintf(name, RTE_MEMPOOL_NAMESIZE,
+			"port_%u_tx_hdr_mempool", iface->portid);
+	iface->tx_hdr_mempool = rte_pktmbuf_pool_create(name, mbuf_count,
+		mempool_cache_size(mbuf_count), 0,
+		RTE_PKTMBUF_HEADROOM + TX_HDR_DATA_ROOM, socket_id);
+	if (iface->tx_hdr_mempool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create tx header mempool with %u mbufs: %s\n",
+				mbuf_count, rte_strerror(rte_errno));
+
+	/* These mbufs have no data room of their own; liburdma points them at
+	 * user payloads in hugepage memory to transmit without copying. */
+	snprintf(name, RTE_MEMPOOL_NAMESIZE,
+			"port_%u_tx_ext_mempool", iface->portid);
+	iface->tx_ext_mempool = rte_pktmbuf_pool_create(name, mbuf_count,
+		mempool_cache_size(mbuf_count), 0, 0, socket_id);
+	if (iface->tx_ext_mempool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create tx external data mempool with %u mbufs: %s\n",
+				mbuf_count, rte_strerror(rte_errno));
 
 	/* Configure the Ethernet device. */
-	retval = rte_eth_dev_configure(iface->portid, iface->max_qp + 1,
-			iface->max_qp + 1, &port_conf);
+	retval = rte_eth_dev_configure(iface->portid, iface->queue_count + 1,
+			iface->queue_count + 1, &port_conf);
 	if (retval != 0)
 		return retval;
 
@@ -808,7 +964,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	/* Data RX queue startup is deferred */
 	memcpy(&rxconf, &iface->dev_info.default_rxconf, sizeof(rxconf));
 	rxconf.rx_deferred_start = 1;
-	for (q = 1; q <= iface->max_qp; q++) {
+	for (q = 1; q <= iface->queue_count; q++) {
 		retval = rte_eth_rx_queue_setup(iface->portid, q,
 				iface->rx_desc_count, socket_id, &rxconf,
 				iface->rx_mempool);
@@ -834,7 +990,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		txconf.txq_flags |= ETH_TXQ_FLAGS_NOXSUMUDP;
 	}
 	txconf.tx_deferred_start = 1;
-	for (q = 1; q <= iface->max_qp; q++) {
+	for (q = 1; q <= iface->queue_count; q++) {
 		retval = rte_eth_tx_queue_setup(iface->portid, q,
 				iface->tx_desc_count, socket_id, &txconf);
 		if (retval < 0)
@@ -0,0 +1,143 @@
+/* cksum.c */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "cksum.h"
+
+
+static inline uint16_t
+fold64(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	return cksum_fold(sum);
+} /* fold64 */
+
+
+/* Since 2^16 == 1 modulo 2^16 - 1, the one's complement sum of 16-bit words
+ * can be computed by summing whole 32-bit words into a 64-bit accumulator and
+ * folding at the end.  The vector loops zero-extend each 32-bit lane into a
+ * 64-bit lane so that the accumulators never overflow.  The caller's copy flag
+ * is a constant, so the compiler generates separate copy and sum-only
+ * loops. */
+static inline uint16_t
+do_cksum(char *restrict dest, const char *restrict src, size_t len,
+		bool copy)
+{
+	uint64_t sum = 0, tail;
+	uint32_t word;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, v;
+
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (copy) {
+			_mm256_storeu_si256((__m256i *)(dest + i), v);
+		}
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+	}
+	acc0 = _mm256_add_epi64(acc0, acc1);
+	sum += (uint64_t)_mm256_extract_epi64(acc0, 0)
+		+ (uint64_t)_mm256_extract_epi64(acc0, 1)
+		+ (uint64_t)_mm256_extract_epi64(acc0, 2)
+		+ (uint64_t)_mm256_extract_epi64(acc0, 3);
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, v;
+	uint64_t lanes[2];
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		if (copy) {
+			_mm_storeu_si128((__m128i *)(dest + i), v);
+		}
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+	sum += lanes[0] + lanes[1];
+#endif
+
+	for (; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, src + i, sizeof(word));
+		if (copy) {
+			memcpy(dest + i, &word, sizeof(word));
+		}
+		sum += word;
+	}
+
+	/* Zero padding the last 1-3 bytes leaves them in the same position
+	 * within their 16-bit words as rte_raw_cksum() puts them */
+	if (i < len) {
+		tail = 0;
+		memcpy(&tail, src + i, len - i);
+		if (copy) {
+			memcpy(dest + i, src + i, len - i);
+		}
+		sum += (tail >> 32) + (tail & 0xffffffff);
+	}
+
+	return fold64(sum);
+} /* do_cksum */
+
+
+uint16_t
+cksum_copy(void *restrict dest, const void *restrict src, size_t len)
+{
+	return do_cksum(dest, src, len, true);
+} /* cksum_copy */
+
+
+uint16_t
+cksum_raw(const void *buf, size_t len)
+{
+	return do_cksum(NULL, buf, len, false);
+} /* cksum_raw */
@@ -0,0 +1,87 @@
+/* cksum.h */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Internet checksum (RFC 1071) routines that compute the checksum of a buffer
+ * while copying it, so that building a DDP segment for a NIC without checksum
+ * offload only reads the payload once.  The AVX2 or SSE2 versions are used if
+ * the compiler targets them, with a portable fallback.
+ *
+ * All sums are raw: neither folded to the complement nor byte swapped, and
+ * identical to the result of rte_raw_cksum() on the same buffer. */
+
+#ifndef CKSUM_H
+#define CKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Copies len bytes from src to dest, which must not overlap, and returns the
+ * raw checksum of the copied bytes. */
+uint16_t
+cksum_copy(void *restrict dest, const void *restrict src, size_t len);
+
+/** Returns the raw checksum of the len bytes at buf. */
+uint16_t
+cksum_raw(const void *buf, size_t len);
+
+/** Adds the raw checksum of a buffer that starts at the given byte offset
+ * within a packet to the running 32-bit sum of the preceding buffers. */
+static inline uint32_t
+cksum_add(uint32_t sum, uint16_t cksum, size_t offset)
+{
+	/* A buffer starting at an odd offset has its bytes swapped relative to
+	 * the 16-bit words of the packet */
+	if (offset & 1) {
+		cksum = (cksum << 8) | (cksum >> 8);
+	}
+	return sum + cksum;
+} /* cksum_add */
+
+/** Folds the carry bits of a 32-bit one's complement sum into 16 bits. */
+static inline uint16_t
+cksum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+	return sum;
+} /* cksum_fold */
+
+#endif
@@ -43,6 +43,7 @@
 
 #define _GNU_SOURCE
 
+#include <limits.h>
 #include <stddef.h>
 
 #include <linkhash.h>
@@ -63,7 +64,8 @@ int
 urdma__config_file_get_ports(struct usiw_config *config,
 			     struct usiw_port_config **port_config)
 {
-	struct json_object *ports, *port, *ipv4, *mtu;
+	struct json_object *ports, *port, *ipv4, *mtu, *rx_desc_count;
+	struct json_object *rx_interrupts, *shared_queues;
 	int port_count, i;
 
 	if (!json_object_object_get_ex(config->root, "ports", &ports)) {
@@ -117,6 +119,46 @@ urdma__config_file_get_ports(struct usiw_config *config,
 		} else {
 			(*port_config)[i].mtu = DEFAULT_MTU;
 		}
+
+		if (json_object_object_get_ex(port, "rx_desc_count",
+							&rx_desc_count)) {
+			if (!json_object_is_type(rx_desc_count, json_type_int)) {
+				fprintf(stderr, "Configuration error: port %d rx_desc_count is not integer\n", i);
+				return -EINVAL;
+			}
+			(*port_config)[i].rx_desc_count
+				= json_object_get_int(rx_desc_count);
+			if ((*port_config)[i].rx_desc_count < 2
+					|| ((*port_config)[i].rx_desc_count
+					& ((*port_config)[i].rx_desc_count - 1))) {
+				fprintf(stderr, "Configuration error: port %d rx_desc_count %u invalid; expected a power of 2\n",
+						i, (*port_config)[i].rx_desc_count);
+				return -EINVAL;
+			}
+		}
+
+		if (json_object_object_get_ex(port, "rx_interrupts",
+							&rx_interrupts)) {
+			if (!json_object_is_type(rx_interrupts,
+							json_type_boolean)) {
+				fprintf(stderr, "Configuration error: port %d rx_interrupts is not boolean\n", i);
+				return -EINVAL;
+			}
+			(*port_config)[i].rx_interrupts
+				= json_object_get_boolean(rx_interrupts);
+		}
+
+		if (json_object_object_get_ex(port, "shared_queues",
+							&shared_queues)) {
+			if (!json_object_is_type(shared_queues, json_type_int)
+					|| json_object_get_int(shared_queues)
+					< 0) {
+				fprintf(stderr, "Configuration error: port %d shared_queues is not a non-negative integer\n", i);
+				return -EINVAL;
+			}
+			(*port_config)[i].shared_queues
+				= json_object_get_int(shared_queues);
+		}
 	}
 
 	return port_count;
@@ -286,6 +328,39 @@ urdma__config_file_get_sock_name(struct usiw_config *config)
 } /* urdma__config_file_get_sock_name */
 
 
+/** Looks up an optional non-negative integer tunable in the root object of the
+ * configuration file.  Returns 0 and sets *value if the field is present,
+ * -ENOENT if the field is absent (leaving *value untouched so that the caller
+ * may pre-load a default), or -EINVAL if the field is not a valid integer. */
+int
+urdma__config_file_get_uint(struct usiw_config *config, const char *name,
+			    unsigned int *value)
+{
+	struct json_object *field;
+	int64_t tmp;
+
+	if (!json_object_object_get_ex(config->root, name, &field)) {
+		return -ENOENT;
+	}
+
+	if (!json_object_is_type(field, json_type_int)) {
+		fprintf(stderr, "Configuration error: \"%s\" field is not an integer\n",
+				name);
+		return -EINVAL;
+	}
+
+	tmp = json_object_get_int64(field);
+	if (tmp < 0 || tmp > UINT_MAX) {
+		fprintf(stderr, "Configuration error: \"%s\" value %" PRId64 " out of range\n",
+				name, tmp);
+		return -EINVAL;
+	}
+
+	*value = tmp;
+	return 0;
+} /* urdma__config_file_get_uint */
+
+
 /** Parses the given JSON configuration file for the IPv4 addresses to assign
  * to each interface.  An example configuration file looks like:
  *
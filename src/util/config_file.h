@@ -37,6 +37,7 @@
  * SOFTWARE.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 
 enum { ipv4_addr_len_max = 20 };
@@ -45,6 +46,16 @@ struct json_object;
 
 struct usiw_port_config {
 	unsigned int mtu;
+	unsigned int rx_desc_count;
+		/**< Maximum number of receive descriptors per queue, or 0 to
+		 * use the largest number that the device supports. */
+	bool rx_interrupts;
+		/**< If true, configure the port so that idle progress lcores
+		 * can sleep until a packet arrives on one of their receive
+		 * queues. */
+	unsigned int shared_queues;
+		/**< If nonzero, queue pairs share this many hardware queue
+		 * pairs instead of each using its own. */
 	char ipv4_address[ipv4_addr_len_max];
 };
 
@@ -62,6 +73,10 @@ urdma__config_file_get_eal_args(struct usiw_config *config, char **argv);
 char *
 urdma__config_file_get_sock_name(struct usiw_config *config);
 
+int
+urdma__config_file_get_uint(struct usiw_config *config, const char *name,
+			    unsigned int *value);
+
 int
 urdma__config_file_open(struct usiw_config *config);
 
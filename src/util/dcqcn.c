@@ -0,0 +1,176 @@
+/* dcqcn.c */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "dcqcn.h"
+
+/* Limits the work of catching up on alpha after a long idle period; alpha has
+ * decayed to almost nothing by then anyway */
+#define DCQCN_ALPHA_DECAY_MAX 2048
+
+
+void
+dcqcn_init(struct dcqcn *cc, const struct dcqcn_params *params, uint64_t now)
+{
+	cc->current_rate = cc->target_rate = params->line_rate;
+	cc->alpha = DCQCN_ALPHA_ONE;
+	cc->timer_stage = cc->byte_stage = 0;
+	cc->bytes = 0;
+	cc->last_decrease = now - params->decrease_period;
+	cc->alpha_deadline = now + params->alpha_period;
+	cc->increase_deadline = now + params->increase_period;
+	cc->notified = false;
+} /* dcqcn_init */
+
+
+/** Raises the rate after timer_stage or byte_stage has advanced: halfway to
+ * the target rate, after raising the target itself unless both stages are
+ * still in fast recovery. */
+static void
+dcqcn_increase(struct dcqcn *cc, const struct dcqcn_params *params)
+{
+	unsigned int min_stage, max_stage;
+	uint64_t target;
+
+	if (cc->timer_stage < cc->byte_stage) {
+		min_stage = cc->timer_stage;
+		max_stage = cc->byte_stage;
+	} else {
+		min_stage = cc->byte_stage;
+		max_stage = cc->timer_stage;
+	}
+
+	target = cc->target_rate;
+	if (min_stage > params->fast_recovery_stages) {
+		target += (uint64_t)params->hyper_increase
+			* (min_stage - params->fast_recovery_stages);
+	} else if (max_stage > params->fast_recovery_stages) {
+		target += params->additive_increase;
+	}
+	if (target > params->line_rate) {
+		target = params->line_rate;
+	}
+	cc->target_rate = target;
+	/* Round up so that the rate reaches the target */
+	cc->current_rate = ((uint64_t)cc->target_rate + cc->current_rate + 1)
+		/ 2;
+} /* dcqcn_increase */
+
+
+bool
+dcqcn_notify(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t now)
+{
+	uint32_t old_rate;
+	uint64_t cut;
+
+	cc->notified = true;
+	cc->alpha = cc->alpha - (cc->alpha >> DCQCN_G_SHIFT)
+		+ (DCQCN_ALPHA_ONE >> DCQCN_G_SHIFT);
+	if (now - cc->last_decrease < params->decrease_period) {
+		return false;
+	}
+
+	old_rate = cc->current_rate;
+	cc->last_decrease = now;
+	cc->target_rate = cc->current_rate;
+	cut = ((uint64_t)cc->current_rate * cc->alpha) / (2 * DCQCN_ALPHA_ONE);
+	cc->current_rate -= cut;
+	if (cc->current_rate < params->min_rate) {
+		cc->current_rate = params->min_rate;
+	}
+	cc->timer_stage = cc->byte_stage = 0;
+	cc->bytes = 0;
+	cc->increase_deadline = now + params->increase_period;
+	return cc->current_rate != old_rate;
+} /* dcqcn_notify */
+
+
+bool
+dcqcn_sent(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t bytes)
+{
+	if (cc->current_rate >= params->line_rate) {
+		return false;
+	}
+	cc->bytes += bytes;
+	if (cc->bytes < params->byte_counter) {
+		return false;
+	}
+	cc->bytes = 0;
+	cc->byte_stage++;
+	dcqcn_increase(cc, params);
+	return true;
+} /* dcqcn_sent */
+
+
+bool
+dcqcn_tick(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t now)
+{
+	uint64_t periods;
+
+	if ((int64_t)(now - cc->alpha_deadline) >= 0) {
+		periods = (now - cc->alpha_deadline) / params->alpha_period + 1;
+		if (cc->notified) {
+			/* The first period saw a notification */
+			periods--;
+		}
+		if (periods > DCQCN_ALPHA_DECAY_MAX) {
+			periods = DCQCN_ALPHA_DECAY_MAX;
+		}
+		while (periods--) {
+			cc->alpha -= cc->alpha >> DCQCN_G_SHIFT;
+		}
+		cc->notified = false;
+		cc->alpha_deadline = now + params->alpha_period;
+	}
+
+	if ((int64_t)(now - cc->increase_deadline) < 0) {
+		return false;
+	}
+	cc->increase_deadline = now + params->increase_period;
+	if (cc->current_rate >= params->line_rate) {
+		return false;
+	}
+	cc->timer_stage++;
+	dcqcn_increase(cc, params);
+	return true;
+} /* dcqcn_tick */
@@ -0,0 +1,138 @@
+/* dcqcn.h */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Sender rate control driven by ECN congestion notifications, following
+ * DCQCN (Zhu et al., "Congestion Control for Large-Scale RDMA Deployments",
+ * SIGCOMM 2015).  Each congestion notification cuts the current rate in
+ * proportion to alpha, an estimate of how often the path is congested; the
+ * rate then climbs back towards the rate it was cut from (fast recovery), and
+ * beyond it by fixed steps (additive and hyper increase), once per timer
+ * period and once per byte_counter bytes sent.
+ *
+ * Time is measured in the caller's units, for example TSC cycles, and rates
+ * in Mbit/s.  The state is not thread-safe. */
+
+#ifndef DCQCN_H
+#define DCQCN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* alpha is a fixed-point number in [0, DCQCN_ALPHA_ONE] */
+#define DCQCN_ALPHA_ONE (1 << 20)
+/* alpha gain g = 1 / (1 << DCQCN_G_SHIFT) */
+#define DCQCN_G_SHIFT 8
+
+/* Parameter values suggested by the DCQCN paper for 40 Gbit/s links */
+#define DCQCN_MIN_RATE_MBPS 100
+#define DCQCN_ADDITIVE_INCREASE_MBPS 40
+#define DCQCN_HYPER_INCREASE_MBPS 200
+#define DCQCN_FAST_RECOVERY_STAGES 5
+#define DCQCN_BYTE_COUNTER (10 * 1024 * 1024)
+#define DCQCN_INCREASE_PERIOD_US 55
+#define DCQCN_ALPHA_PERIOD_US 55
+#define DCQCN_DECREASE_PERIOD_US 50
+
+struct dcqcn_params {
+	uint32_t line_rate;
+		/**< Rate at which a flow starts, and which it never exceeds. */
+	uint32_t min_rate;
+		/**< Rate below which congestion notifications do not push a
+		 * flow. */
+	uint32_t additive_increase;
+		/**< Step by which the target rate grows in additive increase. */
+	uint32_t hyper_increase;
+		/**< Step by which the target rate grows in hyper increase,
+		 * multiplied by the number of stages spent there. */
+	unsigned int fast_recovery_stages;
+		/**< Number of increase stages spent in fast recovery before
+		 * additive increase starts. */
+	uint64_t byte_counter;
+		/**< Number of bytes sent that make up one increase stage. */
+	uint64_t increase_period;
+		/**< Time that makes up one increase stage. */
+	uint64_t alpha_period;
+		/**< alpha decays once per period without a congestion
+		 * notification. */
+	uint64_t decrease_period;
+		/**< Minimum time between two rate cuts; further notifications
+		 * only update alpha. */
+};
+
+struct dcqcn {
+	uint32_t current_rate;
+	uint32_t target_rate;
+	uint32_t alpha;
+	unsigned int timer_stage;
+	unsigned int byte_stage;
+	uint64_t bytes;
+		/**< Bytes sent since the last byte counter stage. */
+	uint64_t last_decrease;
+	uint64_t alpha_deadline;
+	uint64_t increase_deadline;
+	bool notified;
+		/**< Set if a congestion notification arrived during the current
+		 * alpha period. */
+};
+
+/** Starts a flow at the line rate with alpha at 1. */
+void
+dcqcn_init(struct dcqcn *cc, const struct dcqcn_params *params, uint64_t now);
+
+/** Handles a congestion notification from the receiver.  Returns true if
+ * current_rate changed. */
+bool
+dcqcn_notify(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t now);
+
+/** Accounts for bytes sent by the flow.  Returns true if current_rate
+ * changed. */
+bool
+dcqcn_sent(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t bytes);
+
+/** Runs the alpha and rate increase timers up to now.  Returns true if
+ * current_rate changed. */
+bool
+dcqcn_tick(struct dcqcn *cc, const struct dcqcn_params *params,
+		uint64_t now);
+
+#endif
@@ -0,0 +1,177 @@
+/* timer_wheel.c */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "timer_wheel.h"
+
+
+static void
+timer_wheel_insert(struct timer_wheel *wheel, struct timer_wheel_entry *timer)
+{
+	uint64_t tick;
+
+	tick = timer->deadline / wheel->tick;
+	if (tick < wheel->next_tick) {
+		tick = wheel->next_tick;
+	}
+	if (tick - wheel->next_tick < TIMER_WHEEL_SLOTS) {
+		LIST_INSERT_HEAD(&wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)],
+				timer, entry);
+	} else {
+		LIST_INSERT_HEAD(&wheel->laps[(tick / TIMER_WHEEL_SLOTS)
+					& (TIMER_WHEEL_SLOTS - 1)],
+				timer, entry);
+	}
+} /* timer_wheel_insert */
+
+
+/** Moves the timers in the lap slot at index whose tick is before end (if
+ * whole_lap is false) or in the same lap as end (if whole_lap is true) into
+ * the slot for their tick. */
+static void
+timer_wheel_cascade(struct timer_wheel *wheel, unsigned int index,
+		uint64_t end, bool whole_lap)
+{
+	struct timer_wheel_entry *timer, *next;
+	uint64_t tick;
+
+	for (timer = wheel->laps[index].lh_first; timer != NULL;
+			timer = next) {
+		next = timer->entry.le_next;
+		tick = timer->deadline / wheel->tick;
+		if (whole_lap ? tick / TIMER_WHEEL_SLOTS
+					!= end / TIMER_WHEEL_SLOTS
+				: tick >= end) {
+			/* Due on a later trip around the lap slots */
+			continue;
+		}
+		LIST_REMOVE(timer, entry);
+		LIST_INSERT_HEAD(&wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)],
+				timer, entry);
+	}
+} /* timer_wheel_cascade */
+
+
+void
+timer_wheel_init(struct timer_wheel *wheel, uint64_t tick, uint64_t now)
+{
+	unsigned int i;
+
+	wheel->tick = tick ? tick : 1;
+	wheel->next_tick = now / wheel->tick;
+	for (i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+		LIST_INIT(&wheel->slots[i]);
+		LIST_INIT(&wheel->laps[i]);
+	}
+} /* timer_wheel_init */
+
+
+void
+timer_wheel_arm(struct timer_wheel *wheel, struct timer_wheel_entry *timer,
+		uint64_t deadline)
+{
+	timer_wheel_cancel(timer);
+	timer->deadline = deadline;
+	timer_wheel_insert(wheel, timer);
+} /* timer_wheel_arm */
+
+
+unsigned int
+timer_wheel_expire(struct timer_wheel *wheel, uint64_t now,
+		timer_wheel_cb cb, void *arg)
+{
+	struct timer_wheel_slot expiring;
+	struct timer_wheel_entry *timer;
+	uint64_t tick, now_tick;
+	unsigned int count, i;
+
+	now_tick = now / wheel->tick;
+	tick = wheel->next_tick;
+	if (now_tick <= tick) {
+		return 0;
+	}
+	/* Visiting each slot once is enough to catch every timer that is due,
+	 * no matter how long it has been since the last call, once the timers
+	 * of every lap that is skipped have been moved into the slots */
+	if (now_tick - tick > TIMER_WHEEL_SLOTS) {
+		tick = now_tick - TIMER_WHEEL_SLOTS;
+		for (i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+			timer_wheel_cascade(wheel, i, now_tick, false);
+		}
+	}
+
+	count = 0;
+	for (; tick < now_tick; ++tick) {
+		if ((tick & (TIMER_WHEEL_SLOTS - 1)) == 0) {
+			timer_wheel_cascade(wheel, (tick / TIMER_WHEEL_SLOTS)
+					& (TIMER_WHEEL_SLOTS - 1), tick, true);
+		}
+
+		/* A timer that the callback re-arms with a deadline at or
+		 * before this tick must go into a slot that is still ahead of
+		 * us, not into one that this pass has already visited */
+		wheel->next_tick = tick + 1;
+
+		/* Detach the slot so that timers re-armed by the callback are
+		 * not visited again on this pass */
+		expiring = wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+		LIST_INIT(&wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)]);
+		if (expiring.lh_first) {
+			expiring.lh_first->entry.le_prev = &expiring.lh_first;
+		}
+
+		while ((timer = expiring.lh_first) != NULL) {
+			LIST_REMOVE(timer, entry);
+			if (timer->deadline / wheel->tick > tick) {
+				/* Due on a later trip around the wheel */
+				LIST_INSERT_HEAD(&wheel->slots[tick
+						& (TIMER_WHEEL_SLOTS - 1)],
+						timer, entry);
+				continue;
+			}
+			timer->entry.le_prev = NULL;
+			count++;
+			cb(timer, arg);
+		}
+	}
+	wheel->next_tick = now_tick;
+
+	return count;
+} /* timer_wheel_expire */
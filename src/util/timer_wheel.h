@@ -0,0 +1,133 @@
+/* timer_wheel.h */
+
+/*
+ * Userspace Software iWARP library for DPDK
+ *
+ * Authors: Patrick MacArthur <pam@zurich.ibm.com>
+ *
+ * Copyright (c) 2016, IBM Corporation
+ * Copyright (c) 2016, University of New Hampshire
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   - Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   - Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *   - Neither the name of IBM nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A two-level timing wheel for timers keyed by a monotonic cycle counter such
+ * as the TSC.  Each slot covers one tick; a timer due within the next
+ * TIMER_WHEEL_SLOTS ticks is kept in slot (d / tick) % TIMER_WHEEL_SLOTS of
+ * slots and fires once that tick has passed.  Later timers are kept in the
+ * laps slot of the TIMER_WHEEL_SLOTS-tick lap in which they are due, and are
+ * moved to slots when that lap begins.  Timers more than TIMER_WHEEL_SLOTS
+ * laps in the future wrap around and are skipped when their lap slot is
+ * visited early.  Expiring timers thus costs O(slots passed + timers expired),
+ * and each timer is moved at most once before it fires, for deadlines up to
+ * TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS ticks ahead. */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* MUST be a power of 2 */
+#define TIMER_WHEEL_SLOTS 256
+
+struct timer_wheel_entry {
+	LIST_ENTRY(timer_wheel_entry) entry;
+	uint64_t deadline;
+};
+
+LIST_HEAD(timer_wheel_slot, timer_wheel_entry);
+
+struct timer_wheel {
+	uint64_t tick;
+		/**< Number of cycles covered by each slot. */
+	uint64_t next_tick;
+		/**< The first tick whose slot has not yet been expired.  While
+		 * timer_wheel_expire() is running, the tick after the one it is
+		 * expiring. */
+	struct timer_wheel_slot slots[TIMER_WHEEL_SLOTS];
+		/**< Timers due less than TIMER_WHEEL_SLOTS ticks after
+		 * next_tick, by tick. */
+	struct timer_wheel_slot laps[TIMER_WHEEL_SLOTS];
+		/**< All other timers, by the lap of TIMER_WHEEL_SLOTS ticks in
+		 * which they are due. */
+};
+
+/** Called for each expired timer.  The entry is no longer armed when this is
+ * called, and the callback may re-arm it. */
+typedef void (*timer_wheel_cb)(struct timer_wheel_entry *timer, void *arg);
+
+/** Initializes an empty timer wheel whose slots are tick cycles long, with
+ * the current time now. */
+void
+timer_wheel_init(struct timer_wheel *wheel, uint64_t tick, uint64_t now);
+
+/** Arms the timer to expire at the given deadline, first disarming it if it
+ * was already armed.  A deadline in the past expires on the next call to
+ * timer_wheel_expire(), or, when the timer is re-armed from its callback,
+ * possibly later during the same call. */
+void
+timer_wheel_arm(struct timer_wheel *wheel, struct timer_wheel_entry *timer,
+		uint64_t deadline);
+
+/** Expires all timers whose tick has passed as of now, invoking cb on each.
+ * Returns the number of timers expired. */
+unsigned int
+timer_wheel_expire(struct timer_wheel *wheel, uint64_t now,
+		timer_wheel_cb cb, void *arg);
+
+/** Marks a timer entry as not armed.  This must be called on each entry
+ * before it is first passed to timer_wheel_arm(). */
+static inline void
+timer_wheel_entry_init(struct timer_wheel_entry *timer)
+{
+	timer->entry.le_prev = NULL;
+} /* timer_wheel_entry_init */
+
+static inline bool
+timer_wheel_entry_armed(struct timer_wheel_entry *timer)
+{
+	return timer->entry.le_prev != NULL;
+} /* timer_wheel_entry_armed */
+
+/** Disarms the timer if it is armed. */
+static inline void
+timer_wheel_cancel(struct timer_wheel_entry *timer)
+{
+	if (timer_wheel_entry_armed(timer)) {
+		LIST_REMOVE(timer, entry);
+		timer->entry.le_prev = NULL;
+	}
+} /* timer_wheel_cancel */
+
+#endif
@@ -39,10 +39,12 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include <rte_ethdev.h>
+#include <rte_mbuf.h>
 
 #ifdef NDEBUG
 #define NDEBUG_UNUSED __attribute__((unused))
@@ -56,4 +58,21 @@ parse_ipv4_address(const char *str, uint32_t *address, int *prefix_len);
 void
 port_dump_info(FILE *stream, struct rte_eth_dev_info *info);
 
+/** Appends the mbuf chain tail to the mbuf chain head, like
+ * rte_pktmbuf_chain(), but without modifying tail.  rte_pktmbuf_chain() sets
+ * the pkt_len of tail to that of its first segment, which breaks a
+ * multi-segment tail that is linked behind a new head for each
+ * transmission. */
+static inline int
+pktmbuf_chain_shared(struct rte_mbuf *head, struct rte_mbuf *tail)
+{
+	if (head->nb_segs + tail->nb_segs >= 1 << (sizeof(head->nb_segs) * 8)) {
+		return -EOVERFLOW;
+	}
+	rte_pktmbuf_lastseg(head)->next = tail;
+	head->nb_segs += tail->nb_segs;
+	head->pkt_len += tail->pkt_len;
+	return 0;
+} /* pktmbuf_chain_shared */
+
 #endif
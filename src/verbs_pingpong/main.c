@@ -52,6 +52,7 @@
 #include <libgen.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -78,6 +79,7 @@
 #define PACKET_MAX_LEN 1073741824
 
 #define MAX_BURST_SIZE 512
+#define MAX_RX_BURST_SIZE 64
 
 #define BASE_UDP_PORT 10000
 
@@ -87,6 +89,12 @@ static struct app_options {
 	unsigned long burst_size;
 	unsigned int lcore_count;
 	bool large_first_burst;
+	bool report_retransmits;
+	bool report_acks;
+	bool report_rx_cycles;
+	bool report_tail_latency;
+	unsigned int rate_limit_mbps;
+	unsigned int rate_limit_burst;
 	FILE *output_file;
 } options = {
 	.packet_count = 1000000,
@@ -95,6 +103,12 @@ static struct app_options {
 	.lcore_count = 1,
 	.output_file = NULL,
 	.large_first_burst = 1,
+	.report_retransmits = 0,
+	.report_acks = 0,
+	.report_rx_cycles = 0,
+	.report_tail_latency = 0,
+	.rate_limit_mbps = 0,
+	.rate_limit_burst = 65536,
 };
 
 struct stats {
@@ -134,6 +148,33 @@ struct stats {
 		 * burst_size, since we try to keep sending messages until we
 		 * receive the first response.  The final value is the MAX
 		 * across all threads. */
+	uintmax_t retransmit_fast;
+	uintmax_t retransmit_timeout;
+		/**< Number of packets that urdma had to retransmit on our
+		 * queue pairs, which should be 0 on a lossless link even if
+		 * the two ends have different numbers of receive
+		 * descriptors.  Only filled in with --report-retransmits.  The
+		 * final value is the SUM across all threads. */
+	uintmax_t ack_pure;
+	uintmax_t ack_piggybacked;
+		/**< Number of acknowledgements that urdma sent on our queue
+		 * pairs in datagrams of their own and on outgoing data.  Only
+		 * filled in with --report-acks.  The final value is the SUM
+		 * across all threads. */
+	size_t rx_max_burst_size;
+	uintmax_t rx_burst_count[MAX_RX_BURST_SIZE + 1];
+	uintmax_t rx_burst_cycles[MAX_RX_BURST_SIZE + 1];
+		/**< The number of bursts of each size that the urdma progress
+		 * engine received on our queue pairs, and the cycles spent
+		 * processing them.  Only filled in with --report-rx-cycles.
+		 * The final value for each bucket is the SUM across all
+		 * threads. */
+	uint64_t *latency_samples;
+	size_t latency_sample_count;
+		/**< Unidirectional latency of every message, in cycles.  Only
+		 * filled in with --report-tail-latency, which timestamps every
+		 * message instead of one in 256.  The final value holds the
+		 * samples of all threads. */
 };
 
 struct pending_transfer {
@@ -207,7 +248,24 @@ qp_init(struct ibv_context *ibctx, int socket_id,
 
 
 static int
-print_stats(FILE *fptr, const struct stats *stats)
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+} /* compare_u64 */
+
+/** Returns the sample below which fraction of the sorted samples fall. */
+static uint64_t
+percentile(const uint64_t *samples, size_t count, double fraction)
+{
+	size_t index = fraction * count;
+
+	return samples[RTE_MIN(index, count - 1)];
+} /* percentile */
+
+static int
+print_stats(FILE *fptr, struct stats *stats)
 {
 	uint64_t elapsed_cycles;
 	double timer_hz, physical_time, cpu_time, poll_time, latency;
@@ -272,12 +330,75 @@ print_stats(FILE *fptr, const struct stats *stats)
 	ret = fprintf(fptr, "  \"latency_unit\": \"microsecond\",\n");
 	if (ret < 0)
 		return ret;
+	if (options.report_tail_latency && stats->latency_sample_count) {
+		qsort(stats->latency_samples, stats->latency_sample_count,
+				sizeof(*stats->latency_samples), compare_u64);
+		ret = fprintf(fptr, "  \"latency_p50\": %.9f,\n",
+				1e6 * percentile(stats->latency_samples,
+					stats->latency_sample_count, 0.5)
+				/ timer_hz);
+		if (ret < 0)
+			return ret;
+		ret = fprintf(fptr, "  \"latency_p99\": %.9f,\n",
+				1e6 * percentile(stats->latency_samples,
+					stats->latency_sample_count, 0.99)
+				/ timer_hz);
+		if (ret < 0)
+			return ret;
+		ret = fprintf(fptr, "  \"latency_p999\": %.9f,\n",
+				1e6 * percentile(stats->latency_samples,
+					stats->latency_sample_count, 0.999)
+				/ timer_hz);
+		if (ret < 0)
+			return ret;
+		ret = fprintf(fptr, "  \"latency_max\": %.9f,\n",
+				1e6 * stats->latency_samples[
+					stats->latency_sample_count - 1]
+				/ timer_hz);
+		if (ret < 0)
+			return ret;
+	}
 	if (stats->first_burst_size) {
 		ret = fprintf(fptr, "  \"first_burst_size\": %lu,\n",
 				stats->first_burst_size);
 		if (ret < 0)
 			return ret;
 	}
+	if (options.report_retransmits) {
+		ret = fprintf(fptr, "  \"retransmit_fast\": %" PRIuMAX ",\n",
+				stats->retransmit_fast);
+		if (ret < 0)
+			return ret;
+		ret = fprintf(fptr, "  \"retransmit_timeout\": %" PRIuMAX ",\n",
+				stats->retransmit_timeout);
+		if (ret < 0)
+			return ret;
+	}
+	if (options.report_acks) {
+		ret = fprintf(fptr, "  \"ack_pure\": %" PRIuMAX ",\n",
+				stats->ack_pure);
+		if (ret < 0)
+			return ret;
+		ret = fprintf(fptr, "  \"ack_piggybacked\": %" PRIuMAX ",\n",
+				stats->ack_piggybacked);
+		if (ret < 0)
+			return ret;
+	}
+	if (options.report_rx_cycles && stats->rx_max_burst_size) {
+		ret = fprintf(fptr, "  \"rx_cycles_per_message\": [");
+		if (ret < 0)
+			return ret;
+		for (x = 1; x <= stats->rx_max_burst_size; ++x) {
+			ret = fprintf(fptr, "%.1f%s",
+				stats->rx_burst_count[x]
+				? (double)stats->rx_burst_cycles[x]
+					/ (x * stats->rx_burst_count[x])
+				: 0.0,
+				(x < stats->rx_max_burst_size) ? ", " : "],\n");
+			if (ret < 0)
+				return ret;
+		}
+	}
 	ret = fprintf(fptr, "  \"wc_count_per_burst_histo\": [");
 	if (ret < 0)
 		return ret;
@@ -356,6 +477,17 @@ wait_cq_bulk(struct stats *stats, struct ibv_cq *cq, struct ibv_wc *wc,
 	return ret;
 } /* wait_recv_bulk */
 
+/** Adds a round trip of roundtrip_cycles to stats. */
+static void
+record_latency(struct stats *stats, uint64_t roundtrip_cycles)
+{
+	stats->latency += roundtrip_cycles;
+	if (stats->latency_samples) {
+		stats->latency_samples[stats->latency_sample_count++]
+			= roundtrip_cycles / 2;
+	}
+} /* record_latency */
+
 static int
 post_recv(struct lcore_param *arg, struct ibv_recv_wr *wr)
 {
@@ -413,8 +545,8 @@ handle_burst(struct lcore_param *arg, struct ibv_wc *wc,
 			pkt_timestamp = (uint64_t *)(pktbuf_addr
 							+ timestamp_offset);
 			if (*pkt_timestamp != 0) {
-				stats->latency += rte_get_timer_cycles()
-					- *pkt_timestamp;
+				record_latency(stats, rte_get_timer_cycles()
+					- *pkt_timestamp);
 				*pkt_timestamp = 0;
 				(*roundtrip_count)++;
 			}
@@ -434,7 +566,8 @@ handle_burst(struct lcore_param *arg, struct ibv_wc *wc,
 				pktbuf_addr = pending->send_sge.addr;
 				pkt_timestamp = (uint64_t *)(pktbuf_addr
 							+ timestamp_offset);
-				if (!((*remaining_send - x) & 255)) {
+				if (options.report_tail_latency
+					|| !((*remaining_send - x) & 255)) {
 					*pkt_timestamp = rte_get_timer_cycles();
 				}
 				ret = post_send(arg, &pending->send_wr);
@@ -505,8 +638,8 @@ handle_last_client_burst(struct ibv_wc *wc,
 			pkt_timestamp = (uint64_t *)(sendbuf_addr
 					+ timestamp_offset);
 			if (*pkt_timestamp != 0) {
-				stats->latency += rte_get_timer_cycles()
-					- *pkt_timestamp;
+				record_latency(stats, rte_get_timer_cycles()
+					- *pkt_timestamp);
 				*pkt_timestamp = 0;
 				(*roundtrip_count)++;
 			}
@@ -601,6 +734,7 @@ do_lcore_work(void *rawarg)
 	struct ibv_wc *wc;
 	struct ibv_qp *qp;
 	struct stats stats;
+	struct urdma_qp_stats qp_stats;
 	struct pending_transfer *pending;
 	uint64_t roundtrip_count;
 	uint64_t poll_cycles;
@@ -628,6 +762,20 @@ do_lcore_work(void *rawarg)
 	remaining_recv = options.packet_count - options.burst_size;
 	stats.latency = 0;
 	stats.first_burst_size = 0;
+	stats.retransmit_fast = 0;
+	stats.retransmit_timeout = 0;
+	stats.ack_pure = 0;
+	stats.ack_piggybacked = 0;
+	stats.rx_max_burst_size = 0;
+	stats.latency_samples = NULL;
+	stats.latency_sample_count = 0;
+	if (options.report_tail_latency) {
+		stats.latency_samples = calloc(options.packet_count,
+				sizeof(*stats.latency_samples));
+		if (!stats.latency_samples) {
+			return EXIT_FAILURE;
+		}
+	}
 	roundtrip_count = 0;
 	pending_active = options.burst_size;
 
@@ -707,6 +855,25 @@ do_lcore_work(void *rawarg)
 	stats.message_count = options.packet_count - remaining_send;
 	stats.latency = (roundtrip_count == 0) ? 0.0
 		: (stats.latency / (2 * roundtrip_count));
+	if (options.report_retransmits) {
+		urdma_query_qp_stats(qp, &qp_stats);
+		stats.retransmit_fast = qp_stats.retransmit_fast;
+		stats.retransmit_timeout = qp_stats.retransmit_timeout;
+	}
+	if (options.report_acks) {
+		urdma_query_qp_stats(qp, &qp_stats);
+		stats.ack_pure = qp_stats.ack_pure;
+		stats.ack_piggybacked = qp_stats.ack_piggybacked;
+	}
+	if (options.report_rx_cycles) {
+		urdma_query_qp_stats(qp, &qp_stats);
+		stats.rx_max_burst_size = RTE_MIN(qp_stats.recv_max_burst_size,
+				MAX_RX_BURST_SIZE);
+		for (x = 0; x <= stats.rx_max_burst_size; ++x) {
+			stats.rx_burst_count[x] = qp_stats.recv_count_histo[x];
+			stats.rx_burst_cycles[x] = qp_stats.recv_cycles_histo[x];
+		}
+	}
 
 	rte_spinlock_lock(arg->lock);
 	arg->final_stats->latency += stats.latency;
@@ -730,8 +897,30 @@ do_lcore_work(void *rawarg)
 	if (stats.first_burst_size > arg->final_stats->first_burst_size) {
 		arg->final_stats->first_burst_size = stats.first_burst_size;
 	}
+	arg->final_stats->retransmit_fast += stats.retransmit_fast;
+	arg->final_stats->retransmit_timeout += stats.retransmit_timeout;
+	arg->final_stats->ack_pure += stats.ack_pure;
+	arg->final_stats->ack_piggybacked += stats.ack_piggybacked;
+	if (stats.rx_max_burst_size > arg->final_stats->rx_max_burst_size) {
+		arg->final_stats->rx_max_burst_size = stats.rx_max_burst_size;
+	}
+	for (x = 0; x <= stats.rx_max_burst_size; ++x) {
+		arg->final_stats->rx_burst_count[x] += stats.rx_burst_count[x];
+		arg->final_stats->rx_burst_cycles[x]
+						+= stats.rx_burst_cycles[x];
+	}
+	if (stats.latency_samples) {
+		memcpy(arg->final_stats->latency_samples
+				+ arg->final_stats->latency_sample_count,
+				stats.latency_samples,
+				stats.latency_sample_count
+				* sizeof(*stats.latency_samples));
+		arg->final_stats->latency_sample_count
+					+= stats.latency_sample_count;
+	}
 	rte_spinlock_unlock(arg->lock);
 
+	free(stats.latency_samples);
 	free(stats.recv_count_histo);
 	pending_transfer_array_free(pending);
 
@@ -763,6 +952,16 @@ static struct option longopts[] = {
 		.flag = NULL, .val = 'o' },
 	{ .name = "disable-large-first-burst", .has_arg = no_argument,
 		.flag = NULL, .val = 'F' },
+	{ .name = "report-retransmits", .has_arg = no_argument,
+		.flag = NULL, .val = 'R' },
+	{ .name = "report-acks", .has_arg = no_argument,
+		.flag = NULL, .val = 'A' },
+	{ .name = "report-rx-cycles", .has_arg = no_argument,
+		.flag = NULL, .val = 'C' },
+	{ .name = "report-tail-latency", .has_arg = no_argument,
+		.flag = NULL, .val = 'T' },
+	{ .name = "rate-limit", .has_arg = required_argument,
+		.flag = NULL, .val = 'L' },
 	{ .name = "help", .has_arg = no_argument, .flag = NULL, .val = 'h' },
 	{ 0 },
 };
@@ -821,6 +1020,11 @@ parse_options(int argc, char *argv[])
 					"s:" /* --packet-size */
 					"b:" /* --burst-size */
 					"F:" /* --disable-large-first-burst */
+					"R" /* --report-retransmits */
+					"A" /* --report-acks */
+					"C" /* --report-rx-cycles */
+					"T" /* --report-tail-latency */
+					"L:" /* --rate-limit */
 					"o:" /* --output */
 					"h" /* --help */
 					, longopts, NULL)) != -1) {
@@ -860,6 +1064,32 @@ parse_options(int argc, char *argv[])
 		case 'F':
 			options.large_first_burst = false;
 			break;
+		case 'R':
+			options.report_retransmits = true;
+			break;
+		case 'A':
+			options.report_acks = true;
+			break;
+		case 'C':
+			options.report_rx_cycles = true;
+			break;
+		case 'T':
+			options.report_tail_latency = true;
+			break;
+		case 'L':
+			/* <Mbit/s>[:<burst bytes>] */
+			errno = 0;
+			options.rate_limit_mbps = strtoul(optarg, &endch, 0);
+			if (errno == 0 && *endch == ':') {
+				options.rate_limit_burst = strtoul(endch + 1,
+						&endch, 0);
+			}
+			if (errno != 0 || *endch != '\0') {
+				rte_exit(EXIT_FAILURE,
+						"Invalid rate limit \"%s\"\n",
+						optarg);
+			}
+			break;
 		case 'h':
 			usage(EXIT_SUCCESS);
 			break;
@@ -1030,6 +1260,15 @@ main(int argc, char *argv[])
 	if (options.lcore_count < 2) {
 		rte_exit(EXIT_FAILURE, "This benchmark requires at least 2 lcores\n");
 	}
+	if (options.report_tail_latency) {
+		final_stats.latency_samples = calloc((options.lcore_count - 1)
+				* options.packet_count,
+				sizeof(*final_stats.latency_samples));
+		if (!final_stats.latency_samples) {
+			rte_exit(EXIT_FAILURE, "Could not allocate latency samples: %s\n",
+					strerror(errno));
+		}
+	}
 	param = calloc(options.lcore_count - 1, sizeof(*param));
 	if (!param) {
 		rte_exit(EXIT_FAILURE, "Could not allocate lcore param: %s\n",
@@ -1044,6 +1283,15 @@ main(int argc, char *argv[])
 		param[x].cm_id = cm_id;
 		param[x].qp = cm_id->qp;
 		param[x].cq = cm_id->send_cq;
+		if (options.rate_limit_mbps) {
+			ret = urdma_set_qp_rate_limit(param[x].qp,
+					options.rate_limit_mbps,
+					options.rate_limit_burst);
+			if (ret) {
+				rte_exit(EXIT_FAILURE, "Could not set rate limit: %s\n",
+						strerror(ret));
+			}
+		}
 
 		param[x].pending = pending_transfer_array_new();
 